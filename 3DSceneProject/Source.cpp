@@ -7,10 +7,53 @@
 // C includes
 #include <cmath>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cfloat>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <random>
+#include <iterator>
 // OpenGL includes
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+
+// Headless runs use a surfaceless EGL context everywhere EGL is available (Mesa llvmpipe
+// on the build farm), Windows falls back to a hidden GLFW window
+#ifndef _WIN32
+#define U_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// The compressed texture cache lives in its own folder, created on first use, and the
+// cooked asset pack is memory mapped
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#define U_MKDIR(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define U_MKDIR(path) mkdir(path, 0755)
+#endif
 // LearnOpenGL includes
 #include <learnOpengl/camera.h>
 
@@ -19,6 +62,13 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtx/euler_angles.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// SSE2 for the batch transform kernels, x64 always has it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define U_HAVE_SSE
+#include <emmintrin.h>
+#endif
 
 // Image processing directives
 #define STB_IMAGE_IMPLEMENTATION
@@ -41,12 +91,85 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // Near and far planes of both projections
+    const float PROJECTION_NEAR = 0.1f;
+    const float PROJECTION_FAR = 100.0f;
+
     // Stores the GL handles for a mesh
     struct GLMesh
     {
         GLuint vao;         // Handle for the vertex array object
         GLuint vbo;     // Handles for the vertex buffer object
-        GLuint nVertices;    // Number of vertices of the mesh
+        GLuint ebo;         // Handle for the element buffer object
+        GLuint nVertices;    // Number of unique vertices of the mesh
+        GLuint nIndices;    // Number of indices drawn
+        GLenum indexType;   // GL_UNSIGNED_SHORT when every index fits, GL_UNSIGNED_INT otherwise
+        GLsizeiptr bufferBytes; // GPU memory held by the mesh's buffers
+    };
+
+    // Every generated mesh uses the same interleaved layout: position, normal, texture coordinates
+    const GLuint FLOATS_PER_VERTEX = 8;
+
+    // The same vertex in half the bytes: position as 16-bit unsigned normalized values across
+    // the mesh's bounds box, normal as signed 10-bit values and texture coordinates as half
+    // floats. The box's offset and scale are folded into the model matrix each draw is given
+    struct QuantizedVertex
+    {
+        GLushort position[4];   // xyz, w unused
+        GLuint normal;          // GL_INT_2_10_10_10_REV, w unused
+        GLushort uv[2];
+    };
+
+    // --verify-quantized passes when the two formats' frames are at least this close
+    const double QUANTIZED_MAX_MEAN_ERROR = 0.5;        // Per channel, out of 255
+    const double QUANTIZED_MAX_CHANGED_SHARE = 0.001;   // Pixels with a channel more than 8 apart
+
+    bool gQuantizedVertices = false;
+    bool gVerifyQuantized = false;
+    bool quantizedKeyPressed = false;
+
+    // Vertex cache sizes: Forsyth's scoring model and the FIFO the ACMR report simulates
+    const int FORSYTH_CACHE_SIZE = 32;
+    const int ACMR_CACHE_SIZE = 16;
+
+    // CPU side geometry handed from the shape generators to the mesh builder
+    struct MeshData
+    {
+        std::vector<GLfloat> vertices;  // FLOATS_PER_VERTEX floats per vertex
+        std::vector<GLuint> indices;    // Triangle list
+    };
+
+    // Read-only view of one mesh's vertices and indices, pointing into a MeshData or
+    // straight into the mapped asset pack
+    struct MeshGeometry
+    {
+        const GLfloat* vertices;
+        GLuint vertexCount;
+        const void* indices;
+        GLuint indexCount;
+        GLenum indexType;
+        const QuantizedVertex* quantized = nullptr;    // Vertices already quantized, else done on upload
+    };
+
+    // Bit pattern of one vertex, used to find exact duplicates
+    struct VertexKey
+    {
+        GLfloat values[FLOATS_PER_VERTEX];
+
+        bool operator==(const VertexKey& other) const { return memcmp(values, other.values, sizeof(values)) == 0; }
+    };
+
+    struct VertexKeyHash
+    {
+        size_t operator()(const VertexKey& key) const
+        {
+            // FNV-1a over the raw bytes
+            const unsigned char* bytes = (const unsigned char*)key.values;
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < sizeof(key.values); ++i)
+                hash = (hash ^ bytes[i]) * 16777619u;
+            return hash;
+        }
     };
 
     enum class PrimitiveShape {
@@ -69,7 +192,89 @@ namespace
         METAL
     };
 
-    // Stores a mesh and transform data
+    // Index of a shared mesh in gMeshRegistry
+    typedef int MeshHandle;
+
+    // Identifies a generated mesh by its shape and the detail its generator was given
+    // (the number of sides for cylinders, 0 for shapes that take no parameter)
+    struct MeshKey
+    {
+        PrimitiveShape shape;
+        int detail;
+
+        bool operator==(const MeshKey& other) const { return shape == other.shape && detail == other.detail; }
+    };
+
+    // Parametric shapes are generated at several levels of detail, level 0 the finest. Each
+    // frame an object picks a level from its projected size, switching only once it has moved
+    // clearly past a threshold so it doesn't flicker between two levels
+    const int LOD_LEVELS = 3;
+    const int CYLINDER_LOD_SIDES[LOD_LEVELS] = { 16, 10, 6 };
+    const float LOD_SWITCH_PIXELS[LOD_LEVELS - 1] = { 24.0f, 8.0f };  // Projected radius below which each coarser level is used
+    const float LOD_HYSTERESIS = 0.2f;      // Share past a threshold an object has to move before it switches
+
+    // Every level of one shape, holding a reference to each so switching never reuploads
+    struct LodChain
+    {
+        MeshKey keys[LOD_LEVELS];
+        MeshHandle meshes[LOD_LEVELS];
+        int levels = 0;
+    };
+
+    struct LodStats
+    {
+        size_t triangles = 0;           // Last frame, as submitted
+        size_t fullTriangles = 0;       // Last frame's objects all at level 0
+        size_t sceneTriangles = 0;      // Every object at level 0
+        size_t levelObjects[LOD_LEVELS] = {};
+        size_t switches = 0;
+        size_t trianglesTotal = 0;
+        size_t fullTrianglesTotal = 0;
+        size_t switchesTotal = 0;
+        double selectMsTotal = 0.0;
+        int frames = 0;
+    };
+
+    std::vector<LodChain> gLodChains;       // By shape
+    std::vector<unsigned char> gObjectLod;  // Level each sceneObjects[] entry is drawn at
+    LodStats gLodStats;
+    bool gLodSelection = true;
+    bool lodKeyPressed = false;
+
+    // Box and sphere around a mesh's vertices, both centred on the box centre
+    struct MeshBounds
+    {
+        glm::vec3 center = glm::vec3(0.0f);
+        float radius = 0.8660254f;          // Unit cube until a mesh says otherwise
+        glm::vec3 extent = glm::vec3(0.5f); // Half size of the box
+    };
+
+    // One uploaded mesh and how many objects are using it
+    struct MeshEntry
+    {
+        MeshKey key;
+        GLMesh mesh;
+        MeshBounds bounds;
+        MeshData data;          // CPU copy of generated geometry, packed into the arena from here
+        int packIndex;          // Mesh in the asset pack instead, -1 when generated
+        int refCount;
+        GLuint arenaFirstIndex; // Where the mesh starts in the arena element buffer
+        GLint arenaBaseVertex;  // Added to every index to reach the mesh's arena vertices
+    };
+
+    // Every distinct mesh is uploaded once and shared by all the objects that use it
+    struct MeshRegistry
+    {
+        std::vector<MeshEntry> entries;     // Slots with refCount 0 are free for reuse
+        int uniqueMeshes = 0;
+        GLsizeiptr bytesResident = 0;
+        int generation = 0;                 // Bumped whenever a mesh is created or destroyed
+    };
+
+    // Stores a mesh and the transform it starts with. The live transform and its
+    // matrices are in gTransforms, at the same index as the object in sceneObjects.
+    // An object with a parent is placed relative to it: it follows the parent's position
+    // and rotation but keeps its own scale, so parts of a stretched body don't get sheared
     struct GLObject
     {
         PrimitiveShape shape;
@@ -78,49 +283,520 @@ namespace
 
         glm::vec2 uvScale;
 
-        glm::mat4 scale;
-        glm::mat4 rotation;
-        glm::mat4 translation;
+        glm::vec3 translation;
+        glm::vec3 rotation;     // Degrees, applied X then Y then Z
+        glm::vec3 scale;
 
-        GLMesh mesh;
+        int32_t parent = -1;    // Index in sceneObjects, always lower than this object's own
+
+        MeshHandle mesh = -1;
 
         GLObject() {};
 
-        GLObject(PrimitiveShape shape_, BasicTexture texture_, glm::vec2 uvScale_, glm::vec3 translation_, glm::vec3 rotation_, glm::vec3 scale_) {
+        GLObject(PrimitiveShape shape_, BasicTexture texture_, glm::vec2 uvScale_, glm::vec3 translation_, glm::vec3 rotation_, glm::vec3 scale_, int32_t parent_ = -1) {
             shape = shape_;
             texture = texture_;
             uvScale = uvScale_;
-            scale = glm::scale(scale_);
-            //rotation = glm::rotate((float)((2 * M_PI) / 360.0f), rotation_);
-            //rotation = glm::rotate(0.f, rotation_);
-            rotation = glm::eulerAngleXYZ(rotation_.x * (M_PI / 180),
-                rotation_.y * (M_PI / 180),
-                rotation_.z * (M_PI / 180));
-            translation = glm::translate(translation_);
+            translation = translation_;
+            rotation = rotation_;
+            scale = scale_;
+            parent = parent_;
         }
+    };
 
-        glm::mat4 GetModelMatrix() {
-            return translation * rotation * scale;
-        }
+    // Upper 3x3 of the inverse transpose of a world matrix, columns padded to vec4 the
+    // way std140 and std430 lay out a mat3
+    struct NormalMatrix
+    {
+        glm::vec4 columns[3];
+    };
+
+    // Object transforms as structure of arrays: position, rotation quaternion and scale
+    // in separate float arrays so the batch update can load four objects per register.
+    // world and normal hold the results, recomputed only for the dirty ranges.
+    // Objects are stored in pre-order, every parent before its children and each subtree
+    // in one contiguous range, so moving an object dirties [index, subtreeEnd[index]) and
+    // updating in index order always finds the parent already done
+    struct TransformStore
+    {
+        std::vector<float> positionX, positionY, positionZ;     // Relative to the parent
+        std::vector<float> rotationX, rotationY, rotationZ, rotationW;
+        std::vector<float> scaleX, scaleY, scaleZ;
+        std::vector<float> worldPositionX, worldPositionY, worldPositionZ;
+        std::vector<float> worldRotationX, worldRotationY, worldRotationZ, worldRotationW;
+        std::vector<int32_t> parent;
+        std::vector<uint32_t> subtreeEnd;
+        std::vector<glm::mat4> world;
+        std::vector<NormalMatrix> normal;
+        std::vector<MeshBounds> localBounds;                    // The object's mesh bounds
+        std::vector<float> boundsX, boundsY, boundsZ, boundsRadius;     // World bounding sphere
+        std::vector<float> extentX, extentY, extentZ;           // World box half size around the same centre
+        std::vector<std::pair<size_t, size_t>> dirtyRanges;   // [first, last) waiting for UUpdateTransforms()
+        std::vector<std::pair<size_t, size_t>> updatedRanges; // What the last update recomputed, merged and sorted
+        size_t updatedLastFrame = 0;
+        size_t updatedTotal = 0;
+        double updateMsTotal = 0.0;
+        int updateCount = 0;
     };
 
+    TransformStore gTransforms;
+
+    // View frustum culling tests every object's world bounds against the six planes of the
+    // current projection and view each frame, only what survives goes into the render queue
+    struct Frustum
+    {
+        glm::vec4 planes[6];    // xyz normal pointing inside, w distance, normals unit length
+    };
+
+    struct CullStats
+    {
+        size_t tested = 0;      // Last frame
+        size_t submitted = 0;
+        size_t testedTotal = 0;
+        size_t submittedTotal = 0;
+        double cullMsTotal = 0.0;
+        int frames = 0;
+    };
+
+    bool gFrustumCulling = true;
+    bool cullKeyPressed = false;
+    std::vector<uint32_t> gVisibleObjects;
+    CullStats gCullStats;
+
+    // Software occlusion culling rasterizes the biggest cubes on screen into a small CPU depth
+    // buffer, four pixels at a time and one screen tile per job, then reduces it into a
+    // hierarchical-Z pyramid where each texel keeps the farthest depth of the four below.
+    // An object is occluded when the nearest corner of its box is behind the farthest
+    // occluder depth over the pyramid texels its screen rectangle touches
+    const int OCCLUSION_WIDTH = 256;
+    const int OCCLUSION_HEIGHT = 192;           // Same 4:3 as the window
+    const int OCCLUSION_TILE_WIDTH = 64;        // Multiple of 4 for the SSE rows
+    const int OCCLUSION_TILE_HEIGHT = 32;
+    const int OCCLUSION_MAX_OCCLUDERS = 64;
+    const float OCCLUDER_MIN_SIZE = 0.1f;       // Bounding radius over distance a cube needs to occlude
+
+    // One occluder triangle after projection, in buffer pixels with window depth
+    struct OcclusionTriangle
+    {
+        float x[3], y[3], z[3];
+        int minX, minY, maxX, maxY;     // Pixel bounds, inclusive
+    };
+
+    struct OcclusionBuffer
+    {
+        std::vector<std::vector<float>> levels;     // Level 0 is the depth buffer, 1 where nothing was drawn
+        std::vector<int> widths, heights;
+        std::vector<OcclusionTriangle> triangles;
+        std::vector<uint32_t> occluders;            // Chosen this frame
+    };
+
+    struct OcclusionStats
+    {
+        size_t tested = 0;      // Last frame
+        size_t occluded = 0;
+        size_t testedTotal = 0;
+        size_t occludedTotal = 0;
+        size_t occludersTotal = 0;
+        double rasterMsTotal = 0.0;
+        double testMsTotal = 0.0;
+        int frames = 0;
+    };
+
+    OcclusionBuffer gOcclusion;
+    OcclusionStats gOcclusionStats;
+    bool gOcclusionCulling = true;
+    bool occlusionKeyPressed = false;
+    bool occlusionDumpKeyPressed = false;
+    const char* gOcclusionDumpFile = nullptr;   // --occlusion-dump, written at the end of a headless run
+
+    // Bounding volume hierarchy over the objects' world boxes for culling, picking and overlap
+    // queries. Nodes have four children whose boxes are stored component by component, so one
+    // SSE test covers a whole node. Built top down with binned SAH splits, subtrees below a
+    // size threshold are built on the thread pool. Moving objects refits the boxes on their
+    // path to the root; once refits have made the tree much worse than it was built, it is
+    // rebuilt
+    const uint32_t BVH_LEAF_SIZE = 4;           // Most objects a leaf slot holds
+    const int BVH_SAH_BINS = 16;
+    const int BVH_MAX_DEPTH = 48;               // Deeper than this splits at the median instead
+    const int BVH_STACK_SIZE = 256;
+    const uint32_t BVH_TASK_MIN = 4096;         // Smaller subtrees aren't worth a job
+    const double BVH_REBUILD_RATIO = 1.5;
+    const uint32_t BVH_NO_HIT = 0xFFFFFFFFu;
+
+    struct BvhNode
+    {
+        float minX[4], minY[4], minZ[4];
+        float maxX[4], maxY[4], maxZ[4];
+        int32_t child[4];       // Inner node index, or ~first for a leaf holding objects[first, first + count)
+        uint32_t count[4];      // Objects under the slot, 0 for an empty slot
+    };                          // 128 bytes, two cache lines
+
+    struct BvhNodes
+    {
+        std::vector<BvhNode> nodes;     // Root first, children always after their parent
+        std::vector<int32_t> parent;
+        std::vector<uint32_t> first;    // Where each node's objects start in Bvh::objects
+    };
+
+    struct Bvh
+    {
+        BvhNodes tree;
+        std::vector<uint32_t> objects;      // Object indices, each subtree's objects contiguous
+        std::vector<uint32_t> objectNode;   // Node whose leaf slot holds each object
+        std::vector<int32_t> dirtyNodes;
+        std::vector<unsigned char> nodeDirty;
+        bool built = false;
+        double cost = 0.0;                  // Slot surface areas summed, leaves weighted by object count
+        double builtCost = 0.0;
+        int builds = 0;
+        int refits = 0;
+        double lastBuildMs = 0.0;
+    };
+
+    // A subtree set aside during the top of a build to be built by a worker
+    struct BvhBuildTask
+    {
+        uint32_t first;
+        uint32_t count;
+        int32_t parent;
+        int slot;
+        int depth;
+        BvhNodes subtree;
+    };
+
+    Bvh gSceneBvh;
+    bool gBvhCulling = true;
+    bool gBvhBenchmark = false;
+
+    // Picking casts a ray from the camera through a screen point into the scene BVH and tests
+    // the exact triangles of each object whose box the ray reaches before the best hit so far
+    struct PickResult
+    {
+        uint32_t object = BVH_NO_HIT;
+        glm::vec3 point = glm::vec3(0.0f);
+        float distance = FLT_MAX;       // World units along the ray
+        uint32_t objectsTested = 0;     // Objects whose triangles were tested
+        uint32_t trianglesTested = 0;
+    };
+
+    int gPickBenchmark = 0;                 // --pick-benchmark, picks cast after a headless run
+    bool gTransformBenchmark = false;
+    int gAnimatedObjects = 0;           // --animate, how many parents slide back and forth
+    float gAnimationTime = 0.0f;
+    const size_t TRANSFORM_BENCHMARK_OBJECTS = 1000000;
+
+    MeshRegistry gMeshRegistry;
+
     // Stores a reference to the main GLFW window
     GLFWwindow* gWindow = nullptr;
 
-    // Stores a handle to the shader program
-    GLuint gProgramId;
+    // Headless benchmark mode, see URunCameraPathBenchmark()
+    bool gHeadless = false;
+    const char* gCameraPathFile = nullptr;
+    int gBenchmarkFrames = 600;
+    const char* gScreenshotFile = nullptr;
+
+    // Offscreen render target used when there is no window to draw into
+    GLuint gOffscreenFbo = 0;
+    GLuint gOffscreenColorRbo = 0;
+    GLuint gOffscreenDepthRbo = 0;
+
+#ifdef U_HAVE_EGL
+    EGLDisplay gEglDisplay = EGL_NO_DISPLAY;
+    EGLContext gEglContext = EGL_NO_CONTEXT;
+#endif
+
+    // One keyframe of a scripted camera path
+    struct CameraKeyframe
+    {
+        glm::vec3 position;
+        float yaw;
+        float pitch;
+        float zoom;
+    };
+
+    // Uniform buffer binding point shared by every program that declares FrameData
+    const GLuint FRAME_DATA_BINDING = 0;
+
+    // A linked shader program plus everything reflected from it at link time
+    struct ShaderProgram
+    {
+        GLuint id = 0;
+        std::unordered_map<std::string, GLint> uniforms;        // Active uniform name -> location
+        std::unordered_map<std::string, GLuint> uniformBlocks;  // Active uniform block name -> index
+
+        // Per-object uniforms the draw loop sets, cached so it never looks them up by string
+        GLint modelLoc = -1;
+        GLint normalMatrixLoc = -1;
+        GLint uvScaleLoc = -1;
+        GLint specIntensityLoc = -1;
+        GLint textureLayerLoc = -1;
+        GLint instancedLoc = -1;
+        GLint multiDrawLoc = -1;
+        GLint gpuCulledLoc = -1;
+
+        // Location of a reflected uniform, -1 if the program does not use it
+        GLint Uniform(const std::string& name) const {
+            auto it = uniforms.find(name);
+            return it != uniforms.end() ? it->second : -1;
+        }
+    };
+
+    // Frame-constant shader inputs, laid out to match the std140 FrameData block.
+    // std140 pads every vec3 out to 16 bytes, so they are stored as vec4 here
+    struct FrameData
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPosition;
+        GLuint clusterGrid[4];  // Tiles across and down, depth slices, then unused
+        glm::vec4 clusterScale; // Pixels per tile across and down, then depth slice scale and bias
+    };
+
+    // Material features a shader variant is compiled with. Each draw uses the variant with
+    // only the features its object needs, see UShaderFeatures()
+    enum ShaderFeature {
+        SHADER_TEXTURED = 1 << 0,           // Samples the texture array, flat white objects don't
+        SHADER_UV_SCALE = 1 << 1,           // Scales texture coordinates, an identity scale doesn't
+        SHADER_SPECULAR = 1 << 2,           // Adds specular highlights, zero intensity doesn't
+        SHADER_CLUSTERED_LIGHTS = 1 << 3    // Shades the cluster's lights after the unbounded ones
+    };
+    const unsigned SHADER_VARIANT_COUNT = 1 << 4;
+    const unsigned SHADER_ALL_FEATURES = SHADER_VARIANT_COUNT - 1;
+
+    // Where a draw's vertex shader finds its object's transform and material
+    enum DrawSource {
+        DRAW_SOURCE_UNIFORMS,           // Per-object uniforms
+        DRAW_SOURCE_INSTANCES,          // Per-instance attributes
+        DRAW_SOURCE_RECORDS,            // Multi-draw records
+        DRAW_SOURCE_CULLED_RECORDS      // Multi-draw records, found through the GPU culled visible list
+    };
+
+    // Linked programs are saved with glGetProgramBinary, one file per program keyed by a hash
+    // of its sources and the driver strings, so later runs skip compiling them
+    const char* const PROGRAM_CACHE_DIR = "./resources/programcache";
+    const char PROGRAM_CACHE_MAGIC[4] = { 'U', 'P', 'B', 'C' };
+    const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+    struct ProgramCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        uint32_t format;        // Driver's binary format, handed back to glProgramBinary
+        uint32_t size;
+    };
+
+    struct ProgramCache
+    {
+        bool enabled = true;            // --no-program-cache, and off when the driver has no binary formats
+        bool parallelCompile = true;    // --serial-shaders, and off without GL_KHR_parallel_shader_compile
+        std::string driver;             // Vendor, renderer and version, part of every key
+        int hits = 0;
+        int misses = 0;
+        int writes = 0;
+    };
+
+    ProgramCache gProgramCache;
+
+    // A program whose compile and link were issued but not yet checked
+    struct PendingProgram
+    {
+        GLuint vertexShaderId = 0;
+        GLuint fragmentShaderId = 0;
+        uint64_t cacheKey = 0;
+    };
+
+    enum ShaderVariantState {
+        VARIANT_UNBUILT,
+        VARIANT_COMPILING,
+        VARIANT_READY,
+        VARIANT_FAILED
+    };
+
+    // Shader programs by feature bitmask, each built the first time a draw asks for it. Until
+    // one has compiled, a ready variant with more features stands in for it
+    struct ShaderVariants
+    {
+        ShaderProgram programs[SHADER_VARIANT_COUNT];
+        PendingProgram pending[SHADER_VARIANT_COUNT];
+        ShaderVariantState state[SHADER_VARIANT_COUNT] = {};
+        int ready = 0;
+        int cached = 0;                             // Loaded from the program cache
+        int compiling = 0;
+        double compileMs = 0.0;                     // Main thread time spent issuing and checking them
+        std::chrono::steady_clock::time_point batchStart;    // When the startup variants were requested
+        bool reportBatch = false;                   // Print when the startup compiles are all in
+        int draws[SHADER_VARIANT_COUNT] = {};       // Objects drawn with each variant last frame
+        int standInDraws = 0;                       // Objects drawn with a stand-in, over the whole run
+        int skippedDraws = 0;                       // Objects with nothing ready to draw them, over the whole run
+    };
+
+    ShaderVariants gShaderVariants;
+    bool gShaderVariantSelection = true;    // --no-shader-variants draws everything with every feature
+
+    // Uniform buffer holding this frame's FrameData
+    GLuint gFrameUbo = 0;
 
     // Texture IDs
-    GLuint gTextureIdNotex;
-    GLuint gTextureIdWhite;
-    GLuint gTextureIdBrick;
-    GLuint gTextureIdConcrete;
-    GLuint gTextureIdDoor;
-    GLuint gTextureIdGlass;
-    GLuint gTextureIdRoad;
-    GLuint gTextureIdLeaf;
-    GLuint gTextureIdBark;
-    GLuint gTextureIdMetal;
+    // Every basic texture is one layer of a single texture array, layer index = BasicTexture value
+    const int TEXTURE_LAYER_COUNT = 10;
+    const int TEXTURE_ARRAY_SIZE = 512;  // Images of any other size are resampled to this
+    const char* const TEXTURE_FILES[TEXTURE_LAYER_COUNT] = {
+        "./resources/notexture.png",
+        "./resources/whitetexture.png",
+        "./resources/bricktexture.png",
+        "./resources/concretetexture.png",
+        "./resources/doortexture.png",
+        "./resources/glasstexture.png",
+        "./resources/roadtexture.png",
+        "./resources/leaftexture.png",
+        "./resources/barktexture.png",
+        "./resources/metaltexture.png"
+    };
+
+    GLuint gTextureArray = 0;
+
+    // Placeholder every layer shows until its image has been uploaded
+    const unsigned char TEXTURE_PLACEHOLDER_COLOR[4] = { 128, 128, 128, 255 };
+
+    // Background workers for CPU-heavy loading. The GL context stays on the main thread,
+    // so jobs only ever touch CPU memory
+    struct ThreadPool
+    {
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> jobs;
+        std::mutex mutex;
+        std::condition_variable jobAvailable;
+        bool stopping = false;
+    };
+
+    ThreadPool gThreadPool;
+
+    // One image being decoded by a worker and then uploaded by the GL thread
+    struct TextureLoad
+    {
+        int layer;
+        const char* filename;
+        std::vector<unsigned char> pixels;  // RGBA at TEXTURE_ARRAY_SIZE, written by the worker
+        std::vector<std::vector<unsigned char>> levels; // Compressed mip chain instead of pixels
+        bool loaded = false;
+        bool cacheHit = false;
+        bool cacheWriteFailed = false;
+        double decodeMs = 0.0;
+    };
+
+    // Decoded loads are handed back through finished, the GL thread uploads them through
+    // two alternating pixel buffer objects so the copy into the texture is asynchronous
+    struct TextureLoader
+    {
+        std::vector<TextureLoad> loads;
+        std::vector<int> finished;          // Indices into loads, guarded by mutex
+        std::mutex mutex;
+        std::condition_variable finishedChanged;
+        int pending = 0;                    // Loads not uploaded yet, GL thread only
+        GLuint pbos[2] = { 0, 0 };
+        int nextPbo = 0;
+        std::chrono::steady_clock::time_point startTime;
+        double uploadMs = 0.0;
+    };
+
+    TextureLoader gTextureLoader;
+    bool gSerialTextureLoading = false;     // Decode on the main thread, for comparison
+
+    // Textures are block compressed on first load and cached on disk, one file per image,
+    // keyed by a hash of the source file so edited PNGs are picked up again
+    const char* const TEXTURE_CACHE_DIR = "./resources/texcache";
+    const char TEXTURE_CACHE_MAGIC[4] = { 'U', 'B', 'C', 'T' };
+    const uint32_t TEXTURE_CACHE_VERSION = 1;   // Bump whenever the encoders change
+
+    struct TextureCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t sourceHash;
+        uint32_t format;        // GL internal format of the levels that follow
+        uint32_t size;
+        uint32_t mipLevels;
+        uint32_t reserved;
+    };
+
+    bool gCompressTextures = true;
+    bool gBc7Textures = false;
+    GLenum gTextureFormat = GL_RGBA8;           // Shared by every layer of the array
+    int gTextureMipLevels = 1;
+
+    // Cooked assets, written by the AssetCooker project (this file built with U_ASSET_COOKER).
+    // Every primitive mesh, every texture layer with its mip chain and the scene object
+    // table in one file, each section aligned so the runtime can map it and hand pointers
+    // straight to GL
+    const char* const ASSET_PACK_FILE = "./resources/assets.pack";
+    const char ASSET_PACK_MAGIC[4] = { 'U', 'P', 'A', 'K' };
+    const uint32_t ASSET_PACK_VERSION = 3;
+    const uint64_t ASSET_PACK_ALIGNMENT = 256;
+
+    struct PackHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t fileBytes;
+        uint32_t meshCount;
+        uint32_t textureCount;
+        uint32_t objectCount;
+        uint32_t textureFormat;     // GL internal format shared by every layer
+        uint32_t textureSize;
+        uint32_t textureMipLevels;
+        uint64_t meshTable;         // File offsets of the PackMesh, PackTexture and PackObject arrays
+        uint64_t textureTable;
+        uint64_t objectTable;
+    };
+
+    struct PackMesh
+    {
+        int32_t shape;
+        int32_t detail;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t indexType;         // Already narrowed, see UPackIndices()
+        uint32_t reserved;
+        uint64_t vertexOffset;
+        uint64_t indexOffset;
+    };
+
+    // One texture array layer, mip levels back to back from the largest
+    struct PackTexture
+    {
+        uint32_t layer;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    struct PackObject
+    {
+        int32_t shape;
+        int32_t texture;
+        glm::vec2 uvScale;
+        glm::vec3 translation;
+        glm::vec3 rotation;     // Degrees, like GLObject
+        glm::vec3 scale;
+        int32_t parent;
+    };
+
+    // The mapped pack, header stays nullptr when running from generated assets
+    struct AssetPack
+    {
+        const unsigned char* base = nullptr;
+        size_t bytes = 0;
+        const PackHeader* header = nullptr;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+    };
+
+    AssetPack gAssetPack;
+    const char* gAssetPackFile = ASSET_PACK_FILE;   // nullptr with --no-pack
 
     // Camera
     Camera gCamera(glm::vec3(0.0f, 0.0f, 3.0f));
@@ -131,11 +807,232 @@ namespace
 
     // Input
     bool orthoKeyPressed = false;
+    bool profileToggleKeyPressed = false;
+    bool profileDumpKeyPressed = false;
+    bool profileCsvKeyPressed = false;
 
     // Timing
     float gDeltaTime = 0.0f; // time between current frame and last frame
     float gLastFrame = 0.0f;
 
+    // GPU profiling. GL_TIMESTAMP queries bracket every scope and are read back GPU_QUERY_FRAMES frames after they were
+    // issued, by which point the GPU has finished with them and reading never stalls
+    const int GPU_QUERY_FRAMES = 4;
+    const int GPU_TIMING_HISTORY = 256;
+    const int GPU_PROFILER_MAX_OBJECTS = 1024;  // Objects past this share the last object scope
+
+    // Fixed profiler scopes, scene objects follow from GPU_SCOPE_OBJECTS by sceneObjects[] index
+    enum GpuScope {
+        GPU_SCOPE_FRAME,
+        GPU_SCOPE_CLEAR,
+        GPU_SCOPE_SWAP,
+        GPU_SCOPE_OBJECTS
+    };
+
+    // Rolling window of the most recent timings for one scope, in milliseconds
+    struct TimingHistory
+    {
+        float samples[GPU_TIMING_HISTORY];
+        int count = 0;
+        int next = 0;
+
+        void Add(float ms) {
+            samples[next] = ms;
+            next = (next + 1) % GPU_TIMING_HISTORY;
+            count = std::min(count + 1, GPU_TIMING_HISTORY);
+        }
+    };
+
+    struct GpuScopeTimings
+    {
+        std::string name;
+        int objectIndex;        // sceneObjects[] index, -1 for the fixed scopes
+        TimingHistory gpu;
+        TimingHistory cpu;
+    };
+
+    // Queries issued during one frame, waiting to be read back
+    struct GpuQueryFrame
+    {
+        std::vector<GLuint> timestamps;     // timestamps[0] opens the frame, the rest close marks[]
+        std::vector<int> marks;             // scope each timestamp after the first closes
+        std::vector<float> cpuMs;           // CPU time spent submitting each mark
+        bool pending = false;
+    };
+
+    struct GpuProfiler
+    {
+        bool enabled = false;
+        GpuQueryFrame frames[GPU_QUERY_FRAMES];
+        int frameIndex = 0;
+        int droppedFrames = 0;
+        std::vector<GpuScopeTimings> scopes;
+        std::chrono::high_resolution_clock::time_point lastMark;
+    };
+
+    GpuProfiler gGpuProfiler;
+    const char* gGpuProfileCsvFile = "gpu_profile.csv";
+
+    // Render queue. Draws are ordered by a 64-bit key so that objects sharing state end up
+    // next to each other, most expensive state change in the highest bits:
+    //   63-62 pass | 61-56 program | 55-40 mesh | 39-24 texture layer | 23-0 view depth
+    // The program field holds the shader variant's feature bits
+    enum RenderPass {
+        RENDER_PASS_OPAQUE
+    };
+
+    const int SORT_KEY_PASS_SHIFT = 62;
+    const int SORT_KEY_PROGRAM_SHIFT = 56;
+    const int SORT_KEY_MESH_SHIFT = 40;
+    const int SORT_KEY_TEXTURE_SHIFT = 24;
+    const uint64_t SORT_KEY_DEPTH_MAX = (1u << 24) - 1;
+
+    // Bits that must match for two items to share an instanced draw. The texture layer is
+    // per-instance data, so only pass, program and mesh split a run
+    const uint64_t SORT_KEY_BATCH_MASK = ~(((uint64_t)0xFFFF << SORT_KEY_TEXTURE_SHIFT) | SORT_KEY_DEPTH_MAX);
+
+    struct RenderItem
+    {
+        uint64_t key;
+        uint32_t objectIndex;   // Index into sceneObjects[]
+    };
+
+    // Number of times each kind of state had to be rebound
+    struct BindCounts
+    {
+        int programs = 0;
+        int meshes = 0;
+        int layers = 0;     // Texture layer switches, a uniform update rather than a bind
+
+        int Total() const { return programs + meshes; }
+    };
+
+    struct RenderQueue
+    {
+        std::vector<RenderItem> items;
+        std::vector<RenderItem> scratch;    // Ping-pong buffer for the radix sort
+
+        BindCounts unsortedBinds;           // What submitting in declaration order would cost
+        BindCounts sortedBinds;             // What the sorted order actually cost
+    };
+
+    RenderQueue gRenderQueue;
+    bool renderStatsKeyPressed = false;
+
+    // Instanced rendering draws every run of objects sharing a mesh with one
+    // call, streaming their per-object data through instance attributes
+    const GLuint INSTANCE_MODEL_LOCATION = 3;      // mat4, takes locations 3 to 6
+    const GLuint INSTANCE_MATERIAL_LOCATION = 7;
+    const GLuint INSTANCE_NORMAL_LOCATION = 9;     // mat3, takes locations 9 to 11
+
+    struct InstanceData
+    {
+        glm::mat4 model;
+        glm::vec4 material;     // uvScale in xy, specular intensity in z, texture layer in w
+        NormalMatrix normal;
+    };
+
+    bool gInstancedRendering = false;
+    bool instancedKeyPressed = false;
+    GLuint gInstanceVbo = 0;
+    GLsizeiptr gInstanceVboCapacity = 0;
+    std::vector<InstanceData> gInstanceData;
+
+    // Multi-draw submission packs every mesh into one arena and draws the whole queue with a
+    // single glMultiDrawElementsIndirect. GL 4.4 has no core gl_DrawID, so each command's base
+    // instance is fed to the shader through a per-instance attribute instead, which indexes
+    // the per-draw records in a shader storage buffer
+    const GLuint DRAW_INDEX_LOCATION = 8;
+    const GLuint DRAW_DATA_BINDING = 1;
+
+    struct MeshArena
+    {
+        GLuint vao = 0;
+        GLuint vbo = 0;
+        GLuint ebo = 0;
+        GLenum indexType = GL_UNSIGNED_INT;
+        GLuint drawIndexVbo = 0;        // 0, 1, 2... one per instance
+        GLsizeiptr drawIndexCount = 0;
+        GLsizeiptr bufferBytes = 0;
+        int builtGeneration = -1;       // Registry generation the arena was packed from
+    };
+
+    // Layout fixed by glMultiDrawElementsIndirect
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    MeshArena gMeshArena;
+    bool gMultiDrawRendering = false;
+    bool multiDrawKeyPressed = false;
+    GLuint gDrawDataSsbo = 0;           // InstanceData records, std430 matches the C++ layout
+    GLsizeiptr gDrawDataCapacity = 0;
+    GLuint gIndirectBuffer = 0;
+    GLsizeiptr gIndirectCapacity = 0;
+    std::vector<DrawElementsIndirectCommand> gIndirectCommands;
+    std::vector<unsigned> gIndirectVariants;  // Shader variant of each command
+
+    // GPU culling moves the frustum test and the building of the multi-draw commands into
+    // compute passes. Every object's draw record and bounds stay resident on the GPU and
+    // only the ranges whose transforms changed are uploaded again. The cull pass appends
+    // each visible object to its mesh's slice of the visible list and counts it into that
+    // mesh's batch command; the compact pass packs the batches that got any into the
+    // indirect buffer, writes how many there are and zeroes the counts for next frame
+    const GLuint GPU_CULL_GROUP_SIZE = 64;
+    const GLuint CULL_BOUNDS_BINDING = 3;
+    const GLuint VISIBLE_OBJECTS_BINDING = 4;
+    const GLuint CULL_BATCHES_BINDING = 5;
+    const GLuint CULL_COMMANDS_BINDING = 6;
+    const GLuint CULL_DRAW_COUNT_BINDING = 7;
+
+    // Laid out like ObjectBounds in the cull shader, std430 packs the uint after the vec3
+    struct GpuCullBounds
+    {
+        glm::vec4 sphere;       // Centre in xyz, radius in w
+        glm::vec3 extent;       // Box half size around the same centre
+        uint32_t batch;         // Mesh batch the object is drawn with
+    };
+
+    struct GpuCulling
+    {
+        ShaderProgram cullProgram;
+        ShaderProgram compactProgram;
+        GLuint recordBuffer = 0;        // InstanceData for every object, in sceneObjects order
+        GLuint boundsBuffer = 0;        // GpuCullBounds for every object
+        GLuint visibleBuffer = 0;       // Visible object indices, each batch in its own slice
+        GLuint batchBuffer = 0;         // One command per mesh, the cull pass counts instances into it
+        GLuint commandBuffer = 0;       // The batches with anything visible, packed to the front
+        GLuint countBuffer = 0;         // How many commands the compact pass wrote
+        std::vector<int> meshBatch;     // Batch of each registry mesh, -1 when unused
+        size_t objectCount = 0;
+        GLuint batchCount = 0;
+        int builtGeneration = -1;       // Registry generation the batches were made for
+        bool recordsCurrent = false;    // False once a transform update happened without uploading
+        bool slicesCurrent = false;     // False once objects changed mesh, the slices are sized per mesh
+        bool indirectCount = false;     // GL_ARB_indirect_parameters, the draw count stays on the GPU
+        double cpuMs = 0.0;             // Last frame
+        double cpuMsTotal = 0.0;
+        int frames = 0;
+        int validatedFrames = 0;        // --validate-gpu-cull
+        size_t mismatchedTotal = 0;
+        size_t lastVisible = 0;
+    };
+
+    GpuCulling gGpuCull;
+    bool gGpuCulling = false;
+    bool gValidateGpuCulling = false;
+    bool gpuCullKeyPressed = false;
+
+    // Draw calls issued last frame, and what the other paths would have needed
+    int gDrawCalls = 0;
+    int gPerObjectDrawCalls = 0;
+    int gInstancedDrawCalls = 0;
+
     // Light parameters
     glm::vec3 gSkyLightColor(1.0f, 1.0f, 1.0f);
     glm::vec3 gSkyLightPosition(10.f, 5.f, 10.f);
@@ -145,6 +1042,85 @@ namespace
     glm::vec3 gBonusLightPosition(0.f, 5.f, 0.f);
     float gBonusLightBrightness = 0.5f;
 
+    // Clustered forward lighting: the view frustum is cut into screen tiles and exponentially
+    // spaced depth slices. Each frame a compute pass tests every light's sphere against every
+    // cluster's view space box and lists the lights that reach it, and each fragment shades
+    // with its own cluster's list only. The lists share one index buffer, each cluster taking
+    // a range of it sized to its own count. The sky and bonus lights are the first two entries;
+    // they have no radius, so every fragment shades them and they are never binned
+    const GLuint CLUSTER_TILES_X = 16;
+    const GLuint CLUSTER_TILES_Y = 9;
+    const GLuint CLUSTER_SLICES = 24;
+    const GLuint CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+    const GLuint LIGHT_LIST_START_AVERAGE = 32;     // Indices per cluster the shared list starts with room for
+    const GLuint LIGHT_BIN_GROUP_SIZE = 64;
+    const GLuint UNBOUNDED_LIGHTS = 2;
+    const GLuint LIGHTS_BINDING = 8;
+    const GLuint CLUSTER_RANGES_BINDING = 9;
+    const GLuint LIGHT_INDICES_BINDING = 10;
+
+    // Laid out like the shaders' std430 PointLight
+    struct PointLight
+    {
+        glm::vec4 positionRadius;
+        glm::vec4 color;
+    };
+
+    struct ClusteredLighting
+    {
+        ShaderProgram binProgram;
+        GLuint lightBuffer = 0;
+        GLuint clusterBuffer = 0;       // Per cluster its offset into the index list and its light count
+        GLuint indexBuffer = 0;         // Indices handed out this frame, then every cluster's light indices
+        GLuint listCapacity = 0;        // Light indices the index buffer holds
+        GLuint counterReadback = 0;     // A frame's handed out count, copied for reading without a stall
+        GLsync counterFence = 0;        // Signalled once that copy has landed
+        std::vector<PointLight> lights; // Sky, bonus, then the --lights street lights
+        bool lightsCurrent = false;     // The street lights are uploaded, only the first two change
+        size_t droppedIndices = 0;      // Indices that didn't fit before the list grew, in the sampled frames
+        int sampledFrames = 0;          // Frames whose count was read back, one in flight at a time
+        int overflowFrames = 0;         // Sampled frames that asked for more than the list held
+    };
+
+    ClusteredLighting gLighting;
+    int gStreetLights = 0;              // --lights
+    int gViewportWidth = WINDOW_WIDTH;
+    int gViewportHeight = WINDOW_HEIGHT;
+
+    // Scene files carry the GLObject constructor arguments, one object per line in the text
+    // form (see resources/street.scene), packed SceneRecords after a SceneFileHeader in the
+    // binary form. Shapes and textures are written by name in text, by enum value in binary
+    const char* const SHAPE_NAMES[] = { "cube", "pyramid", "plane", "cylinder" };
+    const int SHAPE_NAME_COUNT = sizeof(SHAPE_NAMES) / sizeof(SHAPE_NAMES[0]);
+    const char* const TEXTURE_NAMES[] = { "notex", "flatwhite", "brick", "concrete", "door", "glass", "road", "leaf", "bark", "metal" };
+    const int TEXTURE_NAME_COUNT = sizeof(TEXTURE_NAMES) / sizeof(TEXTURE_NAMES[0]);
+    const char SCENE_FILE_MAGIC[4] = { 'U', 'S', 'C', 'N' };
+    const uint32_t SCENE_FILE_VERSION = 2;
+    const size_t SCENE_PARSE_SLICE_BYTES = 256 * 1024;    // Text below this per job isn't worth splitting
+
+    struct SceneRecord
+    {
+        int32_t shape;
+        int32_t texture;
+        glm::vec2 uvScale;
+        glm::vec3 translation;
+        glm::vec3 rotation;     // Degrees
+        glm::vec3 scale;
+        int32_t parent;         // Index of an earlier record, -1 for none
+    };
+
+    struct SceneFileHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t objectCount;
+        uint32_t reserved;
+    };
+
+    const char* gSceneFile = nullptr;       // Replaces the built-in objects below when set
+    const char* gGenerateSceneFile = nullptr;
+    int gGenerateSceneCount = 0;
+
     /*
     GLObject(// Zero cube for reference
         PrimitiveShape::CUBE,
@@ -157,7 +1133,7 @@ namespace
     */
 
     // All scene objects are defined here
-    GLObject sceneObjects[] = {
+    std::vector<GLObject> sceneObjects = {
         GLObject(// Sidewalk cube
             PrimitiveShape::CUBE,
             BasicTexture::CONCRETE,
@@ -222,13 +1198,14 @@ namespace
             glm::vec3(0.f, 0.f, 0.f),
             glm::vec3(4.f, 1.5f, 2.f)
         ),
-        GLObject(// Car top cube
+        GLObject(// Car top cube, sits on the car body
             PrimitiveShape::CUBE,
             BasicTexture::GLASS,
             glm::vec2(1.0f, 1.0f),
-            glm::vec3(-6.5f, 1.25f, 0.f),
+            glm::vec3(0.5f, 1.25f, 0.f),
             glm::vec3(0.f, 0.f, 0.f),
-            glm::vec3(2.f, 1.f, 2.f)
+            glm::vec3(2.f, 1.f, 2.f),
+            7
         ),
         GLObject(// Tree trunk cube
             PrimitiveShape::CUBE,
@@ -238,29 +1215,32 @@ namespace
             glm::vec3(0.f, 0.f, 0.f),
             glm::vec3(1.f, 3.f, 1.f)
         ),
-        GLObject(// First tree leaf triangle
+        GLObject(// First tree leaf triangle, on the trunk
             PrimitiveShape::PYRAMID,
             BasicTexture::LEAF,
             glm::vec2(1.0f, 1.0f),
-            glm::vec3(3.f, 4.f, -2.f),
+            glm::vec3(0.f, 2.5f, 0.f),
             glm::vec3(0.f, 15.f, 0.f),
-            glm::vec3(3.f, 3.f, 3.f)
+            glm::vec3(3.f, 3.f, 3.f),
+            9
         ),
-        GLObject(// Second tree leaf triangle
+        GLObject(// Second tree leaf triangle, on the trunk
             PrimitiveShape::PYRAMID,
             BasicTexture::LEAF,
             glm::vec2(1.0f, 1.0f),
-            glm::vec3(3.f, 5.f, -2.f),
+            glm::vec3(0.f, 3.5f, 0.f),
             glm::vec3(0.f, -10.f, 0.f),
-            glm::vec3(2.5f, 2.5f, 2.5f)
+            glm::vec3(2.5f, 2.5f, 2.5f),
+            9
         ),
-        GLObject(// Third tree leaf triangle
+        GLObject(// Third tree leaf triangle, on the trunk
             PrimitiveShape::PYRAMID,
             BasicTexture::LEAF,
             glm::vec2(1.0f, 1.0f),
-            glm::vec3(3.f, 6.f, -2.f),
+            glm::vec3(0.f, 4.5f, 0.f),
             glm::vec3(0.f, 0.f, 0.f),
-            glm::vec3(2.f, 2.f, 2.f)
+            glm::vec3(2.f, 2.f, 2.f),
+            9
         ),
         GLObject(// Trash can cube
             PrimitiveShape::CUBE,
@@ -275,7 +1255,32 @@ namespace
 
 // Forward definitions for all our custom functions
 // because header files are for nerds
+bool UParseCommandLine(int argc, char* argv[]);
 bool UInitialize(int, char* [], GLFWwindow** window);
+void UShutdown();
+bool UInitializeHeadless(GLFWwindow** window);
+bool UCreateOffscreenTarget(int width, int height);
+void UDestroyOffscreenTarget();
+void UShutdownHeadless();
+bool ULoadCameraPath(const char* filename, std::vector<CameraKeyframe>& path);
+void UApplyCameraPath(const std::vector<CameraKeyframe>& path, float t);
+void URunCameraPathBenchmark();
+void UPrintFrameTimeReport(std::vector<double> frameTimesMs, double totalMs);
+bool USaveScreenshot(const char* filename);
+void UPresentFrame();
+uint64_t UMakeSortKey(RenderPass pass, GLuint program, GLuint mesh, GLuint texture, float viewDepth);
+void URadixSortRenderQueue(RenderQueue& queue);
+BindCounts UCountBinds(const std::vector<RenderItem>& items);
+void UPrintRenderQueueStats();
+GLuint UGetBasicTextureLayer(BasicTexture basicTex);
+void UGpuProfilerInit(int objectCount);
+void UGpuProfilerShutdown();
+void UGpuProfilerBeginFrame();
+void UGpuProfilerMark(int scope);
+void UGpuProfilerEndFrame();
+void UGpuProfilerCollect(GpuQueryFrame& frame);
+void UGpuProfilerDump(std::ostream& out, bool csv);
+bool UGpuProfilerWriteCsv(const char* filename);
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
@@ -283,18 +1288,196 @@ void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void UCreateSceneObjects();
 void UDestroySceneObjects();
-void UCreateCubeMesh(GLMesh& mesh);
-void UCreatePyramidMesh(GLMesh& mesh);
-void UCreatePlaneMesh(GLMesh& mesh);
-void UCreateCylinderMesh(GLMesh& mesh);
+void UCreateCubeMesh(MeshData& data);
+void UCreatePyramidMesh(MeshData& data);
+void UCreatePlaneMesh(MeshData& data);
+void UCreateCylinderMesh(MeshData& data, int numSides);
+void UBuildMesh(const char* name, const GLfloat* verts, size_t vertexCount, const GLuint* indices, size_t indexCount, MeshData& data);
+void UWeldVertices(const GLfloat* verts, size_t vertexCount, const GLuint* indices, size_t indexCount, MeshData& data);
+float UForsythVertexScore(int cachePosition, int activeTriangles);
+void UOptimizeVertexCache(MeshData& data);
+void UReorderVertices(MeshData& data);
+float UComputeAcmr(const std::vector<GLuint>& indices, size_t vertexCount, int cacheSize);
+void UUploadMesh(const MeshData& data, GLMesh& mesh);
 void UDestroyMesh(GLMesh& mesh);
+MeshHandle UAcquireMesh(MeshKey key);
+void UReleaseMesh(MeshHandle handle);
+GLMesh& UGetMesh(MeshHandle handle);
+void UPrintMeshRegistryStats();
+void UCreateInstanceBuffer(GLsizeiptr instanceCount);
+void UDestroyInstanceBuffer();
+void USetupInstanceAttributes(GLMesh& mesh);
+void UPrintDrawCallStats();
+void USubmitPerObject();
+void USubmitInstanced();
+void USubmitMultiDraw();
+void UGrowDrawIndices(size_t count);
+void USubmitGpuCulled();
+void UBuildGpuCullBuffers();
+void UUploadGpuCullObjects(size_t first, size_t last);
+void UValidateGpuCulling(const Frustum& frustum);
+void UPrintGpuCullStats();
+bool UCreateGpuCulling();
+void UDestroyGpuCulling();
+void UGatherInstanceData();
+InstanceData UGetInstanceData(uint32_t objectIndex);
+void UStreamBuffer(GLenum target, GLuint buffer, GLsizeiptr& capacity, const void* data, GLsizeiptr bytes);
+void UBuildMeshArena();
+void UDestroyMeshArena();
 void ULoadTextureSet();
-bool UCreateTexture(const char* filename, GLuint& textureId);
+void UDecodeTextureLayer(TextureLoad& load);
+void UUploadTextureLayer(TextureLoad& load);
+void UPumpTextureUploads(bool wait);
+GLenum UChooseTextureFormat();
+void UBuildMipChain(const std::vector<unsigned char>& image, int size, int levels, std::vector<std::vector<unsigned char>>& mips);
+GLsizei UTextureLevelBytes(GLenum format, int size);
+size_t UTextureChainBytes(GLenum format);
+const char* UTextureFormatName(GLenum format);
+void UCompressImage(const unsigned char* image, int size, GLenum format, unsigned char* out);
+void UFitBlockEndpoints(const unsigned char texels[64], int channels, float low[4], float high[4]);
+void UEncodeBc1Block(const unsigned char texels[64], unsigned char out[8]);
+void UEncodeBc4AlphaBlock(const unsigned char texels[64], unsigned char out[8]);
+void UEncodeBc7Block(const unsigned char texels[64], unsigned char out[16]);
+uint64_t UHashBytes(const void* data, size_t size);
+std::string UTextureCachePath(const char* filename);
+bool UReadTextureCache(const std::string& path, uint64_t sourceHash, TextureLoad& load);
+bool UWriteTextureCache(const std::string& path, uint64_t sourceHash, const TextureLoad& load);
+int UMipLevelCount(int size);
+MeshKey UDefaultMeshKey(PrimitiveShape shape);
+int ULodLevelCount(PrimitiveShape shape);
+MeshKey ULodMeshKey(PrimitiveShape shape, int level);
+void USelectLods(const std::vector<uint32_t>& visible);
+void UPrintLodStats();
+void UGenerateMesh(MeshKey key, MeshData& data);
+MeshGeometry UGetMeshGeometry(const MeshEntry& entry);
+GLenum UPackIndices(const std::vector<GLuint>& indices, std::vector<unsigned char>& bytes);
+void UUploadMeshGeometry(const MeshGeometry& geometry, GLMesh& mesh);
+GLsizei UVertexStride();
+void UQuantizeVertices(const MeshGeometry& geometry, const MeshBounds& bounds, std::vector<QuantizedVertex>& out);
+GLushort UFloatToHalf(float value);
+GLuint UPackNormal(const GLfloat* normal);
+glm::mat4 UGetDrawModel(uint32_t objectIndex);
+void USetVertexFormat(bool quantized);
+void UPrintVertexFormatStats();
+void UReadFramebuffer(std::vector<unsigned char>& pixels);
+void UVerifyQuantizedVertices();
+bool UOpenAssetPack(const char* filename);
+void UCloseAssetPack();
+const PackMesh* UGetPackMeshes();
+int UFindPackedMesh(MeshKey key);
+void ULoadPackedSceneObjects();
+void UUploadPackedTextures();
+bool UCookAssets(int argc, char* argv[]);
+void UStartThreadPool(int threadCount);
+void USubmitJob(std::function<void()> job);
+void UStopThreadPool();
+void UParallelFor(int jobCount, const std::function<void(int)>& job);
+GLObject UMakeSceneObject(const SceneRecord& record);
+bool ULoadSceneFile(const char* filename);
+bool UParseSceneText(const char* begin, const char* end, std::vector<SceneRecord>& records, int& lines, std::string& error);
+bool UParseSceneName(const char*& p, const char* end, const char* const* names, int nameCount, int32_t& value);
+bool UParseSceneFloat(const char*& p, const char* end, float& value);
+bool UParseSceneIndex(const char*& p, const char* end, int32_t& value);
+bool UWriteSceneFile(const char* filename, const std::vector<SceneRecord>& records);
+void UGenerateScene(int count, std::vector<SceneRecord>& records);
+void UInitTransformStore(TransformStore& store, const std::vector<GLObject>& objects);
+void UResizeTransformStore(TransformStore& store, size_t count);
+void USetTransform(TransformStore& store, size_t index, glm::vec3 position, glm::quat rotation, glm::vec3 scale);
+void UMoveObject(TransformStore& store, size_t index, glm::vec3 position);
+void UMarkSubtreeDirty(TransformStore& store, size_t index);
+void UMarkTransformsDirty(TransformStore& store, size_t first, size_t last);
+void UUpdateTransforms(TransformStore& store);
+void UPropagateTransforms(TransformStore& store, size_t first, size_t last);
+void UBuildSceneHierarchy();
+void UAnimateScene(float deltaTime);
+void UPrintTransformStats();
+MeshBounds UComputeMeshBounds(const MeshGeometry& geometry);
+void UComputeBounds(TransformStore& store, size_t first, size_t last);
+Frustum UExtractFrustum(const glm::mat4& viewProjection);
+void UCullObjects(const TransformStore& store, const Frustum& frustum, size_t first, size_t last, std::vector<uint32_t>& visible);
+bool UObjectOutsideFrustum(const TransformStore& store, const Frustum& frustum, size_t i);
+void UCullScene();
+void UPrintCullStats();
+void UOcclusionCull(const glm::mat4& viewProjection, std::vector<uint32_t>& visible);
+void URasterizeOccluders(const glm::mat4& viewProjection);
+void UAddOcclusionTriangle(const glm::vec4 corners[3]);
+void URasterizeOcclusionTile(int tileX, int tileY);
+void UBuildHiZ();
+bool UObjectOccluded(const glm::mat4& viewProjection, uint32_t object);
+bool UWriteOcclusionDump(const char* filename);
+void UPrintOcclusionStats();
+void UUpdateSceneBvh();
+void UBuildBvh(Bvh& bvh, const TransformStore& store);
+int32_t UBuildBvhNode(Bvh& bvh, BvhNodes& out, const TransformStore& store, uint32_t first, uint32_t count,
+    int32_t parent, int depth, std::vector<BvhBuildTask>* tasks, uint32_t taskSize);
+uint32_t UBvhSplit(const TransformStore& store, uint32_t* objects, uint32_t first, uint32_t count, bool median);
+double UBvhNodeCost(const BvhNode& node);
+void URefitBvh(Bvh& bvh, const TransformStore& store, const std::vector<std::pair<size_t, size_t>>& ranges);
+void URefitBvhNode(Bvh& bvh, const TransformStore& store, int32_t index);
+void UBvhTestFrustum(const BvhNode& node, const Frustum& frustum, int& outside, int& inside);
+int UBvhTestRay(const BvhNode& node, glm::vec3 origin, glm::vec3 inverseDirection, float maxDistance, float entry[4]);
+int UBvhTestBox(const BvhNode& node, glm::vec3 low, glm::vec3 high);
+void UBvhQueryFrustum(const Bvh& bvh, const TransformStore& store, const Frustum& frustum, std::vector<uint32_t>& visible);
+uint32_t UBvhRaycast(const Bvh& bvh, glm::vec3 origin, glm::vec3 direction, float& distance,
+    const std::function<float(uint32_t, float)>& intersect);
+void UBvhQueryBox(const Bvh& bvh, const TransformStore& store, glm::vec3 low, glm::vec3 high, std::vector<uint32_t>& results);
+bool UObjectOverlapsBox(const TransformStore& store, uint32_t object, glm::vec3 low, glm::vec3 high);
+float UIntersectObjectBox(const TransformStore& store, uint32_t object, glm::vec3 origin, glm::vec3 inverseDirection, float maxDistance);
+void UPrintBvhStats();
+void URunBvhBenchmark();
+void UMakePickRay(float x, float y, glm::vec3& origin, glm::vec3& direction);
+PickResult UPickObject(glm::vec3 origin, glm::vec3 direction);
+float UIntersectObjectTriangles(uint32_t object, glm::vec3 origin, glm::vec3 direction, float maxDistance, uint32_t& trianglesTested);
+float URayTriangle(glm::vec3 origin, glm::vec3 direction, glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, float maxDistance);
+void UPickAtCursor();
+void URunPickBenchmark(int count);
+void UComputeTransforms(TransformStore& store, size_t first, size_t last);
+void UComputeTransformsScalar(TransformStore& store, size_t first, size_t last);
+void URunTransformBenchmark();
+int UGpuObjectScope(uint32_t objectIndex);
+void UResampleImage(const unsigned char* source, int sourceWidth, int sourceHeight, int channels,
+    unsigned char* destination, int destinationWidth, int destinationHeight);
 void UDestroyTexture(GLuint textureId);
 float UGetBasicTexSpecIntensity(BasicTexture basicTex);
 void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+void UBuildRenderQueue();
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, const std::string& defines,
+    ShaderProgram& program, PendingProgram& pending);
+bool UFinishShaderProgram(ShaderProgram& program, PendingProgram& pending);
+bool UShaderProgramCompiled(const ShaderProgram& program);
+void UInitProgramCache();
+uint64_t UProgramCacheKey(const std::string& sources);
+std::string UProgramCachePath(uint64_t key);
+bool UReadProgramCache(uint64_t key, GLuint programId);
+bool UWriteProgramCache(uint64_t key, GLuint programId);
+bool UCreateComputeProgram(const char* computeShaderSource, ShaderProgram& program);
+void UReflectShaderProgram(ShaderProgram& program);
+std::string UInjectShaderDefines(const char* source, const std::string& defines);
+std::string UShaderVariantDefines(unsigned features);
+void URequestShaderVariant(unsigned features);
+void UPollShaderVariant(unsigned features, bool wait);
+void USettleShaderVariant(unsigned features, bool linked);
+void UReportShaderVariantBatch();
+void UPollShaderVariants(bool wait);
+void UPrewarmShaderVariants();
+const ShaderProgram* UGetShaderVariant(unsigned features);
+const ShaderProgram* UUseShaderVariant(unsigned features, DrawSource source);
+void UCountShaderVariantDraws(unsigned features, const ShaderProgram* program, int objects);
+unsigned UShaderFeatures(const GLObject& object);
+unsigned USceneShaderFeatures();
+void UDestroyShaderVariants();
+void UPrintShaderVariantStats();
+void UDestroyShaderProgram(ShaderProgram& program);
+void UCreateFrameUniformBuffer();
+void UUpdateFrameUniformBuffer();
+void UDestroyFrameUniformBuffer();
+bool UCreateClusteredLighting();
+void UDestroyClusteredLighting();
+void UGenerateStreetLights(int count);
+void UAllocateLightList(GLuint capacity);
+void UBinLights();
+void UPrintLightingStats();
+glm::mat4 UGetProjectionMatrix();
 
 /* Vertex Shader Source Code*/
 const GLchar* vertexShaderSource = GLSL(440,
@@ -302,24 +1485,84 @@ const GLchar* vertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
     layout(location = 1) in vec3 normal; // VAP position 1 for normals
     layout(location = 2) in vec2 textureCoordinate;
+    layout(location = 3) in mat4 instanceModel; // Per-instance model matrix, locations 3 to 6
+    layout(location = 7) in vec4 instanceMaterial; // Per-instance uvScale in xy, specular intensity in z, texture layer in w
+    layout(location = 8) in uint drawIndex; // Multi-draw record index, starts at each command's base instance
+    layout(location = 9) in mat3 instanceNormalMatrix; // Per-instance normal matrix, locations 9 to 11
 
     out vec3 vertexNormal; // For outgoing normals to fragment shader
     out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
     out vec2 vertexTextureCoordinate;
+    flat out vec2 vertexUvScale;
+    flat out float vertexSpecularIntensity;
+    flat out float vertexTextureLayer;
+
+    // Camera and light cluster data shared by every draw this frame
+    layout(std140) uniform FrameData
+    {
+        mat4 view;
+        mat4 projection;
+        vec3 viewPosition;
+        uvec4 clusterGrid;
+        vec4 clusterScale;
+    };
+
+    // Per-draw object data for multi-draw submission, laid out like InstanceData
+    struct DrawRecord
+    {
+        mat4 model;
+        vec4 material;
+        mat3 normalMatrix;
+    };
+
+    layout(std430, binding = 1) readonly buffer DrawData
+    {
+        DrawRecord draws[];
+    };
+
+    // GPU culling writes the visible objects here, draw indices go through it to the records
+    layout(std430, binding = 4) readonly buffer VisibleObjects
+    {
+        uint visibleObjects[];
+    };
 
     //Uniform / Global variables for the  transform matrices
     uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    uniform mat3 normalMatrix; // Inverse transpose of the model matrix, computed with the transforms on the CPU
+    uniform vec2 uvScale;
+    uniform float specularIntensity;
+    uniform float textureLayer;
+    uniform bool instanced; // Take the object data from the instance attributes instead
+    uniform bool multiDraw; // Take the object data from the draw records instead
+    uniform bool gpuCulled; // Draw records are every object's, found through the visible list
 
     void main()
     {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+        mat4 objectModel = model;
+        mat3 objectNormalMatrix = normalMatrix;
+        vec4 objectMaterial = vec4(uvScale, specularIntensity, textureLayer);
+        if (multiDraw) {
+            uint record = gpuCulled ? visibleObjects[drawIndex] : drawIndex;
+            objectModel = draws[record].model;
+            objectNormalMatrix = draws[record].normalMatrix;
+            objectMaterial = draws[record].material;
+        }
+        else if (instanced) {
+            objectModel = instanceModel;
+            objectNormalMatrix = instanceNormalMatrix;
+            objectMaterial = instanceMaterial;
+        }
 
-        vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+        gl_Position = projection * view * objectModel * vec4(position, 1.0f); // Transforms vertices into clip coordinates
 
-        vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
+        vertexFragmentPos = vec3(objectModel * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+
+        vertexNormal = objectNormalMatrix * normal; // get normal vectors in world space only and exclude normal translation properties
         vertexTextureCoordinate = textureCoordinate;
+
+        vertexUvScale = objectMaterial.xy;
+        vertexSpecularIntensity = objectMaterial.z;
+        vertexTextureLayer = objectMaterial.w;
     }
 );
 
@@ -329,18 +1572,48 @@ const GLchar* fragmentShaderSource = GLSL(440,
     in vec3 vertexNormal; // For incoming normals
     in vec3 vertexFragmentPos; // For incoming fragment position
     in vec2 vertexTextureCoordinate;
+    flat in vec2 vertexUvScale;
+    flat in float vertexSpecularIntensity;
+    flat in float vertexTextureLayer;
 
     out vec4 fragmentColor; // For outgoing cube color to the GPU
 
-    // Uniform / Global variables for object color, light color, light position, and camera/view position
-    uniform vec3 lightColor;
-    uniform vec3 lightPosition;
-    uniform vec3 light2Color;
-    uniform vec3 light2Position;
-    uniform vec3 viewPosition;
-    uniform sampler2D uTexture; // Useful when working with multiple textures
-    uniform vec2 uvScale;
-    uniform float specularIntensity;
+    // Camera and light cluster data shared by every draw this frame
+    layout(std140) uniform FrameData
+    {
+        mat4 view;
+        mat4 projection;
+        vec3 viewPosition;
+        uvec4 clusterGrid;
+        vec4 clusterScale;
+    };
+
+    // Every light, position and radius in the first vector
+    struct PointLight
+    {
+        vec4 positionRadius;
+        vec4 color;
+    };
+
+    layout(std430, binding = 8) readonly buffer Lights
+    {
+        PointLight lights[];
+    };
+
+    // Per cluster its first entry in lightIndices and how many it has
+    layout(std430, binding = 9) readonly buffer ClusterRanges
+    {
+        uvec2 clusterRanges[];
+    };
+
+    layout(std430, binding = 10) readonly buffer LightIndices
+    {
+        uint allocated;
+        uint lightIndices[];
+    };
+
+    // Uniform / Global variables for the texture
+    uniform sampler2DArray uTexture; // Every basic texture, one per layer
 
     vec3 CalcPointLight(vec3 nLightPos, vec3 nLightColor)
     {
@@ -356,45 +1629,299 @@ const GLchar* fragmentShaderSource = GLSL(440,
         float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
         vec3 diffuse = impact * nLightColor; // Generate diffuse light color
 
-        //Calculate Specular lighting*/
-        float highlightSize = 16.0f; // Set specular highlight size
-        vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-        vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-        //Calculate specular component
-        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-        vec3 specular = specularIntensity * specularComponent * nLightColor;
+        //Calculate Specular lighting, only variants with USE_SPECULAR have any*/
+        vec3 specular = vec3(0.0);
+        if (USE_SPECULAR != 0) {
+            float highlightSize = 16.0f; // Set specular highlight size
+            vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
+            vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+            //Calculate specular component
+            float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+            specular = vertexSpecularIntensity * specularComponent * nLightColor;
+        }
 
         return ambient + diffuse + specular;
     }
 
+    // Fades a light smoothly to nothing at its radius
+    float CalcAttenuation(vec4 positionRadius)
+    {
+        float reach = clamp(1.0 - dot(positionRadius.xyz - vertexFragmentPos, positionRadius.xyz - vertexFragmentPos)
+            / (positionRadius.w * positionRadius.w), 0.0, 1.0);
+        return reach * reach;
+    }
+
     void main()
     {
-        // Texture holds the color to be used for all three components
-        vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+        // Texture holds the color to be used for all three components, flat white objects skip the fetch
+        vec4 textureColor = vec4(1.0);
+        if (USE_TEXTURE != 0) {
+            vec2 uv = vertexTextureCoordinate;
+            if (USE_UV_SCALE != 0)
+                uv *= vertexUvScale;
+            textureColor = texture(uTexture, vec3(uv, vertexTextureLayer));
+        }
 
-        vec3 phong = CalcPointLight(lightPosition, lightColor) * textureColor.xyz;
-        phong += CalcPointLight(light2Position, light2Color) * textureColor.xyz;
+        // The unbounded lights at the front of the list reach every fragment undimmed
+        vec3 phong = vec3(0.0);
+        for (uint i = 0u; i < uint(UNBOUNDED_LIGHT_COUNT); ++i)
+            phong += CalcPointLight(lights[i].positionRadius.xyz, lights[i].color.rgb) * textureColor.xyz;
+
+        // The rest only where they were binned
+        if (USE_CLUSTERED_LIGHTS != 0) {
+            // Find this fragment's cluster from its screen tile and view depth
+            float viewDepth = max(-(view * vec4(vertexFragmentPos, 1.0)).z, 1e-4);
+            uvec2 tile = min(uvec2(gl_FragCoord.xy / clusterScale.xy), clusterGrid.xy - 1u);
+            uint slice = uint(clamp(log(viewDepth) * clusterScale.z + clusterScale.w, 0.0, float(clusterGrid.z - 1u)));
+            uvec2 range = clusterRanges[tile.x + clusterGrid.x * (tile.y + clusterGrid.y * slice)];
+
+            for (uint i = 0u; i < range.y; ++i) {
+                PointLight light = lights[lightIndices[range.x + i]];
+                phong += CalcPointLight(light.positionRadius.xyz, light.color.rgb) * CalcAttenuation(light.positionRadius) * textureColor.xyz;
+            }
+        }
 
         fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
     }
 );
 
+/* Culling Compute Shader Source Code*/
+const GLchar* cullShaderSource = GLSL(440,
+
+    layout(local_size_x = 64) in;
+
+    // The same sphere and box the CPU culling tests
+    struct ObjectBounds
+    {
+        vec4 sphere;
+        vec3 extent;
+        uint batch;
+    };
+
+    // Laid out like DrawElementsIndirectCommand
+    struct DrawCommand
+    {
+        uint count;
+        uint instanceCount;
+        uint firstIndex;
+        int baseVertex;
+        uint baseInstance;
+    };
+
+    layout(std430, binding = 3) readonly buffer Bounds
+    {
+        ObjectBounds bounds[];
+    };
+
+    layout(std430, binding = 4) writeonly buffer VisibleObjects
+    {
+        uint visibleObjects[];
+    };
+
+    layout(std430, binding = 5) buffer Batches
+    {
+        DrawCommand batches[];
+    };
+
+    uniform vec4 frustumPlanes[6]; // Normals pointing inside, unit length
+    uniform uint objectCount;
+    uniform bool frustumTest; // Off with --no-cull, every object is kept
+
+    void main()
+    {
+        uint object = gl_GlobalInvocationID.x;
+        if (object >= objectCount)
+            return;
+
+        // Out when the sphere or the box, whichever reaches less far, is behind any plane
+        ObjectBounds objectBounds = bounds[object];
+        for (int p = 0; frustumTest && p < 6; ++p) {
+            vec4 plane = frustumPlanes[p];
+            float distance = dot(plane.xyz, objectBounds.sphere.xyz) + plane.w;
+            float boxReach = dot(abs(plane.xyz), objectBounds.extent);
+            if (distance + min(objectBounds.sphere.w, boxReach) < 0.0)
+                return;
+        }
+
+        uint slot = atomicAdd(batches[objectBounds.batch].instanceCount, 1u);
+        visibleObjects[batches[objectBounds.batch].baseInstance + slot] = object;
+    }
+);
+
+/* Command Compaction Compute Shader Source Code*/
+const GLchar* compactShaderSource = GLSL(440,
+
+    layout(local_size_x = 1) in;
+
+    struct DrawCommand
+    {
+        uint count;
+        uint instanceCount;
+        uint firstIndex;
+        int baseVertex;
+        uint baseInstance;
+    };
+
+    layout(std430, binding = 5) buffer Batches
+    {
+        DrawCommand batches[];
+    };
+
+    layout(std430, binding = 6) writeonly buffer Commands
+    {
+        DrawCommand commands[];
+    };
+
+    layout(std430, binding = 7) writeonly buffer DrawCount
+    {
+        uint drawCount;
+    };
+
+    uniform uint batchCount;
+
+    // There's one batch per mesh, too few to be worth more than one invocation
+    void main()
+    {
+        uint written = 0u;
+        for (uint batch = 0u; batch < batchCount; ++batch) {
+            if (batches[batch].instanceCount > 0u) {
+                commands[written] = batches[batch];
+                ++written;
+            }
+            batches[batch].instanceCount = 0u;
+        }
+        drawCount = written;
+
+        // Without indirect parameters every command gets drawn, the rest draw nothing
+        for (uint command = written; command < batchCount; ++command)
+            commands[command].instanceCount = 0u;
+    }
+);
+
+/* Light Binning Compute Shader Source Code*/
+const GLchar* lightBinShaderSource = GLSL(440,
+
+    layout(local_size_x = 64) in;
+
+    struct PointLight
+    {
+        vec4 positionRadius;
+        vec4 color;
+    };
+
+    layout(std430, binding = 8) readonly buffer Lights
+    {
+        PointLight lights[];
+    };
+
+    layout(std430, binding = 9) writeonly buffer ClusterRanges
+    {
+        uvec2 clusterRanges[];      // First index and count of each cluster
+    };
+
+    layout(std430, binding = 10) buffer LightIndices
+    {
+        uint allocated;             // Indices asked for this frame, whether they fit or not
+        uint lightIndices[];
+    };
+
+    uniform mat4 view;
+    uniform mat4 inverseProjection;
+    uniform uvec3 clusterGrid;      // Tiles across and down, depth slices
+    uniform uint listCapacity;      // Indices lightIndices holds
+    uniform vec2 depthRange;        // Near and far plane
+    uniform uint firstLight;        // The unbounded lights before it aren't binned
+    uniform uint lightCount;
+
+    // Each group walks the lights a group's worth at a time, in view space
+    shared vec4 groupLights[64];
+
+    void main()
+    {
+        uint cluster = gl_GlobalInvocationID.x;
+        bool inGrid = cluster < clusterGrid.x * clusterGrid.y * clusterGrid.z;
+
+        // The cluster's view space box: its tile's corners, pushed out to both ends of its slice
+        vec3 boxLow = vec3(1e30);
+        vec3 boxHigh = vec3(-1e30);
+        if (inGrid) {
+            uint tileX = cluster % clusterGrid.x;
+            uint tileY = (cluster / clusterGrid.x) % clusterGrid.y;
+            uint slice = cluster / (clusterGrid.x * clusterGrid.y);
+            float depthRatio = depthRange.y / depthRange.x;
+            vec2 sliceDepth = depthRange.x * vec2(pow(depthRatio, float(slice) / float(clusterGrid.z)),
+                pow(depthRatio, float(slice + 1u) / float(clusterGrid.z)));
+            for (uint corner = 0u; corner < 4u; ++corner) {
+                vec2 ndc = vec2(float(tileX + (corner & 1u)), float(tileY + (corner >> 1u))) / vec2(clusterGrid.xy) * 2.0 - 1.0;
+                vec4 nearPoint = inverseProjection * vec4(ndc, -1.0, 1.0);
+                vec4 farPoint = inverseProjection * vec4(ndc, 1.0, 1.0);
+                nearPoint /= nearPoint.w;
+                farPoint /= farPoint.w;
+
+                // The line through both is the eye ray in perspective, a parallel line in ortho
+                for (uint end = 0u; end < 2u; ++end) {
+                    float t = (-sliceDepth[end] - nearPoint.z) / (farPoint.z - nearPoint.z);
+                    vec3 point = mix(nearPoint.xyz, farPoint.xyz, t);
+                    boxLow = min(boxLow, point);
+                    boxHigh = max(boxHigh, point);
+                }
+            }
+        }
+
+        // The first pass counts the lights that reach the cluster, then the cluster takes a range
+        // of the shared list that size and the second pass fills it
+        uint count = 0u;
+        uint first = 0u;
+        uint written = 0u;
+        for (uint pass = 0u; pass < 2u; ++pass) {
+            for (uint base = firstLight; base < lightCount; base += 64u) {
+                uint index = base + gl_LocalInvocationID.x;
+                if (index < lightCount)
+                    groupLights[gl_LocalInvocationID.x] = vec4((view * vec4(lights[index].positionRadius.xyz, 1.0)).xyz,
+                        lights[index].positionRadius.w);
+                memoryBarrierShared();
+                barrier();
+
+                // A light reaches the cluster when its sphere touches the box
+                uint batch = min(64u, lightCount - base);
+                for (uint i = 0u; inGrid && i < batch; ++i) {
+                    vec4 light = groupLights[i];
+                    vec3 toBox = clamp(light.xyz, boxLow, boxHigh) - light.xyz;
+                    if (dot(toBox, toBox) <= light.w * light.w) {
+                        if (pass == 0u)
+                            ++count;
+                        else if (written < count)
+                            lightIndices[first + written++] = base + i;
+                    }
+                }
+                barrier();
+            }
+
+            // Past the end of the list a cluster keeps what fits, the CPU grows it for the next frame
+            if (pass == 0u && inGrid && count > 0u) {
+                first = atomicAdd(allocated, count);
+                count = first < listCapacity ? min(count, listCapacity - first) : 0u;
+            }
+        }
+
+        if (inGrid)
+            clusterRanges[cluster] = uvec2(first, count);
+    }
+);
+
 // Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
 void flipImageVertically(unsigned char* image, int width, int height, int channels)
 {
+    // Swap whole rows through a scratch row instead of byte by byte
+    const size_t rowBytes = (size_t)width * channels;
+    std::vector<unsigned char> row(rowBytes);
     for (int j = 0; j < height / 2; ++j)
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
-
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
+        unsigned char* top = image + j * rowBytes;
+        unsigned char* bottom = image + (height - 1 - j) * rowBytes;
+        memcpy(row.data(), top, rowBytes);
+        memcpy(top, bottom, rowBytes);
+        memcpy(bottom, row.data(), rowBytes);
     }
 }
 
@@ -419,30 +1946,117 @@ std::vector<GLfloat> getUnitCircleVertices(int sectorCount)
 // Main program loop
 int main(int argc, char* argv[])
 {
+#ifdef U_ASSET_COOKER
+    // The AssetCooker project builds this same file, it only writes the pack and exits
+    return UCookAssets(argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+#endif
+
+    auto startupStart = std::chrono::steady_clock::now();
+
+    if (!UParseCommandLine(argc, argv))
+        return EXIT_FAILURE;
+
+    // Writing a test scene needs no window
+    if (gGenerateSceneFile)
+    {
+        std::vector<SceneRecord> records;
+        UGenerateScene(gGenerateSceneCount, records);
+        return UWriteSceneFile(gGenerateSceneFile, records) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // So does timing the transform update
+    if (gTransformBenchmark)
+    {
+        URunTransformBenchmark();
+        return EXIT_SUCCESS;
+    }
+    if (gBvhBenchmark)
+    {
+        URunBvhBenchmark();
+        return EXIT_SUCCESS;
+    }
+
     // Attempt to initialize OpenGL
     if (!UInitialize(argc, argv, &gWindow))
         return EXIT_FAILURE;
 
+    // Scene loading and texture decoding both run on the workers
+    UStartThreadPool(std::max(1, (int)std::thread::hardware_concurrency() - 1));
+
+    // A cooked pack replaces mesh generation, PNG decoding and the built-in object table.
+    // A scene file given on the command line still wins over the pack's objects
+    bool packOpen = gAssetPackFile && UOpenAssetPack(gAssetPackFile);
+    if (gSceneFile)
+    {
+        if (!ULoadSceneFile(gSceneFile))
+        {
+            UStopThreadPool();
+            return EXIT_FAILURE;
+        }
+    }
+    else if (packOpen)
+    {
+        ULoadPackedSceneObjects();
+    }
+
+    // Mesh VAOs point their instance attributes at this buffer, so it has to exist first
+    UCreateInstanceBuffer(sceneObjects.size());
+
     // Create our scene objects and populate the sceneObjects array
     UCreateSceneObjects();
 
-    // Create the shader program from source
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
+    // Timer queries are cheap to create up front even if profiling stays off
+    UGpuProfilerInit((int)sceneObjects.size());
+
+    // Every program from here on comes from the binary cache when it can
+    UInitProgramCache();
+
+    // Camera and light data is uploaded once per frame through this
+    UCreateFrameUniformBuffer();
+    if (!UCreateClusteredLighting())
+    {
+        UShutdown();
         return EXIT_FAILURE;
+    }
+
+    // The GPU culling passes, the CPU paths still work if a driver can't build them
+    if (!UCreateGpuCulling())
+    {
+        cout << "GPU culling unavailable" << endl;
+        gGpuCulling = false;
+    }
 
-    // Load textures
+    // Start on the shader variants the scene needs, they compile while the textures load
+    UPrewarmShaderVariants();
+
+    // Load textures, decoding happens on the workers and layers show up as they finish
     ULoadTextureSet();
 
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gProgramId, "uTextureBase"), 0);
+    // Benchmarks and screenshots need the real textures and shaders from the first frame
+    if (gHeadless) {
+        UPumpTextureUploads(true);
+        UPollShaderVariants(true);
+    }
+
+    // Nothing can stand in for the variant with every feature
+    if (gShaderVariants.state[SHADER_ALL_FEATURES] == VARIANT_FAILED)
+    {
+        UShutdown();
+        return EXIT_FAILURE;
+    }
 
     // Sets the background color of the window to black (it will be implicitely used by glClear)
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
+    cout << "Startup: " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupStart).count()
+        << " ms to first frame, " << (gAssetPack.header ? "assets from pack" : "assets generated") << endl;
+
+    // Headless runs replay the camera path for a fixed frame count instead of looping
+    if (gHeadless)
+        URunCameraPathBenchmark();
+
     // render loop
-    while (!glfwWindowShouldClose(gWindow))
+    while (!gHeadless && !glfwWindowShouldClose(gWindow))
     {
         // per-frame timing
         float currentFrame = glfwGetTime();
@@ -458,17 +2072,150 @@ int main(int argc, char* argv[])
         glfwPollEvents();
     }
 
+    // Headless profiling runs report once everything has been rendered
+    if (gHeadless && gGpuProfiler.enabled)
+    {
+        UGpuProfilerDump(cout, false);
+        if (!UGpuProfilerWriteCsv(gGpuProfileCsvFile))
+            cout << "Failed to write " << gGpuProfileCsvFile << endl;
+    }
+    // A window closed because the variant with every feature failed to build is still a failure
+    bool variantsFailed = gShaderVariants.state[SHADER_ALL_FEATURES] == VARIANT_FAILED;
+    UShutdown();
+
+    exit(variantsFailed ? EXIT_FAILURE : EXIT_SUCCESS); // Terminates the program, successfully unless a shader failed
+}
+
+// Stops the workers and releases everything main created, also on a failed startup
+void UShutdown()
+{
+    UGpuProfilerShutdown();
+
     // Release mesh and shader program memory
     UDestroySceneObjects();
-    UDestroyTexture(gTextureIdBrick);
-    UDestroyShaderProgram(gProgramId);
+    UDestroyMeshArena();
+    UDestroyInstanceBuffer();
+    UStopThreadPool();
+    UDestroyTexture(gTextureArray);
+    UDestroyShaderVariants();
+    UDestroyGpuCulling();
+    UDestroyClusteredLighting();
+    UDestroyFrameUniformBuffer();
+    UCloseAssetPack();
+
+    if (gHeadless)
+        UShutdownHeadless();
+}
+
+// Reads our command line switches, returns false on bad usage
+bool UParseCommandLine(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+            gHeadless = true;
+        else if (strcmp(argv[i], "--camera-path") == 0 && i + 1 < argc)
+            gCameraPathFile = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            gBenchmarkFrames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--screenshot") == 0 && i + 1 < argc)
+            gScreenshotFile = argv[++i];
+        else if (strcmp(argv[i], "--gpu-profile") == 0)
+            gGpuProfiler.enabled = true;
+        else if (strcmp(argv[i], "--instanced") == 0)
+            gInstancedRendering = true;
+        else if (strcmp(argv[i], "--multi-draw") == 0)
+            gMultiDrawRendering = true;
+        else if (strcmp(argv[i], "--serial-textures") == 0)
+            gSerialTextureLoading = true;
+        else if (strcmp(argv[i], "--uncompressed-textures") == 0)
+            gCompressTextures = false;
+        else if (strcmp(argv[i], "--bc7") == 0)
+            gBc7Textures = true;
+        else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc)
+            gAssetPackFile = argv[++i];
+        else if (strcmp(argv[i], "--no-pack") == 0)
+            gAssetPackFile = nullptr;
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+            gSceneFile = argv[++i];
+        else if (strcmp(argv[i], "--generate-scene") == 0 && i + 2 < argc)
+        {
+            gGenerateSceneCount = atoi(argv[++i]);
+            gGenerateSceneFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--transform-benchmark") == 0)
+            gTransformBenchmark = true;
+        else if (strcmp(argv[i], "--no-cull") == 0)
+            gFrustumCulling = false;
+        else if (strcmp(argv[i], "--no-bvh") == 0)
+            gBvhCulling = false;
+        else if (strcmp(argv[i], "--no-occlusion") == 0)
+            gOcclusionCulling = false;
+        else if (strcmp(argv[i], "--no-lod") == 0)
+            gLodSelection = false;
+        else if (strcmp(argv[i], "--no-shader-variants") == 0)
+            gShaderVariantSelection = false;
+        else if (strcmp(argv[i], "--no-program-cache") == 0)
+            gProgramCache.enabled = false;
+        else if (strcmp(argv[i], "--serial-shaders") == 0)
+            gProgramCache.parallelCompile = false;
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+            gStreetLights = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--quantized-vertices") == 0)
+            gQuantizedVertices = true;
+        else if (strcmp(argv[i], "--verify-quantized") == 0)
+            gVerifyQuantized = true;
+        else if (strcmp(argv[i], "--occlusion-dump") == 0 && i + 1 < argc)
+            gOcclusionDumpFile = argv[++i];
+        else if (strcmp(argv[i], "--pick-benchmark") == 0 && i + 1 < argc)
+            gPickBenchmark = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--gpu-cull") == 0)
+            gGpuCulling = true;
+        else if (strcmp(argv[i], "--validate-gpu-cull") == 0)
+            gGpuCulling = gValidateGpuCulling = true;
+        else if (strcmp(argv[i], "--bvh-benchmark") == 0)
+            gBvhBenchmark = true;
+        else if (strcmp(argv[i], "--animate") == 0 && i + 1 < argc)
+            gAnimatedObjects = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--gpu-profile-csv") == 0 && i + 1 < argc)
+            gGpuProfileCsvFile = argv[++i];
+        else
+        {
+            cout << "Unknown argument " << argv[i] << endl;
+            cout << "Usage: " << argv[0] << " [--headless] [--camera-path file] [--frames n] [--screenshot file.ppm]"
+                " [--gpu-profile] [--gpu-profile-csv file] [--instanced] [--multi-draw]"
+                " [--serial-textures] [--uncompressed-textures] [--bc7] [--pack file | --no-pack]"
+                " [--scene file] [--generate-scene count file] [--transform-benchmark] [--animate n] [--no-cull]"
+                " [--no-bvh] [--bvh-benchmark] [--gpu-cull] [--validate-gpu-cull]"
+                " [--pick-benchmark n] [--no-occlusion] [--occlusion-dump file.pgm] [--no-lod]"
+                " [--quantized-vertices] [--verify-quantized] [--lights n] [--no-shader-variants]"
+                " [--no-program-cache] [--serial-shaders]" << endl;
+            return false;
+        }
+    }
+
+    if (gBenchmarkFrames < 1)
+    {
+        cout << "--frames must be at least 1" << endl;
+        return false;
+    }
+
+    if (gGenerateSceneFile && gGenerateSceneCount < 1)
+    {
+        cout << "--generate-scene needs at least 1 object" << endl;
+        return false;
+    }
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+    return true;
 }
 
 // Initialize GLFW, GLEW, and create a window
 bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 {
+    // No display on the build farm, so skip the window entirely
+    if (gHeadless)
+        return UInitializeHeadless(window);
+
     // GLFW: initialize and configure
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -512,9 +2259,288 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     // Displays GPU OpenGL version
     cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
 
+    // The size callback only fires on later changes, and on HiDPI displays the framebuffer
+    // is bigger than the window
+    int framebufferWidth = 0;
+    int framebufferHeight = 0;
+    glfwGetFramebufferSize(*window, &framebufferWidth, &framebufferHeight);
+    UResizeWindow(*window, framebufferWidth, framebufferHeight);
+
+    return true;
+}
+
+// Creates a GL 4.4 core context with no window and points rendering at an offscreen FBO
+bool UInitializeHeadless(GLFWwindow** window)
+{
+#ifdef U_HAVE_EGL
+    // Mesa's surfaceless platform needs neither a display server nor a GPU
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        gEglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (gEglDisplay == EGL_NO_DISPLAY)
+        gEglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint eglMajor, eglMinor;
+    if (gEglDisplay == EGL_NO_DISPLAY || !eglInitialize(gEglDisplay, &eglMajor, &eglMinor))
+    {
+        std::cout << "Failed to initialize EGL" << std::endl;
+        return false;
+    }
+    eglBindAPI(EGL_OPENGL_API);
+
+    // We never draw to an EGL surface, so any desktop GL capable config will do
+    const EGLint configAttribs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config = NULL;
+    EGLint numConfigs = 0;
+    eglChooseConfig(gEglDisplay, configAttribs, &config, 1, &numConfigs);
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 4,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    gEglContext = eglCreateContext(gEglDisplay, numConfigs > 0 ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+    if (gEglContext == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, gEglContext))
+    {
+        std::cout << "Failed to create a surfaceless EGL context" << std::endl;
+        eglTerminate(gEglDisplay);
+        return false;
+    }
+    *window = nullptr;
+#else
+    // No EGL here, a hidden window still gives us a context to render offscreen with
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    *window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    if (*window == NULL)
+    {
+        std::cout << "Failed to create hidden GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(*window);
+#endif
+
+    // GLEW: initialize. A GLX build of GLEW reports a missing X display on an EGL
+    // context after it has already loaded every core entry point, so that one is fine
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+    if (GLEW_OK != GlewInitResult && GLEW_ERROR_NO_GLX_DISPLAY != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    cout << "INFO: OpenGL Renderer: " << glGetString(GL_RENDERER) << endl;
+
+    return UCreateOffscreenTarget(WINDOW_WIDTH, WINDOW_HEIGHT);
+}
+
+// Creates and binds a framebuffer with color and depth attachments in place of the default one
+bool UCreateOffscreenTarget(int width, int height)
+{
+    glGenRenderbuffers(1, &gOffscreenColorRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenColorRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glGenRenderbuffers(1, &gOffscreenDepthRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenDepthRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &gOffscreenFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gOffscreenColorRbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gOffscreenDepthRbo);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "Offscreen framebuffer is incomplete" << endl;
+        return false;
+    }
+
+    // Stays bound for the whole run, URender never touches the default framebuffer
+    glViewport(0, 0, width, height);
+    gViewportWidth = width;
+    gViewportHeight = height;
+
     return true;
 }
 
+// Free the offscreen framebuffer and its attachments
+void UDestroyOffscreenTarget()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &gOffscreenFbo);
+    glDeleteRenderbuffers(1, &gOffscreenColorRbo);
+    glDeleteRenderbuffers(1, &gOffscreenDepthRbo);
+}
+
+// Tears down whatever UInitializeHeadless created
+void UShutdownHeadless()
+{
+    UDestroyOffscreenTarget();
+
+#ifdef U_HAVE_EGL
+    eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(gEglDisplay, gEglContext);
+    eglTerminate(gEglDisplay);
+#else
+    glfwDestroyWindow(gWindow);
+    glfwTerminate();
+#endif
+}
+
+// Reads a camera path, one "x y z yaw pitch [zoom]" keyframe per line, # starts a comment
+bool ULoadCameraPath(const char* filename, std::vector<CameraKeyframe>& path)
+{
+    std::ifstream file(filename);
+    if (!file)
+        return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream fields(line);
+        CameraKeyframe key;
+        if (!(fields >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch))
+            continue;
+        if (!(fields >> key.zoom))
+            key.zoom = ZOOM;
+
+        path.push_back(key);
+    }
+
+    return !path.empty();
+}
+
+// Places gCamera at normalized time t along the path, linearly blending neighbouring keyframes
+void UApplyCameraPath(const std::vector<CameraKeyframe>& path, float t)
+{
+    float position = t * (path.size() - 1);
+    size_t index = std::min((size_t)position, path.size() - 1);
+    size_t next = std::min(index + 1, path.size() - 1);
+    float blend = position - index;
+
+    const CameraKeyframe& a = path[index];
+    const CameraKeyframe& b = path[next];
+    gCamera.Position = a.position + (b.position - a.position) * blend;
+    gCamera.Yaw = a.yaw + (b.yaw - a.yaw) * blend;
+    gCamera.Pitch = a.pitch + (b.pitch - a.pitch) * blend;
+    gCamera.Zoom = a.zoom + (b.zoom - a.zoom) * blend;
+
+    // A zero mouse movement is the only public way to make Camera rebuild its vectors
+    gCamera.ProcessMouseMovement(0.f, 0.f);
+}
+
+// Renders gBenchmarkFrames frames along the camera path and prints frame time statistics
+void URunCameraPathBenchmark()
+{
+    std::vector<CameraKeyframe> path;
+    if (gCameraPathFile)
+    {
+        if (!ULoadCameraPath(gCameraPathFile, path))
+            cout << "Failed to load camera path " << gCameraPathFile << ", using the default orbit" << endl;
+    }
+
+    // Default path circles the street looking in at the scene
+    if (path.empty())
+    {
+        const int orbitKeys = 33;
+        for (int i = 0; i < orbitKeys; ++i)
+        {
+            float angle = (float)i / (orbitKeys - 1) * 360.f;
+            CameraKeyframe key;
+            key.position = glm::vec3(-2.f + 18.f * cos(glm::radians(angle)), 6.f, -4.f + 18.f * sin(glm::radians(angle)));
+            key.yaw = angle + 180.f;
+            key.pitch = -15.f;
+            key.zoom = ZOOM;
+            path.push_back(key);
+        }
+    }
+
+    // Every frame steps the same simulated time so runs are reproducible
+    gDeltaTime = 1.f / 60.f;
+
+    std::vector<double> frameTimesMs;
+    frameTimesMs.reserve(gBenchmarkFrames);
+
+    typedef std::chrono::high_resolution_clock Clock;
+    Clock::time_point runStart = Clock::now();
+
+    for (int frame = 0; frame < gBenchmarkFrames; ++frame)
+    {
+        float t = gBenchmarkFrames > 1 ? (float)frame / (gBenchmarkFrames - 1) : 0.f;
+        UApplyCameraPath(path, t);
+
+        Clock::time_point frameStart = Clock::now();
+        URender();
+        frameTimesMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - frameStart).count());
+    }
+
+    double totalMs = std::chrono::duration<double, std::milli>(Clock::now() - runStart).count();
+    UPrintFrameTimeReport(frameTimesMs, totalMs);
+    UPrintRenderQueueStats();
+    UPrintDrawCallStats();
+    UPrintCullStats();
+    UPrintOcclusionStats();
+    UPrintLodStats();
+    UPrintLightingStats();
+    UPrintShaderVariantStats();
+    UPrintGpuCullStats();
+    UPrintBvhStats();
+    UPrintTransformStats();
+    if (gPickBenchmark > 0)
+        URunPickBenchmark(gPickBenchmark);
+    if (gOcclusionDumpFile && !UWriteOcclusionDump(gOcclusionDumpFile))
+        cout << "Failed to write occlusion buffer " << gOcclusionDumpFile << endl;
+    if (gVerifyQuantized)
+        UVerifyQuantizedVertices();
+
+    if (gScreenshotFile && !USaveScreenshot(gScreenshotFile))
+        cout << "Failed to write screenshot " << gScreenshotFile << endl;
+}
+
+// Prints min, mean and percentile frame times in milliseconds
+void UPrintFrameTimeReport(std::vector<double> frameTimesMs, double totalMs)
+{
+    std::sort(frameTimesMs.begin(), frameTimesMs.end());
+
+    double sum = 0.0;
+    for (double ms : frameTimesMs)
+        sum += ms;
+
+    // Nearest-rank percentile on the sorted samples
+    auto percentile = [&frameTimesMs](double p) {
+        size_t rank = (size_t)std::ceil(p / 100.0 * frameTimesMs.size());
+        return frameTimesMs[rank > 0 ? rank - 1 : 0];
+    };
+
+    cout << "Frame time report (" << frameTimesMs.size() << " frames, ms)" << endl;
+    cout << "  min   " << frameTimesMs.front() << endl;
+    cout << "  mean  " << sum / frameTimesMs.size() << endl;
+    cout << "  p50   " << percentile(50.0) << endl;
+    cout << "  p95   " << percentile(95.0) << endl;
+    cout << "  p99   " << percentile(99.0) << endl;
+    cout << "  max   " << frameTimesMs.back() << endl;
+    cout << "Total wall time " << totalMs << " ms" << endl;
+}
+
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 void UProcessInput(GLFWwindow* window)
 {
@@ -546,12 +2572,115 @@ void UProcessInput(GLFWwindow* window)
     if (orthoKey && !orthoKeyPressed)
         gOrthoView = !gOrthoView;
     orthoKeyPressed = orthoKey;
-}
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+    // F1 toggles GPU profiling, F2 dumps it to the console and F3 to CSV
+    bool profileToggleKey = glfwGetKey(window, GLFW_KEY_F1) == GLFW_PRESS;
+    if (profileToggleKey && !profileToggleKeyPressed)
+    {
+        gGpuProfiler.enabled = !gGpuProfiler.enabled;
+        cout << "GPU profiling " << (gGpuProfiler.enabled ? "enabled" : "disabled") << endl;
+    }
+    profileToggleKeyPressed = profileToggleKey;
+
+    bool profileDumpKey = glfwGetKey(window, GLFW_KEY_F2) == GLFW_PRESS;
+    if (profileDumpKey && !profileDumpKeyPressed)
+        UGpuProfilerDump(cout, false);
+    profileDumpKeyPressed = profileDumpKey;
+
+    bool profileCsvKey = glfwGetKey(window, GLFW_KEY_F3) == GLFW_PRESS;
+    if (profileCsvKey && !profileCsvKeyPressed)
+    {
+        if (UGpuProfilerWriteCsv(gGpuProfileCsvFile))
+            cout << "Wrote GPU profile to " << gGpuProfileCsvFile << endl;
+        else
+            cout << "Failed to write " << gGpuProfileCsvFile << endl;
+    }
+    profileCsvKeyPressed = profileCsvKey;
+
+    // I switches between per-object and instanced draws
+    bool instancedKey = glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS;
+    if (instancedKey && !instancedKeyPressed)
+    {
+        gInstancedRendering = !gInstancedRendering;
+        cout << "Instanced rendering " << (gInstancedRendering ? "enabled" : "disabled") << endl;
+        UPrintDrawCallStats();
+    }
+    instancedKeyPressed = instancedKey;
+
+    // M switches whole-scene multi-draw submission on and off, it takes priority over instancing
+    bool multiDrawKey = glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS;
+    if (multiDrawKey && !multiDrawKeyPressed)
+    {
+        gMultiDrawRendering = !gMultiDrawRendering;
+        cout << "Multi-draw rendering " << (gMultiDrawRendering ? "enabled" : "disabled") << endl;
+        UPrintDrawCallStats();
+    }
+    multiDrawKeyPressed = multiDrawKey;
+
+    // C switches frustum culling on and off
+    bool cullKey = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+    if (cullKey && !cullKeyPressed)
+    {
+        gFrustumCulling = !gFrustumCulling;
+        UPrintCullStats();
+    }
+    cullKeyPressed = cullKey;
+
+    // O switches occlusion culling on and off, F5 writes its depth buffer out
+    bool occlusionKey = glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS;
+    if (occlusionKey && !occlusionKeyPressed)
+    {
+        gOcclusionCulling = !gOcclusionCulling;
+        UPrintOcclusionStats();
+    }
+    occlusionKeyPressed = occlusionKey;
+
+    bool occlusionDumpKey = glfwGetKey(window, GLFW_KEY_F5) == GLFW_PRESS;
+    if (occlusionDumpKey && !occlusionDumpKeyPressed && !UWriteOcclusionDump("occlusion.pgm"))
+        cout << "Failed to write occlusion.pgm" << endl;
+    occlusionDumpKeyPressed = occlusionDumpKey;
+
+    // L switches level of detail selection on and off
+    bool lodKey = glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS;
+    if (lodKey && !lodKeyPressed)
+    {
+        gLodSelection = !gLodSelection;
+        UPrintLodStats();
+    }
+    lodKeyPressed = lodKey;
+
+    // V uploads every mesh again in the other vertex format
+    bool quantizedKey = glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS;
+    if (quantizedKey && !quantizedKeyPressed)
+    {
+        USetVertexFormat(!gQuantizedVertices);
+        UPrintVertexFormatStats();
+    }
+    quantizedKeyPressed = quantizedKey;
+
+    // G moves culling and draw building onto the GPU, it takes priority over the other paths
+    bool gpuCullKey = glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS;
+    if (gpuCullKey && !gpuCullKeyPressed && gGpuCull.cullProgram.id != 0)
+    {
+        gGpuCulling = !gGpuCulling;
+        cout << "GPU culling " << (gGpuCulling ? "enabled" : "disabled") << endl;
+        UPrintGpuCullStats();
+    }
+    gpuCullKeyPressed = gpuCullKey;
+
+    // F4 reports how many binds the render queue saved last frame
+    bool renderStatsKey = glfwGetKey(window, GLFW_KEY_F4) == GLFW_PRESS;
+    if (renderStatsKey && !renderStatsKeyPressed)
+        UPrintRenderQueueStats();
+    renderStatsKeyPressed = renderStatsKey;
+}
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
 void UResizeWindow(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
+    gViewportWidth = width;
+    gViewportHeight = height;
 }
 
 // glfw: whenever the mouse moves, this callback is called
@@ -597,8 +2726,9 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
     {
     case GLFW_MOUSE_BUTTON_LEFT:
     {
+        // Left click selects whatever is in the middle of the view
         if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
+            UPickAtCursor();
         else
             cout << "Left mouse button released" << endl;
     }
@@ -634,594 +2764,5641 @@ void URender()
     // Enable z-depth so objects occlude properly
     glEnable(GL_DEPTH_TEST);
 
+    // Swap in any textures the workers finished since last frame
+    UPumpTextureUploads(false);
+
+    UGpuProfilerBeginFrame();
+
     // Clear the frame background and z buffers
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    // Loop through the sceneObjects array
-    for (GLObject& currentObject : sceneObjects) {
-        // cout << "Rendering a shape with " << currentObject.mesh.nIndices << " indices" << endl;
+    UGpuProfilerMark(GPU_SCOPE_CLEAR);
+
+    // Camera and lights don't change between objects, so they go up once per frame
+    UUpdateFrameUniformBuffer();
+    UBinLights();
+
+    // Bring the matrices of anything that moved up to date
+    if (gAnimatedObjects > 0)
+        UAnimateScene(gDeltaTime);
+    UUpdateTransforms(gTransforms);
+    if (gBvhCulling && !gGpuCulling)
+        UUpdateSceneBvh();
+    else if (!gTransforms.updatedRanges.empty())
+        gSceneBvh.built = false;        // Missed a refit, rebuilt when next needed
+
+    // One texture bind covers every object
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gTextureArray);
+
+    // The GPU culling path tests and queues the objects itself
+    gDrawCalls = 0;
+    std::fill(std::begin(gShaderVariants.draws), std::end(gShaderVariants.draws), 0);
+    UPollShaderVariants(false);
+    if (gGpuCulling) {
+        USubmitGpuCulled();
+    }
+    else {
+        // Whatever moved this frame has to go up in full once the GPU path is back on
+        if (!gTransforms.updatedRanges.empty())
+            gGpuCull.recordsCurrent = false;
+
+        UBuildRenderQueue();
+        if (gMultiDrawRendering)
+            USubmitMultiDraw();
+        else if (gInstancedRendering)
+            USubmitInstanced();
+        else
+            USubmitPerObject();
+    }
 
-        // Activate the VBOs contained within the mesh's VAO
-        glBindVertexArray(currentObject.mesh.vao);
+    // Deactivate the Vertex Array Object
+    glBindVertexArray(0);
 
-        // Set the shader to be used
-        glUseProgram(gProgramId);
+    UPresentFrame();
+    UGpuProfilerMark(GPU_SCOPE_SWAP);
+    UGpuProfilerEndFrame();
+}
 
-        glm::mat4 model = currentObject.GetModelMatrix();
+// Culls the scene on the CPU and fills the sorted render queue with what's left
+void UBuildRenderQueue()
+{
+    // Leave out everything outside the view
+    UCullScene();
+
+    // Swap what's left to the detail its size on screen calls for
+    USelectLods(gVisibleObjects);
+
+    // Queue every visible object under a key built from the state it needs
+    const glm::vec3 cameraPosition = gCamera.Position;
+    gRenderQueue.items.clear();
+    for (uint32_t objectIndex : gVisibleObjects) {
+        GLObject& currentObject = sceneObjects[objectIndex];
+        float viewDepth = glm::length(glm::vec3(gTransforms.world[objectIndex][3]) - cameraPosition);
+
+        RenderItem item;
+        item.key = UMakeSortKey(RENDER_PASS_OPAQUE, UShaderFeatures(currentObject), UGetMesh(currentObject.mesh).vao,
+            UGetBasicTextureLayer(currentObject.texture), viewDepth);
+        item.objectIndex = objectIndex;
+        gRenderQueue.items.push_back(item);
+    }
 
-        // Transforms the camera by move the camera
-        glm::mat4 view = gCamera.GetViewMatrix();
+    gRenderQueue.unsortedBinds = UCountBinds(gRenderQueue.items);
+    URadixSortRenderQueue(gRenderQueue);
+    gRenderQueue.sortedBinds = UCountBinds(gRenderQueue.items);
+
+    // Each run of queue items with identical batch state can be one instanced draw
+    const uint64_t stateMask = SORT_KEY_BATCH_MASK;
+    gPerObjectDrawCalls = (int)gRenderQueue.items.size();
+    gInstancedDrawCalls = 0;
+    for (size_t i = 0; i < gRenderQueue.items.size(); ++i)
+        if (i == 0 || (gRenderQueue.items[i].key & stateMask) != (gRenderQueue.items[i - 1].key & stateMask))
+            ++gInstancedDrawCalls;
+}
 
-        // Creates a perspective projection from the camera
-        glm::mat4 projection;
-        if (gOrthoView) {
-            //projection = glm::ortho<float>(0.0f, (float)WINDOW_WIDTH, 0.0f, (float)WINDOW_HEIGHT, -1.0f, 1.0f);
-            float widthHalf = 2.f;
-            float heightHalf = 2.f;
-            projection = glm::ortho<float>(-widthHalf, widthHalf, -heightHalf, heightHalf, 0.1f, 100.0f);
+// Draws the sorted queue one object at a time
+void USubmitPerObject()
+{
+    unsigned currentVariant = SHADER_VARIANT_COUNT;
+    const ShaderProgram* program = nullptr;
+    GLuint currentVao = 0;
+
+    // Submit in key order, only touching state that differs from the previous draw
+    for (const RenderItem& item : gRenderQueue.items) {
+        GLObject& currentObject = sceneObjects[item.objectIndex];
+        const GLMesh& mesh = UGetMesh(currentObject.mesh);
+        // cout << "Rendering a shape with " << mesh.nIndices << " indices" << endl;
+
+        unsigned variant = (unsigned)(item.key >> SORT_KEY_PROGRAM_SHIFT & 0x3F);
+        if (currentVariant != variant) {
+            currentVariant = variant;
+            program = UUseShaderVariant(variant, DRAW_SOURCE_UNIFORMS);
         }
-        else {
-            projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
-        }
-
-        // Get handles for our matrices
-        GLint modelLoc = glGetUniformLocation(gProgramId, "model");
-        GLint viewLoc = glGetUniformLocation(gProgramId, "view");
-        GLint projLoc = glGetUniformLocation(gProgramId, "projection");
-
-        // ... and pass the relevant data to the GPU
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-        // Reference matrix uniforms from the Shader program for the light color, light position, and camera position
-        GLint lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-        GLint lightPositionLoc = glGetUniformLocation(gProgramId, "lightPosition");
-        GLint light2ColorLoc = glGetUniformLocation(gProgramId, "light2Color");
-        GLint light2PositionLoc = glGetUniformLocation(gProgramId, "light2Position");
-        GLint viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-        GLint specIntensityLoc = glGetUniformLocation(gProgramId, "specularIntensity");
-
-        // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms
-        glm::vec3 finalSkyLightColor = gSkyLightColor * gSkyLightBrightness;
-        glm::vec3 finalBonusLightColor = gBonusLightColor * gBonusLightBrightness;
-        glUniform3f(lightColorLoc, finalSkyLightColor.r, finalSkyLightColor.g, finalSkyLightColor.b);
-        glUniform3f(lightPositionLoc, gSkyLightPosition.x, gSkyLightPosition.y, gSkyLightPosition.z);
-        glUniform3f(light2ColorLoc, finalBonusLightColor.r, finalBonusLightColor.g, finalBonusLightColor.b);
-        glUniform3f(light2PositionLoc, gBonusLightPosition.x, gBonusLightPosition.y, gBonusLightPosition.z);
-        const glm::vec3 cameraPosition = gCamera.Position;
-        glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-        glUniform1f(specIntensityLoc, UGetBasicTexSpecIntensity(currentObject.texture));
-
-        GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-        glUniform2fv(UVScaleLoc, 1, glm::value_ptr(currentObject.uvScale));
-
-        glActiveTexture(GL_TEXTURE0);
-
-        // Resolve final texture Id
-        GLuint texId = gTextureIdNotex;
-
-        switch (currentObject.texture) {
-        case BasicTexture::NOTEX:
-            texId = gTextureIdNotex;
-            break;
-        case BasicTexture::FLATWHITE:
-            texId = gTextureIdWhite;
-            break;
-        case BasicTexture::BRICK:
-            texId = gTextureIdBrick;
-            break;
-        case BasicTexture::CONCRETE:
-            texId = gTextureIdConcrete;
-            break;
-        case BasicTexture::DOOR:
-            texId = gTextureIdDoor;
-            break;
-        case BasicTexture::GLASS:
-            texId = gTextureIdGlass;
-            break;
-        case BasicTexture::ROAD:
-            texId = gTextureIdRoad;
-            break;
-        case BasicTexture::LEAF:
-            texId = gTextureIdLeaf;
-            break;
-        case BasicTexture::BARK:
-            texId = gTextureIdBark;
-            break;
-        case BasicTexture::METAL:
-            texId = gTextureIdMetal;
-            break;
+        UCountShaderVariantDraws(variant, program, 1);
+        if (!program)
+            continue;
+
+        // Activate the VBOs contained within the mesh's VAO
+        if (currentVao != mesh.vao) {
+            currentVao = mesh.vao;
+            glBindVertexArray(currentVao);
         }
 
-        glBindTexture(GL_TEXTURE_2D, texId);
+        // Only the per-object uniforms change inside the loop
+        const NormalMatrix& normal = gTransforms.normal[item.objectIndex];
+        glm::mat3 normalMatrix(glm::vec3(normal.columns[0]), glm::vec3(normal.columns[1]), glm::vec3(normal.columns[2]));
+        glUniformMatrix4fv(program->modelLoc, 1, GL_FALSE, glm::value_ptr(UGetDrawModel(item.objectIndex)));
+        glUniformMatrix3fv(program->normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+        glUniform1f(program->specIntensityLoc, UGetBasicTexSpecIntensity(currentObject.texture));
+        glUniform2fv(program->uvScaleLoc, 1, glm::value_ptr(currentObject.uvScale));
+        glUniform1f(program->textureLayerLoc, (GLfloat)UGetBasicTextureLayer(currentObject.texture));
 
         // Draws the triangles
-        if (currentObject.shape == PrimitiveShape::CYLINDER) {
-            // Drawing cylinders doesn't work. DrawArrays-shaped peg in a DrawElements-shaped hole.
-            // Instructor, if you read this, it would be excellent for future students to be
-            // CLEARLY INFORMED that you should build your project around DrawElements, because
-            // that will make adding more complex shapes infinitely more feasible.
-            
-            // glDrawElements(GL_TRIANGLES, (unsigned int)currentObject.mesh.nVertices, GL_UNSIGNED_INT, 0);
+        glDrawElements(GL_TRIANGLES, mesh.nIndices, mesh.indexType, 0);
+        ++gDrawCalls;
+
+        UGpuProfilerMark(UGpuObjectScope(item.objectIndex));
+    }
+}
+
+// Draws the sorted queue with one instanced call per run of objects sharing a mesh
+void USubmitInstanced()
+{
+    const uint64_t stateMask = SORT_KEY_BATCH_MASK;
+    unsigned currentVariant = SHADER_VARIANT_COUNT;
+    const ShaderProgram* program = nullptr;
+    GLuint currentVao = 0;
+
+    // Stream every object's data in queue order so each run is contiguous
+    UGatherInstanceData();
+    UStreamBuffer(GL_ARRAY_BUFFER, gInstanceVbo, gInstanceVboCapacity, gInstanceData.data(),
+        gInstanceData.size() * sizeof(InstanceData));
+
+    size_t runStart = 0;
+    while (runStart < gRenderQueue.items.size()) {
+        size_t runEnd = runStart + 1;
+        while (runEnd < gRenderQueue.items.size() &&
+            (gRenderQueue.items[runEnd].key & stateMask) == (gRenderQueue.items[runStart].key & stateMask))
+            ++runEnd;
+
+        GLObject& firstObject = sceneObjects[gRenderQueue.items[runStart].objectIndex];
+        const GLMesh& mesh = UGetMesh(firstObject.mesh);
+
+        // Runs never straddle variants, the variant is part of the batch state
+        unsigned variant = (unsigned)(gRenderQueue.items[runStart].key >> SORT_KEY_PROGRAM_SHIFT & 0x3F);
+        if (currentVariant != variant) {
+            currentVariant = variant;
+            program = UUseShaderVariant(variant, DRAW_SOURCE_INSTANCES);
         }
-        else {
-            glDrawArrays(GL_TRIANGLES, 0, currentObject.mesh.nVertices);
+        UCountShaderVariantDraws(variant, program, (int)(runEnd - runStart));
+        if (!program) {
+            runStart = runEnd;
+            continue;
         }
 
-        // Deactivate the Vertex Array Object
-        glBindVertexArray(0);
-    }
+        if (currentVao != mesh.vao) {
+            currentVao = mesh.vao;
+            glBindVertexArray(currentVao);
+        }
 
-    // Flip the the back buffer with the front buffer every frame
-    // to prevent screen tearing
-    glfwSwapBuffers(gWindow);
+        // Base instance selects this run's slice of the instance buffer
+        glDrawElementsInstancedBaseInstance(GL_TRIANGLES, mesh.nIndices, mesh.indexType, 0,
+            (GLsizei)(runEnd - runStart), (GLuint)runStart);
+        ++gDrawCalls;
+
+        // A run's GPU time is attributed to its first object
+        UGpuProfilerMark(UGpuObjectScope(gRenderQueue.items[runStart].objectIndex));
+        runStart = runEnd;
+    }
 }
 
-// Creates and caches our scene objects
-void UCreateSceneObjects()
+// Draws the whole sorted queue with one indirect call over the mesh arena
+void USubmitMultiDraw()
 {
-    // Fill sceneObjects with juicy data
-    for (GLObject& currentObject : sceneObjects) {
-        switch (currentObject.shape) {
-        case PrimitiveShape::CUBE:
-            UCreateCubeMesh(currentObject.mesh);
-            break;
-        case PrimitiveShape::PYRAMID:
-            UCreatePyramidMesh(currentObject.mesh);
-            break;
-        case PrimitiveShape::PLANE:
-            UCreatePlaneMesh(currentObject.mesh);
-            break;
-        case PrimitiveShape::CYLINDER:
-            UCreateCylinderMesh(currentObject.mesh);
-            cout << "Cylinders are not currently supported!" << endl;   
-            break;
+    if (gMeshArena.builtGeneration != gMeshRegistry.generation)
+        UBuildMeshArena();
+
+    // Draw records are read in queue order, one per instance
+    UGatherInstanceData();
+    UStreamBuffer(GL_SHADER_STORAGE_BUFFER, gDrawDataSsbo, gDrawDataCapacity, gInstanceData.data(),
+        gInstanceData.size() * sizeof(InstanceData));
+
+    UGrowDrawIndices(gRenderQueue.items.size());
+
+    // One command per run of objects sharing a mesh, instanced across the run
+    gIndirectCommands.clear();
+    gIndirectVariants.clear();
+    size_t runStart = 0;
+    while (runStart < gRenderQueue.items.size()) {
+        size_t runEnd = runStart + 1;
+        while (runEnd < gRenderQueue.items.size() &&
+            (gRenderQueue.items[runEnd].key & SORT_KEY_BATCH_MASK) == (gRenderQueue.items[runStart].key & SORT_KEY_BATCH_MASK))
+            ++runEnd;
+
+        const MeshEntry& entry = gMeshRegistry.entries[sceneObjects[gRenderQueue.items[runStart].objectIndex].mesh];
+        DrawElementsIndirectCommand command;
+        command.count = entry.mesh.nIndices;
+        command.instanceCount = (GLuint)(runEnd - runStart);
+        command.firstIndex = entry.arenaFirstIndex;
+        command.baseVertex = entry.arenaBaseVertex;
+        command.baseInstance = (GLuint)runStart;
+        gIndirectCommands.push_back(command);
+
+        gIndirectVariants.push_back((unsigned)(gRenderQueue.items[runStart].key >> SORT_KEY_PROGRAM_SHIFT & 0x3F));
+
+        runStart = runEnd;
+    }
+    UStreamBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer, gIndirectCapacity, gIndirectCommands.data(),
+        gIndirectCommands.size() * sizeof(DrawElementsIndirectCommand));
+
+    glBindVertexArray(gMeshArena.vao);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING, gDrawDataSsbo);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+
+    // Commands are sorted by variant, so each variant's commands go in one call
+    size_t commandStart = 0;
+    while (commandStart < gIndirectCommands.size()) {
+        size_t commandEnd = commandStart + 1;
+        while (commandEnd < gIndirectCommands.size() && gIndirectVariants[commandEnd] == gIndirectVariants[commandStart])
+            ++commandEnd;
+
+        const ShaderProgram* program = UUseShaderVariant(gIndirectVariants[commandStart], DRAW_SOURCE_RECORDS);
+        int objects = 0;
+        for (size_t command = commandStart; command < commandEnd; ++command)
+            objects += (int)gIndirectCommands[command].instanceCount;
+        UCountShaderVariantDraws(gIndirectVariants[commandStart], program, objects);
+        if (program) {
+            glMultiDrawElementsIndirect(GL_TRIANGLES, gMeshArena.indexType,
+                (const void*)(commandStart * sizeof(DrawElementsIndirectCommand)), (GLsizei)(commandEnd - commandStart), 0);
+            ++gDrawCalls;
         }
+        commandStart = commandEnd;
     }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // The whole pass is one call, so its GPU time lands on the first object
+    if (!gRenderQueue.items.empty())
+        UGpuProfilerMark(UGpuObjectScope(gRenderQueue.items[0].objectIndex));
 }
 
-// Frees the memory used by the meshes contained within each SceneObject
-void UDestroySceneObjects() {
-    // Loop through the sceneObjects array
-    for (GLObject& currentObject : sceneObjects) {
-        UDestroyMesh(currentObject.mesh);
-    }
+// Every instance needs a draw index, grows the 0, 1, 2... buffer if the scene outgrew it
+void UGrowDrawIndices(size_t count)
+{
+    if ((GLsizeiptr)count <= gMeshArena.drawIndexCount)
+        return;
+
+    std::vector<GLuint> drawIndices(count);
+    for (size_t i = 0; i < drawIndices.size(); ++i)
+        drawIndices[i] = (GLuint)i;
+    gMeshArena.drawIndexCount = (GLsizeiptr)drawIndices.size();
+    glBindBuffer(GL_ARRAY_BUFFER, gMeshArena.drawIndexVbo);
+    glBufferData(GL_ARRAY_BUFFER, drawIndices.size() * sizeof(GLuint), drawIndices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-// Creates and caches all data required to draw a cube
-void UCreateCubeMesh(GLMesh& mesh)
+// Culls and draws the whole scene on the GPU. The CPU side only uploads the objects that
+// moved and issues two dispatches and one draw, whatever the object count
+void USubmitGpuCulled()
 {
-    // Position and Color data
-    GLfloat verts[] = {
-        //Positions          //Normals
-        // ------------------------------------------------------
-        //Back Face          //Negative Z Normal  Texture Coords.
-        -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-         0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-         0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-         0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-        -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-        -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+    auto start = std::chrono::steady_clock::now();
+    GpuCulling& cull = gGpuCull;
+
+    if (gMeshArena.builtGeneration != gMeshRegistry.generation)
+        UBuildMeshArena();
+    if (cull.builtGeneration != gMeshRegistry.generation || cull.objectCount != sceneObjects.size() || !cull.slicesCurrent)
+        UBuildGpuCullBuffers();
+    else if (!cull.recordsCurrent)
+        UUploadGpuCullObjects(0, cull.objectCount);
+    else
+        for (const std::pair<size_t, size_t>& range : gTransforms.updatedRanges)
+            UUploadGpuCullObjects(range.first, range.second);
+    cull.recordsCurrent = true;
+
+    Frustum frustum = UExtractFrustum(UGetProjectionMatrix() * gCamera.GetViewMatrix());
+    glUseProgram(cull.cullProgram.id);
+    glUniform4fv(cull.cullProgram.Uniform("frustumPlanes"), 6, glm::value_ptr(frustum.planes[0]));
+    glUniform1ui(cull.cullProgram.Uniform("objectCount"), (GLuint)cull.objectCount);
+    glUniform1i(cull.cullProgram.Uniform("frustumTest"), gFrustumCulling);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_BOUNDS_BINDING, cull.boundsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_OBJECTS_BINDING, cull.visibleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_BATCHES_BINDING, cull.batchBuffer);
+    glDispatchCompute(((GLuint)cull.objectCount + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(cull.compactProgram.id);
+    glUniform1ui(cull.compactProgram.Uniform("batchCount"), cull.batchCount);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_COMMANDS_BINDING, cull.commandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_DRAW_COUNT_BINDING, cull.countBuffer);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    if (gValidateGpuCulling)
+        UValidateGpuCulling(frustum);
+
+    // Draw indices pick each instance's entry in the visible list, which names its record.
+    // The CPU never sees which objects are drawn, so every material feature is compiled in
+    const ShaderProgram* program = UUseShaderVariant(SHADER_TEXTURED | SHADER_UV_SCALE | SHADER_SPECULAR | USceneShaderFeatures(),
+        DRAW_SOURCE_CULLED_RECORDS);
+    glBindVertexArray(gMeshArena.vao);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING, cull.recordBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cull.commandBuffer);
+    if (!program) {
+        // Still compiling, the frame goes without
+    }
+    else if (cull.indirectCount) {
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, cull.countBuffer);
+        glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, gMeshArena.indexType, 0, 0, (GLsizei)cull.batchCount, 0);
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+    }
+    else {
+        glMultiDrawElementsIndirect(GL_TRIANGLES, gMeshArena.indexType, 0, (GLsizei)cull.batchCount, 0);
+    }
+    if (program)
+        ++gDrawCalls;
 
-        //Front Face         //Positive Z Normal
-        -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-         0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-         0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-         0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-        -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-        -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 
-        //Left Face          //Negative X Normal
-        -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-        -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-        -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-        -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-        -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-        -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+    // Like multi-draw, the whole pass lands on the first object
+    UGpuProfilerMark(UGpuObjectScope(0));
 
-        //Right Face         //Positive X Normal
-         0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-         0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-         0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-         0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-         0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-         0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+    cull.cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cull.cpuMsTotal += cull.cpuMs;
+    ++cull.frames;
+}
 
-        //Bottom Face        //Negative Y Normal
-        -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-         0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-         0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-         0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-        -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-        -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+// Gives every live mesh a batch with its slice of the visible list, big enough for all
+// of its objects, then uploads every object's record and bounds
+void UBuildGpuCullBuffers()
+{
+    GpuCulling& cull = gGpuCull;
+    cull.objectCount = sceneObjects.size();
+
+    cull.meshBatch.assign(gMeshRegistry.entries.size(), -1);
+    std::vector<DrawElementsIndirectCommand> batches;
+    for (size_t mesh = 0; mesh < gMeshRegistry.entries.size(); ++mesh) {
+        const MeshEntry& entry = gMeshRegistry.entries[mesh];
+        if (entry.refCount <= 0)
+            continue;
+        DrawElementsIndirectCommand batch;
+        batch.count = entry.mesh.nIndices;
+        batch.instanceCount = 0;
+        batch.firstIndex = entry.arenaFirstIndex;
+        batch.baseVertex = entry.arenaBaseVertex;
+        batch.baseInstance = 0;
+        cull.meshBatch[mesh] = (int)batches.size();
+        batches.push_back(batch);
+    }
 
-        //Top Face           //Positive Y Normal
-        -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-         0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-         0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-         0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-        -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-        -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    // Slices are sized by object count per mesh, counted into baseInstance and then summed
+    for (const GLObject& object : sceneObjects)
+        ++batches[cull.meshBatch[object.mesh]].baseInstance;
+    GLuint sliceStart = 0;
+    for (DrawElementsIndirectCommand& batch : batches) {
+        GLuint objects = batch.baseInstance;
+        batch.baseInstance = sliceStart;
+        sliceStart += objects;
+    }
+    cull.batchCount = (GLuint)batches.size();
+
+    // The GPU writes all of these, the CPU only ever reads them back when validating
+    auto allocate = [](GLuint& buffer, GLsizeiptr bytes, const void* data) {
+        if (buffer == 0)
+            glGenBuffers(1, &buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<GLsizeiptr>(bytes, 4), data, data ? GL_DYNAMIC_COPY : GL_DYNAMIC_DRAW);
     };
+    allocate(cull.recordBuffer, cull.objectCount * sizeof(InstanceData), NULL);
+    allocate(cull.boundsBuffer, cull.objectCount * sizeof(GpuCullBounds), NULL);
+    allocate(cull.visibleBuffer, cull.objectCount * sizeof(GLuint), NULL);
+    allocate(cull.batchBuffer, batches.size() * sizeof(DrawElementsIndirectCommand), batches.data());
+    allocate(cull.commandBuffer, batches.size() * sizeof(DrawElementsIndirectCommand), batches.data());
+    allocate(cull.countBuffer, sizeof(GLuint), NULL);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    UGrowDrawIndices(cull.objectCount);
+    UUploadGpuCullObjects(0, cull.objectCount);
+    cull.builtGeneration = gMeshRegistry.generation;
+    cull.slicesCurrent = true;
+
+    cout << "GPU culling: " << cull.objectCount << " objects in " << cull.batchCount << " mesh batches, "
+        << (cull.indirectCount ? "draw count read from the GPU" : "no GL_ARB_indirect_parameters, empty batches drawn with 0 instances")
+        << endl;
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+// Uploads the draw records and bounds of objects [first, last)
+void UUploadGpuCullObjects(size_t first, size_t last)
+{
+    if (first >= last)
+        return;
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    const TransformStore& store = gTransforms;
+    std::vector<InstanceData> records(last - first);
+    std::vector<GpuCullBounds> bounds(last - first);
+    for (size_t i = first; i < last; ++i) {
+        records[i - first] = UGetInstanceData((uint32_t)i);
+        GpuCullBounds& objectBounds = bounds[i - first];
+        objectBounds.sphere = glm::vec4(store.boundsX[i], store.boundsY[i], store.boundsZ[i], store.boundsRadius[i]);
+        objectBounds.extent = glm::vec3(store.extentX[i], store.extentY[i], store.extentZ[i]);
+        objectBounds.batch = (uint32_t)gGpuCull.meshBatch[sceneObjects[i].mesh];
+    }
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gGpuCull.recordBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(InstanceData), records.size() * sizeof(InstanceData), records.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gGpuCull.boundsBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(GpuCullBounds), bounds.size() * sizeof(GpuCullBounds), bounds.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
 
-    // Create VBO
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// Reads back what the passes wrote and checks it names the same objects as CPU culling
+// does for the same frustum. Reading back stalls on the GPU, so this is a debugging aid
+void UValidateGpuCulling(const Frustum& frustum)
+{
+    GpuCulling& cull = gGpuCull;
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+    GLuint drawCount = cull.batchCount;
+    if (cull.indirectCount) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull.countBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &drawCount);
+    }
+    std::vector<DrawElementsIndirectCommand> commands(cull.batchCount);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull.commandBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data());
+    std::vector<GLuint> visibleList(cull.objectCount);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull.visibleBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, visibleList.size() * sizeof(GLuint), visibleList.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    std::vector<uint32_t> gpuVisible;
+    for (GLuint c = 0; c < std::min(drawCount, cull.batchCount); ++c)
+        gpuVisible.insert(gpuVisible.end(), visibleList.begin() + commands[c].baseInstance,
+            visibleList.begin() + commands[c].baseInstance + commands[c].instanceCount);
+    std::sort(gpuVisible.begin(), gpuVisible.end());
+
+    std::vector<uint32_t> cpuVisible;
+    if (gFrustumCulling)
+        UCullObjects(gTransforms, frustum, 0, cull.objectCount, cpuVisible);
+    else
+        for (uint32_t object = 0; object < cull.objectCount; ++object)
+            cpuVisible.push_back(object);
+
+    std::vector<uint32_t> different;
+    std::set_symmetric_difference(gpuVisible.begin(), gpuVisible.end(), cpuVisible.begin(), cpuVisible.end(),
+        std::back_inserter(different));
+    if (!different.empty())
+        cout << "GPU culling validation, frame " << cull.validatedFrames << ": " << gpuVisible.size() << " visible on the GPU, "
+            << cpuVisible.size() << " on the CPU, " << different.size() << " differ, first object " << different[0] << endl;
+
+    cull.mismatchedTotal += different.size();
+    cull.lastVisible = gpuVisible.size();
+    ++cull.validatedFrames;
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Prints the GPU path's CPU cost and, when validating, how it compared to CPU culling
+void UPrintGpuCullStats()
+{
+    const GpuCulling& cull = gGpuCull;
+    if (cull.frames == 0)
+        return;
+    cout << "GPU culling " << (gGpuCulling ? "on" : "off") << ": " << cull.objectCount << " objects, "
+        << cull.cpuMs << " ms of CPU last frame for upload, culling and submission, " << cull.cpuMsTotal / cull.frames
+        << " ms average" << endl;
+    if (cull.validatedFrames > 0)
+        cout << "GPU culling validation: " << cull.validatedFrames << " frames checked against CPU culling, "
+            << cull.mismatchedTotal << " objects differed in total, " << cull.lastVisible << " visible last frame" << endl;
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Compiles the culling passes and checks whether the draw count can stay on the GPU
+bool UCreateGpuCulling()
+{
+    if (!UCreateComputeProgram(cullShaderSource, gGpuCull.cullProgram) ||
+        !UCreateComputeProgram(compactShaderSource, gGpuCull.compactProgram))
+        return false;
+    gGpuCull.indirectCount = GLEW_ARB_indirect_parameters;
+    return true;
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+// Free the culling programs and buffers
+void UDestroyGpuCulling()
+{
+    GpuCulling& cull = gGpuCull;
+    UDestroyShaderProgram(cull.cullProgram);
+    UDestroyShaderProgram(cull.compactProgram);
+    for (GLuint* buffer : { &cull.recordBuffer, &cull.boundsBuffer, &cull.visibleBuffer,
+        &cull.batchBuffer, &cull.commandBuffer, &cull.countBuffer }) {
+        glDeleteBuffers(1, buffer);
+        *buffer = 0;
+    }
+    cull.builtGeneration = -1;
+    cull.objectCount = 0;
 }
 
-// Creates and caches all data required to draw a pyramid
-void UCreatePyramidMesh(GLMesh& mesh)
+// Fills gInstanceData with every queued object's transform and material, in queue order
+void UGatherInstanceData()
 {
-    // Vertex data
-    GLfloat verts[] = {
-        //Positions            // Normals          //Texture Coordinates
-        // Front face
-        -0.5f, -0.5f,  0.5f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
-         0.0f,  0.5f,  0.0f,   0.0f, 0.0f, 1.0f,   0.5f, 1.0f,
-         0.5f, -0.5f,  0.5f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,
+    gInstanceData.resize(gRenderQueue.items.size());
+    for (size_t i = 0; i < gRenderQueue.items.size(); ++i)
+        gInstanceData[i] = UGetInstanceData(gRenderQueue.items[i].objectIndex);
+}
 
-        // Right face
-         0.5f, -0.5f,  0.5f,   1.0f, 0.0f, 0.0f,   0.0f, 0.0f,
-         0.0f,  0.5f,  0.0f,   1.0f, 0.0f, 0.0f,   0.5f, 1.0f,
-         0.5f, -0.5f, -0.5f,   1.0f, 0.0f, 0.0f,   1.0f, 0.0f,
+// One object's transform and material as the instanced and multi-draw paths read them
+InstanceData UGetInstanceData(uint32_t objectIndex)
+{
+    const GLObject& currentObject = sceneObjects[objectIndex];
+    InstanceData data;
+    data.model = UGetDrawModel(objectIndex);
+    data.normal = gTransforms.normal[objectIndex];
+    data.material = glm::vec4(currentObject.uvScale, UGetBasicTexSpecIntensity(currentObject.texture),
+        (float)UGetBasicTextureLayer(currentObject.texture));
+    return data;
+}
 
-        // Back face
-         0.5f, -0.5f, -0.5f,   0.0f, 0.0f, -1.f,   1.0f, 0.0f,
-         0.0f,  0.5f,  0.0f,   0.0f, 0.0f, -1.f,   0.5f, 1.0f,
-        -0.5f, -0.5f, -0.5f,   0.0f, 0.0f, -1.f,   0.0f, 0.0f,
+// World matrix a draw hands the shader. Quantized positions arrive as 0 to 1 across the
+// mesh's box, so the box's offset and scale are folded in; normals keep the plain normal matrix
+glm::mat4 UGetDrawModel(uint32_t objectIndex)
+{
+    const glm::mat4& world = gTransforms.world[objectIndex];
+    if (!gQuantizedVertices)
+        return world;
+
+    const MeshBounds& bounds = gMeshRegistry.entries[sceneObjects[objectIndex].mesh].bounds;
+    const glm::vec3 offset = bounds.center - bounds.extent;
+    const glm::vec3 scale = bounds.extent * 2.0f;
+    glm::mat4 model = world;
+    model[0] = world[0] * scale.x;
+    model[1] = world[1] * scale.y;
+    model[2] = world[2] * scale.z;
+    model[3] = world * glm::vec4(offset, 1.0f);
+    return model;
+}
 
-        // Left face
-        -0.5f, -0.5f, -0.5f,   -1.f, 0.0f, 0.0f,   1.0f, 0.0f,
-         0.0f,  0.5f,  0.0f,   -1.f, 0.0f, 0.0f,   0.5f, 1.0f,
-        -0.5f, -0.5f,  0.5f,   -1.f, 0.0f, 0.0f,   0.0f, 0.0f,
+// Uploads per-frame data into a stream buffer, growing it when needed and orphaning the old
+// storage otherwise so we never wait on draws still reading last frame's contents
+void UStreamBuffer(GLenum target, GLuint buffer, GLsizeiptr& capacity, const void* data, GLsizeiptr bytes)
+{
+    glBindBuffer(target, buffer);
+    if (bytes > capacity) {
+        capacity = bytes;
+        glBufferData(target, bytes, data, GL_STREAM_DRAW);
+    }
+    else {
+        glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(target, 0, bytes, data);
+    }
+    glBindBuffer(target, 0);
+}
 
-        // Bottom face
-        -0.5f, -0.5f, -0.5f,   0.0f, -1.f, 0.0f,   0.0f, 1.0f,
-         0.5f, -0.5f, -0.5f,   0.0f, -1.f, 0.0f,   1.0f, 1.0f,
-         0.5f, -0.5f,  0.5f,   0.0f, -1.f, 0.0f,   1.0f, 0.0f,
-         0.5f, -0.5f,  0.5f,   0.0f, -1.f, 0.0f,   1.0f, 0.0f,
-        -0.5f, -0.5f,  0.5f,   0.0f, -1.f, 0.0f,   0.0f, 0.0f,
-        -0.5f, -0.5f, -0.5f,   0.0f, -1.f, 0.0f,   0.0f, 1.0f,
-    };
+// Writes the current framebuffer contents to a binary PPM file
+bool USaveScreenshot(const char* filename)
+{
+    std::vector<unsigned char> pixels;
+    UReadFramebuffer(pixels);
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    file << "P6\n" << WINDOW_WIDTH << " " << WINDOW_HEIGHT << "\n255\n";
+    // GL rows start at the bottom, PPM rows at the top
+    for (int row = WINDOW_HEIGHT - 1; row >= 0; --row)
+        file.write((const char*)&pixels[row * WINDOW_WIDTH * 3], WINDOW_WIDTH * 3);
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    return (bool)file;
+}
 
-    // Create VBO
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// Reads the current framebuffer back as tightly packed RGB rows, bottom row first
+void UReadFramebuffer(std::vector<unsigned char>& pixels)
+{
+    pixels.resize(WINDOW_WIDTH * WINDOW_HEIGHT * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+}
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+// --verify-quantized: draws the last frame again in the other vertex format and checks the two
+// frames agree within tolerance, then prints what each format costs in vertex bandwidth
+void UVerifyQuantizedVertices()
+{
+    std::vector<unsigned char> first;
+    std::vector<unsigned char> second;
+    UReadFramebuffer(first);
+
+    // Nothing may move between the two frames
+    const float deltaTime = gDeltaTime;
+    gDeltaTime = 0.0f;
+    USetVertexFormat(!gQuantizedVertices);
+    URender();
+    UReadFramebuffer(second);
+    USetVertexFormat(!gQuantizedVertices);
+    URender();
+    gDeltaTime = deltaTime;
+
+    int maxError = 0;
+    double totalError = 0.0;
+    size_t changedPixels = 0;
+    for (size_t i = 0; i < first.size(); i += 3) {
+        int pixelError = 0;
+        for (size_t c = i; c < i + 3; ++c) {
+            int error = abs((int)first[c] - (int)second[c]);
+            pixelError = std::max(pixelError, error);
+            totalError += error;
+        }
+        maxError = std::max(maxError, pixelError);
+        if (pixelError > 8)
+            ++changedPixels;
+    }
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    const size_t pixels = first.size() / 3;
+    const double meanError = totalError / first.size();
+    const bool passed = meanError <= QUANTIZED_MAX_MEAN_ERROR && changedPixels <= pixels * QUANTIZED_MAX_CHANGED_SHARE;
+    cout << "Quantized vertex check " << (passed ? "passed" : "FAILED") << ": max error " << maxError << ", mean "
+        << meanError << " (limit " << QUANTIZED_MAX_MEAN_ERROR << "), " << changedPixels << " of " << pixels
+        << " pixels more than 8 apart (limit " << (size_t)(pixels * QUANTIZED_MAX_CHANGED_SHARE) << ")" << endl;
+    UPrintVertexFormatStats();
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Finishes the frame, either on screen or in the offscreen target
+void UPresentFrame()
+{
+    // Headless frames have nothing to swap, but waiting for the GPU keeps
+    // the measured frame time honest
+    if (gHeadless)
+    {
+        glFinish();
+        return;
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // Flip the the back buffer with the front buffer every frame
+    // to prevent screen tearing
+    glfwSwapBuffers(gWindow);
 }
 
-// Creates and caches all data required to draw a plane
-void UCreatePlaneMesh(GLMesh& mesh)
+// Sets up the query ring and one timing scope per fixed pass and scene object
+void UGpuProfilerInit(int objectCount)
 {
-    // Vertex data
-    GLfloat verts[] = {
-        // Positions           // Normals          //Texture Coordinates
-        // Front face top tri
-        -0.5f,  0.0f, -0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 0.0f,
-         0.5f,  0.0f,  0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 1.0f,
-        -0.5f,  0.0f,  0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 1.0f,
-
-        // Front face bottom tri
-        -0.5f,  0.0f, -0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 0.0f,
-         0.5f,  0.0f, -0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 0.0f,
+    const char* fixedNames[] = { "frame", "clear", "swap" };
+    gGpuProfiler.scopes.resize(GPU_SCOPE_OBJECTS + std::min(objectCount, GPU_PROFILER_MAX_OBJECTS));
+    for (size_t i = 0; i < gGpuProfiler.scopes.size(); ++i)
+    {
+        GpuScopeTimings& scope = gGpuProfiler.scopes[i];
+        if (i < GPU_SCOPE_OBJECTS)
+        {
+            scope.name = fixedNames[i];
+            scope.objectIndex = -1;
+        }
+        else
+        {
+            scope.objectIndex = (int)i - GPU_SCOPE_OBJECTS;
+            scope.name = "object[" + std::to_string(scope.objectIndex) + "]";
+        }
+    }
+    if (objectCount > GPU_PROFILER_MAX_OBJECTS)
+        gGpuProfiler.scopes.back().name = "object[" + std::to_string(GPU_PROFILER_MAX_OBJECTS - 1) + "+]";
+}
+
+// Profiler scope for a sceneObjects[] index. Large scenes would need megabytes of history
+// per object, so everything past GPU_PROFILER_MAX_OBJECTS lands in the last scope
+int UGpuObjectScope(uint32_t objectIndex)
+{
+    return GPU_SCOPE_OBJECTS + (int)std::min<uint32_t>(objectIndex, GPU_PROFILER_MAX_OBJECTS - 1);
+}
+
+// Frees every query the profiler created
+void UGpuProfilerShutdown()
+{
+    for (GpuQueryFrame& frame : gGpuProfiler.frames)
+    {
+        if (!frame.timestamps.empty())
+            glDeleteQueries((GLsizei)frame.timestamps.size(), frame.timestamps.data());
+        frame.timestamps.clear();
+    }
+}
+
+// Opens a frame in the next ring slot, harvesting whatever that slot measured last time round
+void UGpuProfilerBeginFrame()
+{
+    if (!gGpuProfiler.enabled)
+        return;
+
+    GpuQueryFrame& frame = gGpuProfiler.frames[gGpuProfiler.frameIndex];
+    if (frame.pending)
+        UGpuProfilerCollect(frame);
+
+    frame.marks.clear();
+    frame.cpuMs.clear();
+    if (frame.timestamps.empty())
+    {
+        frame.timestamps.resize(1);
+        glGenQueries(1, frame.timestamps.data());
+    }
+
+    glQueryCounter(frame.timestamps[0], GL_TIMESTAMP);
+    gGpuProfiler.lastMark = std::chrono::high_resolution_clock::now();
+}
+
+// Closes the scope that has been running since the previous mark
+void UGpuProfilerMark(int scope)
+{
+    if (!gGpuProfiler.enabled)
+        return;
+
+    GpuQueryFrame& frame = gGpuProfiler.frames[gGpuProfiler.frameIndex];
+    // Grow the query pool the first time a frame needs more marks than before
+    size_t timestampIndex = frame.marks.size() + 1;
+    if (timestampIndex >= frame.timestamps.size())
+    {
+        frame.timestamps.resize(timestampIndex + 1);
+        glGenQueries(1, &frame.timestamps[timestampIndex]);
+    }
+
+    glQueryCounter(frame.timestamps[timestampIndex], GL_TIMESTAMP);
+    frame.marks.push_back(scope);
+
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    frame.cpuMs.push_back(std::chrono::duration<float, std::milli>(now - gGpuProfiler.lastMark).count());
+    gGpuProfiler.lastMark = now;
+}
+
+// Ends the frame and advances the query ring
+void UGpuProfilerEndFrame()
+{
+    if (!gGpuProfiler.enabled)
+        return;
+
+    gGpuProfiler.frames[gGpuProfiler.frameIndex].pending = true;
+
+    gGpuProfiler.frameIndex = (gGpuProfiler.frameIndex + 1) % GPU_QUERY_FRAMES;
+}
+
+// Reads back a finished frame's queries into the rolling histories, or drops the frame
+// if the GPU is still behind so we never wait on it
+void UGpuProfilerCollect(GpuQueryFrame& frame)
+{
+    frame.pending = false;
+
+    // Timestamps complete in order, so the last one being ready means they all are
+    GLint available = 0;
+    glGetQueryObjectiv(frame.timestamps[frame.marks.size()], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+    {
+        ++gGpuProfiler.droppedFrames;
+        return;
+    }
+
+    float frameCpuMs = 0.f;
+    GLuint64 frameStart = 0;
+    glGetQueryObjectui64v(frame.timestamps[0], GL_QUERY_RESULT, &frameStart);
+    GLuint64 previous = frameStart;
+    for (size_t i = 0; i < frame.marks.size(); ++i)
+    {
+        GLuint64 timestamp = 0;
+        glGetQueryObjectui64v(frame.timestamps[i + 1], GL_QUERY_RESULT, &timestamp);
+
+        GpuScopeTimings& scope = gGpuProfiler.scopes[frame.marks[i]];
+        scope.gpu.Add((timestamp - previous) / 1.0e6f);
+        scope.cpu.Add(frame.cpuMs[i]);
+        frameCpuMs += frame.cpuMs[i];
+        previous = timestamp;
+    }
+    gGpuProfiler.scopes[GPU_SCOPE_FRAME].gpu.Add((previous - frameStart) / 1.0e6f);
+    gGpuProfiler.scopes[GPU_SCOPE_FRAME].cpu.Add(frameCpuMs);
+}
+
+// Prints mean and percentiles of every scope's rolling window, as a table or CSV
+void UGpuProfilerDump(std::ostream& out, bool csv)
+{
+    // Nearest-rank percentiles over a copy of the window
+    struct Summary { float mean, p50, p95, p99, max; };
+    auto summarize = [](const TimingHistory& history) {
+        Summary summary = { 0.f, 0.f, 0.f, 0.f, 0.f };
+        if (history.count == 0)
+            return summary;
+
+        std::vector<float> sorted(history.samples, history.samples + history.count);
+        std::sort(sorted.begin(), sorted.end());
+        for (float ms : sorted)
+            summary.mean += ms;
+        summary.mean /= sorted.size();
+
+        auto rank = [&sorted](float p) {
+            size_t index = (size_t)std::ceil(p / 100.f * sorted.size());
+            return sorted[index > 0 ? index - 1 : 0];
+        };
+        summary.p50 = rank(50.f);
+        summary.p95 = rank(95.f);
+        summary.p99 = rank(99.f);
+        summary.max = sorted.back();
+        return summary;
+    };
+
+    if (csv)
+        out << "scope,object_index,samples,gpu_mean_ms,gpu_p50_ms,gpu_p95_ms,gpu_p99_ms,gpu_max_ms,"
+            "cpu_mean_ms,cpu_p50_ms,cpu_p95_ms,cpu_p99_ms,cpu_max_ms" << endl;
+    else
+        out << "GPU profile, last " << gGpuProfiler.scopes[GPU_SCOPE_FRAME].gpu.count << " frames ("
+            << gGpuProfiler.droppedFrames << " dropped while the GPU was behind), ms" << endl
+            << "  scope          gpu mean    p50     p95     p99    | cpu mean    p50     p95     p99" << endl;
+
+    for (const GpuScopeTimings& scope : gGpuProfiler.scopes)
+    {
+        Summary gpu = summarize(scope.gpu);
+        Summary cpu = summarize(scope.cpu);
+        if (csv)
+        {
+            out << scope.name << "," << scope.objectIndex << "," << scope.gpu.count << ","
+                << gpu.mean << "," << gpu.p50 << "," << gpu.p95 << "," << gpu.p99 << "," << gpu.max << ","
+                << cpu.mean << "," << cpu.p50 << "," << cpu.p95 << "," << cpu.p99 << "," << cpu.max << endl;
+        }
+        else
+        {
+            char line[160];
+            snprintf(line, sizeof(line), "  %-12s %8.3f %7.3f %7.3f %7.3f  | %8.3f %7.3f %7.3f %7.3f",
+                scope.name.c_str(), gpu.mean, gpu.p50, gpu.p95, gpu.p99, cpu.mean, cpu.p50, cpu.p95, cpu.p99);
+            out << line << endl;
+        }
+    }
+}
+
+// Writes the CSV form of the profile dump to a file
+bool UGpuProfilerWriteCsv(const char* filename)
+{
+    std::ofstream file(filename);
+    if (!file)
+        return false;
+
+    UGpuProfilerDump(file, true);
+    return (bool)file;
+}
+
+// Builds the projection for the current view mode
+glm::mat4 UGetProjectionMatrix()
+{
+    if (gOrthoView) {
+        //projection = glm::ortho<float>(0.0f, (float)WINDOW_WIDTH, 0.0f, (float)WINDOW_HEIGHT, -1.0f, 1.0f);
+        float widthHalf = 2.f;
+        float heightHalf = 2.f;
+        return glm::ortho<float>(-widthHalf, widthHalf, -heightHalf, heightHalf, PROJECTION_NEAR, PROJECTION_FAR);
+    }
+
+    // Creates a perspective projection from the camera
+    return glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, PROJECTION_NEAR, PROJECTION_FAR);
+}
+
+// Creates the FrameData uniform buffer and attaches it to its binding point
+void UCreateFrameUniformBuffer()
+{
+    glGenBuffers(1, &gFrameUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, gFrameUbo);
+}
+
+// Uploads this frame's camera matrices, view position and light cluster layout
+void UUpdateFrameUniformBuffer()
+{
+    FrameData frame;
+    frame.view = gCamera.GetViewMatrix();
+    frame.projection = UGetProjectionMatrix();
+    frame.viewPosition = glm::vec4(gCamera.Position, 1.f);
+
+    // Slice = log(depth) * scale + bias puts the near plane at 0 and the far plane at the last slice's end
+    const float depthLog = logf(PROJECTION_FAR / PROJECTION_NEAR);
+    frame.clusterGrid[0] = CLUSTER_TILES_X;
+    frame.clusterGrid[1] = CLUSTER_TILES_Y;
+    frame.clusterGrid[2] = CLUSTER_SLICES;
+    frame.clusterGrid[3] = 0;
+    frame.clusterScale = glm::vec4((float)gViewportWidth / CLUSTER_TILES_X, (float)gViewportHeight / CLUSTER_TILES_Y,
+        CLUSTER_SLICES / depthLog, -(float)CLUSTER_SLICES * logf(PROJECTION_NEAR) / depthLog);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Free the FrameData uniform buffer
+void UDestroyFrameUniformBuffer()
+{
+    glDeleteBuffers(1, &gFrameUbo);
+}
+
+// Builds the light binning pass and its buffers, with the sky and bonus lights plus any
+// --lights street lights in the list
+bool UCreateClusteredLighting()
+{
+    ClusteredLighting& lighting = gLighting;
+    if (!UCreateComputeProgram(lightBinShaderSource, lighting.binProgram))
+        return false;
+
+    lighting.lights.assign(UNBOUNDED_LIGHTS, PointLight());
+    UGenerateStreetLights(gStreetLights);
+
+    glGenBuffers(1, &lighting.lightBuffer);
+    glGenBuffers(1, &lighting.clusterBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.clusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)CLUSTER_COUNT * 2 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glGenBuffers(1, &lighting.counterReadback);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.counterReadback);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UAllocateLightList(CLUSTER_COUNT * LIGHT_LIST_START_AVERAGE);
+    lighting.lightsCurrent = false;
+    return true;
+}
+
+// (Re)allocates the shared light index list with room for capacity indices
+void UAllocateLightList(GLuint capacity)
+{
+    ClusteredLighting& lighting = gLighting;
+    if (lighting.indexBuffer == 0)
+        glGenBuffers(1, &lighting.indexBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.indexBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, ((GLsizeiptr)capacity + 1) * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    lighting.listCapacity = capacity;
+}
+
+// Free the binning program and the light buffers
+void UDestroyClusteredLighting()
+{
+    ClusteredLighting& lighting = gLighting;
+    UDestroyShaderProgram(lighting.binProgram);
+    glDeleteBuffers(1, &lighting.lightBuffer);
+    glDeleteBuffers(1, &lighting.clusterBuffer);
+    glDeleteBuffers(1, &lighting.indexBuffer);
+    glDeleteBuffers(1, &lighting.counterReadback);
+    if (lighting.counterFence)
+        glDeleteSync(lighting.counterFence);
+    lighting = ClusteredLighting();
+}
+
+// --lights: scatters street lamps and, every fourth light, car lights over the ground the
+// scene covers
+void UGenerateStreetLights(int count)
+{
+    const TransformStore& store = gTransforms;
+    if (count <= 0 || store.world.empty())
+        return;
+
+    glm::vec3 low(FLT_MAX);
+    glm::vec3 high(-FLT_MAX);
+    for (size_t i = 0; i < store.world.size(); ++i) {
+        glm::vec3 center(store.boundsX[i], store.boundsY[i], store.boundsZ[i]);
+        low = glm::min(low, center);
+        high = glm::max(high, center);
+    }
+
+    std::mt19937 random(23);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int i = 0; i < count; ++i) {
+        float x = low.x + (high.x - low.x) * unit(random);
+        float z = low.z + (high.z - low.z) * unit(random);
+        PointLight light;
+        if (i % 4 == 3) {
+            // Head and tail lights sit low and don't reach far
+            bool tail = unit(random) < 0.5f;
+            light.positionRadius = glm::vec4(x, low.y + 0.5f, z, 2.0f);
+            light.color = tail ? glm::vec4(0.8f, 0.05f, 0.02f, 0.0f) : glm::vec4(0.8f, 0.75f, 0.6f, 0.0f);
+        }
+        else {
+            light.positionRadius = glm::vec4(x, low.y + 3.0f, z, 5.0f);
+            light.color = glm::vec4(0.9f, 0.6f, 0.3f, 0.0f);
+        }
+        gLighting.lights.push_back(light);
+    }
+}
+
+// Refreshes the sky and bonus lights and bins every light into the cluster grid for this
+// frame's view, leaving both buffers bound for the fragment shader
+void UBinLights()
+{
+    ClusteredLighting& lighting = gLighting;
+    lighting.lights[0].positionRadius = glm::vec4(gSkyLightPosition, 0.0f);
+    lighting.lights[0].color = glm::vec4(gSkyLightColor * gSkyLightBrightness, 0.0f);
+    lighting.lights[1].positionRadius = glm::vec4(gBonusLightPosition, 0.0f);
+    lighting.lights[1].color = glm::vec4(gBonusLightColor * gBonusLightBrightness, 0.0f);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.lightBuffer);
+    if (!lighting.lightsCurrent) {
+        glBufferData(GL_SHADER_STORAGE_BUFFER, lighting.lights.size() * sizeof(PointLight), lighting.lights.data(), GL_DYNAMIC_DRAW);
+        lighting.lightsCurrent = true;
+    }
+    else {
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, UNBOUNDED_LIGHTS * sizeof(PointLight), lighting.lights.data());
+    }
+    // Last frame's handed out count comes back behind a fence, so this never waits on the GPU.
+    // A frame that asked for more than the list holds grows it for the frames after
+    if (lighting.counterFence) {
+        GLenum status = glClientWaitSync(lighting.counterFence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            glDeleteSync(lighting.counterFence);
+            lighting.counterFence = 0;
+            GLuint requested = 0;
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.counterReadback);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &requested);
+            ++lighting.sampledFrames;
+            if (requested > lighting.listCapacity) {
+                lighting.droppedIndices += requested - lighting.listCapacity;
+                ++lighting.overflowFrames;
+                UAllocateLightList(requested + requested / 2);
+            }
+        }
+    }
+
+    // Nothing handed out yet this frame
+    const GLuint zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.indexBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    const ShaderProgram& program = lighting.binProgram;
+    glUseProgram(program.id);
+    glUniformMatrix4fv(program.Uniform("view"), 1, GL_FALSE, glm::value_ptr(gCamera.GetViewMatrix()));
+    glUniformMatrix4fv(program.Uniform("inverseProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(UGetProjectionMatrix())));
+    glUniform3ui(program.Uniform("clusterGrid"), CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+    glUniform1ui(program.Uniform("listCapacity"), lighting.listCapacity);
+    glUniform2f(program.Uniform("depthRange"), PROJECTION_NEAR, PROJECTION_FAR);
+    glUniform1ui(program.Uniform("firstLight"), UNBOUNDED_LIGHTS);
+    glUniform1ui(program.Uniform("lightCount"), (GLuint)lighting.lights.size());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHTS_BINDING, lighting.lightBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_RANGES_BINDING, lighting.clusterBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_INDICES_BINDING, lighting.indexBuffer);
+    glDispatchCompute((CLUSTER_COUNT + LIGHT_BIN_GROUP_SIZE - 1) / LIGHT_BIN_GROUP_SIZE, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    // One count in flight at a time
+    if (!lighting.counterFence) {
+        glBindBuffer(GL_COPY_READ_BUFFER, lighting.indexBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, lighting.counterReadback);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GLuint));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        lighting.counterFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
+// Reads back last frame's cluster ranges and prints how many lights a fragment had to shade,
+// and how many indices didn't fit before the shared list grew. Only sampled frames are counted,
+// frames binned while a readback was in flight aren't checked
+void UPrintLightingStats()
+{
+    const ClusteredLighting& lighting = gLighting;
+    std::vector<GLuint> ranges((size_t)CLUSTER_COUNT * 2);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.clusterBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, ranges.size() * sizeof(GLuint), ranges.data());
+    GLuint requested = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lighting.indexBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &requested);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    size_t total = 0;
+    GLuint most = 0;
+    for (GLuint cluster = 0; cluster < CLUSTER_COUNT; ++cluster) {
+        GLuint count = ranges[(size_t)cluster * 2 + 1];
+        total += count;
+        most = std::max(most, count);
+    }
+    cout << "Clustered lighting: " << lighting.lights.size() - UNBOUNDED_LIGHTS << " bounded lights in " << CLUSTER_TILES_X << "x" << CLUSTER_TILES_Y << "x"
+        << CLUSTER_SLICES << " clusters plus " << UNBOUNDED_LIGHTS << " everywhere. Last frame " << (double)total / CLUSTER_COUNT << " lights per cluster on average, "
+        << most << " at most, " << requested << " indices in a list of " << lighting.listCapacity << ". "
+        << lighting.droppedIndices + (requested > lighting.listCapacity ? requested - lighting.listCapacity : 0)
+        << " indices dropped in " << lighting.overflowFrames + (requested > lighting.listCapacity ? 1 : 0)
+        << " overflowing of " << lighting.sampledFrames + 1 << " sampled frames before the list grew" << endl;
+}
+
+// Packs the state a draw needs into a sort key, see RenderQueue for the layout
+uint64_t UMakeSortKey(RenderPass pass, GLuint program, GLuint mesh, GLuint texture, float viewDepth)
+{
+    // Front to back within a state bucket so early depth testing rejects more fragments
+    float depthFraction = glm::clamp(viewDepth / 100.f, 0.f, 1.f);
+    uint64_t depth = (uint64_t)(depthFraction * SORT_KEY_DEPTH_MAX);
+
+    return ((uint64_t)pass << SORT_KEY_PASS_SHIFT)
+        | ((uint64_t)(program & 0x3F) << SORT_KEY_PROGRAM_SHIFT)
+        | ((uint64_t)(mesh & 0xFFFF) << SORT_KEY_MESH_SHIFT)
+        | ((uint64_t)(texture & 0xFFFF) << SORT_KEY_TEXTURE_SHIFT)
+        | depth;
+}
+
+// Least significant digit radix sort on the keys, one byte per pass. Passes where
+// every key has the same byte are skipped, which is most of them for small scenes
+void URadixSortRenderQueue(RenderQueue& queue)
+{
+    std::vector<RenderItem>& source = queue.items;
+    std::vector<RenderItem>& destination = queue.scratch;
+    destination.resize(source.size());
+
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        size_t offsets[256] = { 0 };
+        for (const RenderItem& item : source)
+            ++offsets[(item.key >> shift) & 0xFF];
+
+        if (offsets[(source.empty() ? 0 : (source[0].key >> shift) & 0xFF)] == source.size())
+            continue;
+
+        // Turn counts into starting positions
+        size_t total = 0;
+        for (size_t& offset : offsets)
+        {
+            size_t count = offset;
+            offset = total;
+            total += count;
+        }
+
+        for (const RenderItem& item : source)
+            destination[offsets[(item.key >> shift) & 0xFF]++] = item;
+
+        source.swap(destination);
+    }
+}
+
+// Counts the binds needed to submit the items in order, skipping redundant ones
+BindCounts UCountBinds(const std::vector<RenderItem>& items)
+{
+    BindCounts counts;
+    uint64_t previous = 0;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        uint64_t key = items[i].key;
+        if (i == 0 || ((key ^ previous) >> SORT_KEY_PROGRAM_SHIFT & 0x3F))
+            ++counts.programs;
+        if (i == 0 || ((key ^ previous) >> SORT_KEY_MESH_SHIFT & 0xFFFF))
+            ++counts.meshes;
+        if (i == 0 || ((key ^ previous) >> SORT_KEY_TEXTURE_SHIFT & 0xFFFF))
+            ++counts.layers;
+        previous = key;
+    }
+    return counts;
+}
+
+// Prints last frame's bind counts in declaration order versus key order
+void UPrintRenderQueueStats()
+{
+    UPrintMeshRegistryStats();
+
+    const BindCounts& before = gRenderQueue.unsortedBinds;
+    const BindCounts& after = gRenderQueue.sortedBinds;
+    cout << "Render queue: " << gRenderQueue.items.size() << " draws, binds before sorting "
+        << before.Total() << " (" << before.programs << " program, " << before.meshes << " mesh; "
+        << before.layers << " layer switches), after " << after.Total() << " (" << after.programs
+        << " program, " << after.meshes << " mesh; " << after.layers << " layer switches), 1 texture bind" << endl;
+}
+
+// Prints the draw calls issued last frame against what the other submission path needs
+void UPrintDrawCallStats()
+{
+    if (gGpuCulling) {
+        cout << "Draw calls: " << gDrawCalls << " issued (GPU culled multi-draw) over " << gGpuCull.batchCount
+            << " mesh batches, the CPU paths' counts aren't known" << endl;
+        return;
+    }
+    const char* path = gMultiDrawRendering ? "multi-draw" : gInstancedRendering ? "instanced" : "per object";
+    cout << "Draw calls: " << gDrawCalls << " issued (" << path << "), per object path needs "
+        << gPerObjectDrawCalls << ", instanced path needs " << gInstancedDrawCalls
+        << ", multi-draw path needs " << gRenderQueue.sortedBinds.programs << " with " << gInstancedDrawCalls
+        << " indirect commands" << endl;
+}
+
+// Resolves the texture array layer holding one of our basic textures
+GLuint UGetBasicTextureLayer(BasicTexture basicTex)
+{
+    // Layers are loaded in BasicTexture order
+    return (GLuint)basicTex;
+}
+
+// Creates and caches our scene objects
+void UCreateSceneObjects()
+{
+    // Every level of each shape in the scene is made up front, so switching levels later is free
+    gLodChains.assign(SHAPE_NAME_COUNT, LodChain());
+    for (const GLObject& currentObject : sceneObjects) {
+        LodChain& chain = gLodChains[(int)currentObject.shape];
+        if (chain.levels > 0)
+            continue;
+        chain.levels = ULodLevelCount(currentObject.shape);
+        for (int level = 0; level < chain.levels; ++level) {
+            chain.keys[level] = ULodMeshKey(currentObject.shape, level);
+            chain.meshes[level] = UAcquireMesh(chain.keys[level]);
+        }
+    }
+
+    // Fill sceneObjects with juicy data, objects of the same shape share one mesh
+    gLodStats.sceneTriangles = 0;
+    for (GLObject& currentObject : sceneObjects) {
+        currentObject.mesh = UAcquireMesh(UDefaultMeshKey(currentObject.shape));
+        gLodStats.sceneTriangles += UGetMesh(currentObject.mesh).nIndices / 3;
+    }
+    gObjectLod.assign(sceneObjects.size(), 0);
+
+    UPrintMeshRegistryStats();
+    UBuildSceneHierarchy();
+    UInitTransformStore(gTransforms, sceneObjects);
+}
+
+// Drops each SceneObject's reference to its mesh, freeing meshes nobody uses anymore
+void UDestroySceneObjects() {
+    // Loop through the sceneObjects array
+    for (GLObject& currentObject : sceneObjects) {
+        UReleaseMesh(currentObject.mesh);
+        currentObject.mesh = -1;
+    }
+
+    // Then the chains' own references
+    for (LodChain& chain : gLodChains)
+        for (int level = 0; level < chain.levels; ++level)
+            UReleaseMesh(chain.meshes[level]);
+    gLodChains.clear();
+}
+
+// Builds the scene object a scene file record describes
+GLObject UMakeSceneObject(const SceneRecord& record)
+{
+    return GLObject((PrimitiveShape)record.shape, (BasicTexture)record.texture, record.uvScale,
+        record.translation, record.rotation, record.scale, record.parent);
+}
+
+// Fills store from objects and computes every world and normal matrix. objects has to be
+// in pre-order already, see UBuildSceneHierarchy(). Objects without a mesh get the unit cube's bounds
+void UInitTransformStore(TransformStore& store, const std::vector<GLObject>& objects)
+{
+    const size_t count = objects.size();
+    UResizeTransformStore(store, count);
+
+    // A parent's subtree ends where its last child's does, walking backwards sees children first
+    for (size_t i = 0; i < count; ++i) {
+        store.parent[i] = objects[i].parent;
+        if (objects[i].mesh >= 0)
+            store.localBounds[i] = gMeshRegistry.entries[objects[i].mesh].bounds;
+    }
+    for (size_t i = count; i-- > 0; )
+        if (store.parent[i] >= 0)
+            store.subtreeEnd[store.parent[i]] = std::max(store.subtreeEnd[store.parent[i]], store.subtreeEnd[i]);
+
+    // Going through the old Euler matrix keeps rotations exactly as the constructor meant them
+    const int jobCount = std::max<int>(1, (int)gThreadPool.workers.size() * 4);
+    UParallelFor(jobCount, [&store, &objects, count, jobCount](int job) {
+        for (size_t i = count * job / jobCount; i < count * (job + 1) / jobCount; ++i) {
+            const GLObject& object = objects[i];
+            glm::quat rotation = glm::quat_cast(glm::mat3(glm::eulerAngleXYZ(glm::radians(object.rotation.x),
+                glm::radians(object.rotation.y), glm::radians(object.rotation.z))));
+            USetTransform(store, i, object.translation, rotation, object.scale);
+        }
+    });
+
+    store.dirtyRanges.clear();
+    UMarkTransformsDirty(store, 0, count);
+    UUpdateTransforms(store);
+
+    // Only frame updates go in the stats
+    store.updatedTotal = 0;
+    store.updateMsTotal = 0.0;
+    store.updateCount = 0;
+}
+
+void UResizeTransformStore(TransformStore& store, size_t count)
+{
+    for (std::vector<float>* component : { &store.positionX, &store.positionY, &store.positionZ,
+        &store.rotationX, &store.rotationY, &store.rotationZ, &store.rotationW,
+        &store.scaleX, &store.scaleY, &store.scaleZ,
+        &store.worldPositionX, &store.worldPositionY, &store.worldPositionZ,
+        &store.worldRotationX, &store.worldRotationY, &store.worldRotationZ, &store.worldRotationW,
+        &store.boundsX, &store.boundsY, &store.boundsZ, &store.boundsRadius,
+        &store.extentX, &store.extentY, &store.extentZ })
+        component->resize(count);
+    // Flat until someone fills in parents
+    store.parent.assign(count, -1);
+    store.subtreeEnd.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        store.subtreeEnd[i] = (uint32_t)i + 1;
+    store.world.resize(count);
+    store.normal.resize(count);
+    store.localBounds.resize(count);
+}
+
+// Writes one object's transform, relative to its parent. Its matrices catch up at the
+// next UUpdateTransforms once the object is marked dirty
+void USetTransform(TransformStore& store, size_t index, glm::vec3 position, glm::quat rotation, glm::vec3 scale)
+{
+    store.positionX[index] = position.x;
+    store.positionY[index] = position.y;
+    store.positionZ[index] = position.z;
+    store.rotationX[index] = rotation.x;
+    store.rotationY[index] = rotation.y;
+    store.rotationZ[index] = rotation.z;
+    store.rotationW[index] = rotation.w;
+    store.scaleX[index] = scale.x;
+    store.scaleY[index] = scale.y;
+    store.scaleZ[index] = scale.z;
+}
+
+// Moves an object and everything attached to it
+void UMoveObject(TransformStore& store, size_t index, glm::vec3 position)
+{
+    store.positionX[index] = position.x;
+    store.positionY[index] = position.y;
+    store.positionZ[index] = position.z;
+    UMarkSubtreeDirty(store, index);
+}
+
+// Queues an object and all its descendants for the next update
+void UMarkSubtreeDirty(TransformStore& store, size_t index)
+{
+    UMarkTransformsDirty(store, index, store.subtreeEnd[index]);
+}
+
+// Queues [first, last) for the next update, growing the previous range when they touch
+void UMarkTransformsDirty(TransformStore& store, size_t first, size_t last)
+{
+    if (!store.dirtyRanges.empty()) {
+        std::pair<size_t, size_t>& previous = store.dirtyRanges.back();
+        if (first <= previous.second && last >= previous.first) {
+            previous.first = std::min(previous.first, first);
+            previous.second = std::max(previous.second, last);
+            return;
+        }
+    }
+    store.dirtyRanges.push_back(std::make_pair(first, last));
+}
+
+// Recomputes the matrices of every object marked dirty since the last update. Ranges go
+// in index order, so a parent's world transform is always current before its children use it
+void UUpdateTransforms(TransformStore& store)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::pair<size_t, size_t>>& ranges = store.dirtyRanges;
+    std::sort(ranges.begin(), ranges.end());
+    store.updatedRanges.clear();
+    size_t updated = 0;
+    for (size_t i = 0; i < ranges.size(); ) {
+        size_t first = ranges[i].first, last = ranges[i].second;
+        for (++i; i < ranges.size() && ranges[i].first <= last; ++i)
+            last = std::max(last, ranges[i].second);
+        UPropagateTransforms(store, first, last);
+        UComputeTransforms(store, first, last);
+        UComputeBounds(store, first, last);
+        store.updatedRanges.push_back(std::make_pair(first, last));
+        updated += last - first;
+    }
+    ranges.clear();
+
+    store.updatedLastFrame = updated;
+    store.updatedTotal += updated;
+    store.updateMsTotal += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    ++store.updateCount;
+}
+
+// World position and rotation for objects [first, last): a root's are its own, a child's
+// are its own carried along by the parent's position and rotation
+void UPropagateTransforms(TransformStore& store, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; ++i) {
+        glm::quat local(store.rotationW[i], store.rotationX[i], store.rotationY[i], store.rotationZ[i]);
+        glm::vec3 position(store.positionX[i], store.positionY[i], store.positionZ[i]);
+        int32_t parent = store.parent[i];
+        if (parent >= 0) {
+            glm::quat parentRotation(store.worldRotationW[parent], store.worldRotationX[parent],
+                store.worldRotationY[parent], store.worldRotationZ[parent]);
+            glm::vec3 parentPosition(store.worldPositionX[parent], store.worldPositionY[parent], store.worldPositionZ[parent]);
+
+            // Same as parentRotation * position, spelled out so an identity parent leaves it exact
+            glm::vec3 axis(parentRotation.x, parentRotation.y, parentRotation.z);
+            glm::vec3 twist = 2.0f * glm::cross(axis, position);
+            position = parentPosition + position + parentRotation.w * twist + glm::cross(axis, twist);
+            local = parentRotation * local;
+        }
+        store.worldPositionX[i] = position.x;
+        store.worldPositionY[i] = position.y;
+        store.worldPositionZ[i] = position.z;
+        store.worldRotationX[i] = local.x;
+        store.worldRotationY[i] = local.y;
+        store.worldRotationZ[i] = local.z;
+        store.worldRotationW[i] = local.w;
+    }
+}
+
+// Reorders sceneObjects so every parent comes before its children and each subtree sits in
+// one contiguous run, keeping siblings and roots in their original order. Parents already
+// have lower indices than their children, so scenes listed parent first stay as they are
+void UBuildSceneHierarchy()
+{
+    const size_t count = sceneObjects.size();
+
+    // Children of each object, bucketed by parent
+    std::vector<uint32_t> childStart(count + 1, 0), children(count);
+    for (const GLObject& object : sceneObjects)
+        if (object.parent >= 0)
+            ++childStart[object.parent + 1];
+    for (size_t i = 0; i < count; ++i)
+        childStart[i + 1] += childStart[i];
+    std::vector<uint32_t> childFill(childStart.begin(), childStart.end() - 1);
+    for (size_t i = 0; i < count; ++i)
+        if (sceneObjects[i].parent >= 0)
+            children[childFill[sceneObjects[i].parent]++] = (uint32_t)i;
+
+    // Depth first from each root, children pushed in reverse so they come out in order
+    std::vector<uint32_t> order, stack;
+    order.reserve(count);
+    for (size_t root = 0; root < count; ++root) {
+        if (sceneObjects[root].parent >= 0)
+            continue;
+        stack.push_back((uint32_t)root);
+        while (!stack.empty()) {
+            uint32_t node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            for (uint32_t c = childStart[node + 1]; c-- > childStart[node]; )
+                stack.push_back(children[c]);
+        }
+    }
+
+    bool inOrder = true;
+    for (size_t i = 0; i < count && inOrder; ++i)
+        inOrder = order[i] == i;
+    if (inOrder)
+        return;
+
+    std::vector<uint32_t> newIndex(count);
+    for (size_t i = 0; i < count; ++i)
+        newIndex[order[i]] = (uint32_t)i;
+    std::vector<GLObject> sorted(count);
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = sceneObjects[order[i]];
+        if (sorted[i].parent >= 0)
+            sorted[i].parent = (int32_t)newIndex[sorted[i].parent];
+    }
+    sceneObjects.swap(sorted);
+}
+
+// --animate: slides the first gAnimatedObjects objects with children back and forth along
+// X, taking their children with them
+void UAnimateScene(float deltaTime)
+{
+    gAnimationTime += deltaTime;
+    int animated = 0;
+    for (size_t i = 0; i < sceneObjects.size() && animated < gAnimatedObjects; ++i) {
+        if (gTransforms.subtreeEnd[i] == i + 1)
+            continue;
+        glm::vec3 position = sceneObjects[i].translation;
+        position.x += 2.0f * sin(gAnimationTime + (float)animated);
+        UMoveObject(gTransforms, i, position);
+        ++animated;
+    }
+}
+
+// Prints how much of the scene the transform updates touched, headless runs do it at exit
+void UPrintTransformStats()
+{
+    const TransformStore& store = gTransforms;
+    if (store.updateCount == 0)
+        return;
+    cout << "Transforms: " << (double)store.updatedTotal / store.updateCount << " of " << store.world.size()
+        << " objects updated per frame, " << store.updateMsTotal / store.updateCount << " ms" << endl;
+}
+
+// World matrix T * R * S and normal matrix R * S^-1, the transposed inverse of the world
+// matrix's upper 3x3, for objects [first, last). Four objects at a time with SSE, the
+// matrices come out as columns of four registers, one object per lane, and get transposed
+// into each object's own matrix on the way out
+void UComputeTransforms(TransformStore& store, size_t first, size_t last)
+{
+    size_t i = first;
+#ifdef U_HAVE_SSE
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= last; i += 4) {
+        __m128 x = _mm_loadu_ps(&store.worldRotationX[i]);
+        __m128 y = _mm_loadu_ps(&store.worldRotationY[i]);
+        __m128 z = _mm_loadu_ps(&store.worldRotationZ[i]);
+        __m128 w = _mm_loadu_ps(&store.worldRotationW[i]);
+
+        // Rotation matrix from the quaternion, rRC is row R column C
+        __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+        __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+        __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+        __m128 r00 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz)));
+        __m128 r11 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz)));
+        __m128 r22 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy)));
+        __m128 r01 = _mm_mul_ps(two, _mm_sub_ps(xy, wz));
+        __m128 r10 = _mm_mul_ps(two, _mm_add_ps(xy, wz));
+        __m128 r02 = _mm_mul_ps(two, _mm_add_ps(xz, wy));
+        __m128 r20 = _mm_mul_ps(two, _mm_sub_ps(xz, wy));
+        __m128 r12 = _mm_mul_ps(two, _mm_sub_ps(yz, wx));
+        __m128 r21 = _mm_mul_ps(two, _mm_add_ps(yz, wx));
+
+        __m128 sx = _mm_loadu_ps(&store.scaleX[i]);
+        __m128 sy = _mm_loadu_ps(&store.scaleY[i]);
+        __m128 sz = _mm_loadu_ps(&store.scaleZ[i]);
+
+        // Each matrix is 4 registers of one component for 4 objects; transposing
+        // gives 4 registers of one object's column each
+        float* world = &store.world[i][0][0];
+        float* normal = &store.normal[i].columns[0][0];
+        __m128 columns[4][4] = {
+            { _mm_mul_ps(r00, sx), _mm_mul_ps(r10, sx), _mm_mul_ps(r20, sx), zero },
+            { _mm_mul_ps(r01, sy), _mm_mul_ps(r11, sy), _mm_mul_ps(r21, sy), zero },
+            { _mm_mul_ps(r02, sz), _mm_mul_ps(r12, sz), _mm_mul_ps(r22, sz), zero },
+            { _mm_loadu_ps(&store.worldPositionX[i]), _mm_loadu_ps(&store.worldPositionY[i]), _mm_loadu_ps(&store.worldPositionZ[i]), one },
+        };
+        for (int c = 0; c < 4; ++c) {
+            _MM_TRANSPOSE4_PS(columns[c][0], columns[c][1], columns[c][2], columns[c][3]);
+            for (int lane = 0; lane < 4; ++lane)
+                _mm_storeu_ps(world + lane * 16 + c * 4, columns[c][lane]);
+        }
+
+        __m128 isx = _mm_div_ps(one, sx), isy = _mm_div_ps(one, sy), isz = _mm_div_ps(one, sz);
+        __m128 normals[3][4] = {
+            { _mm_mul_ps(r00, isx), _mm_mul_ps(r10, isx), _mm_mul_ps(r20, isx), zero },
+            { _mm_mul_ps(r01, isy), _mm_mul_ps(r11, isy), _mm_mul_ps(r21, isy), zero },
+            { _mm_mul_ps(r02, isz), _mm_mul_ps(r12, isz), _mm_mul_ps(r22, isz), zero },
+        };
+        for (int c = 0; c < 3; ++c) {
+            _MM_TRANSPOSE4_PS(normals[c][0], normals[c][1], normals[c][2], normals[c][3]);
+            for (int lane = 0; lane < 4; ++lane)
+                _mm_storeu_ps(normal + lane * 12 + c * 4, normals[c][lane]);
+        }
+    }
+#endif
+    UComputeTransformsScalar(store, i, last);
+}
+
+// Plain version of UComputeTransforms, for the leftover objects and targets without SSE
+void UComputeTransformsScalar(TransformStore& store, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; ++i) {
+        float x = store.worldRotationX[i], y = store.worldRotationY[i], z = store.worldRotationZ[i], w = store.worldRotationW[i];
+        glm::vec3 column0(1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y + w * z), 2.0f * (x * z - w * y));
+        glm::vec3 column1(2.0f * (x * y - w * z), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z + w * x));
+        glm::vec3 column2(2.0f * (x * z + w * y), 2.0f * (y * z - w * x), 1.0f - 2.0f * (x * x + y * y));
+
+        glm::mat4& world = store.world[i];
+        world[0] = glm::vec4(column0 * store.scaleX[i], 0.0f);
+        world[1] = glm::vec4(column1 * store.scaleY[i], 0.0f);
+        world[2] = glm::vec4(column2 * store.scaleZ[i], 0.0f);
+        world[3] = glm::vec4(store.worldPositionX[i], store.worldPositionY[i], store.worldPositionZ[i], 1.0f);
+
+        NormalMatrix& normal = store.normal[i];
+        normal.columns[0] = glm::vec4(column0 * (1.0f / store.scaleX[i]), 0.0f);
+        normal.columns[1] = glm::vec4(column1 * (1.0f / store.scaleY[i]), 0.0f);
+        normal.columns[2] = glm::vec4(column2 * (1.0f / store.scaleZ[i]), 0.0f);
+    }
+}
+
+// Box around a mesh's vertex positions, and the sphere around the box centre that holds them all
+MeshBounds UComputeMeshBounds(const MeshGeometry& geometry)
+{
+    MeshBounds bounds;
+    if (geometry.vertexCount == 0)
+        return bounds;
+
+    glm::vec3 low(geometry.vertices[0], geometry.vertices[1], geometry.vertices[2]);
+    glm::vec3 high = low;
+    for (GLuint v = 1; v < geometry.vertexCount; ++v) {
+        const GLfloat* position = geometry.vertices + v * FLOATS_PER_VERTEX;
+        low = glm::min(low, glm::vec3(position[0], position[1], position[2]));
+        high = glm::max(high, glm::vec3(position[0], position[1], position[2]));
+    }
+    bounds.center = (low + high) * 0.5f;
+    bounds.extent = (high - low) * 0.5f;
+
+    float radiusSquared = 0.0f;
+    for (GLuint v = 0; v < geometry.vertexCount; ++v) {
+        const GLfloat* position = geometry.vertices + v * FLOATS_PER_VERTEX;
+        glm::vec3 offset = glm::vec3(position[0], position[1], position[2]) - bounds.center;
+        radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+    }
+    bounds.radius = sqrtf(radiusSquared);
+    return bounds;
+}
+
+// World bounds for objects [first, last) from their world matrices. The box is the mesh box
+// turned with the object, re-fitted to the axes; the sphere grows with the largest scale
+void UComputeBounds(TransformStore& store, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; ++i) {
+        const glm::mat4& world = store.world[i];
+        const MeshBounds& local = store.localBounds[i];
+        glm::vec3 center = glm::vec3(world * glm::vec4(local.center, 1.0f));
+        glm::vec3 extent = glm::abs(glm::vec3(world[0])) * local.extent.x + glm::abs(glm::vec3(world[1])) * local.extent.y
+            + glm::abs(glm::vec3(world[2])) * local.extent.z;
+        float scale = std::max(fabsf(store.scaleX[i]), std::max(fabsf(store.scaleY[i]), fabsf(store.scaleZ[i])));
+
+        store.boundsX[i] = center.x;
+        store.boundsY[i] = center.y;
+        store.boundsZ[i] = center.z;
+        store.boundsRadius[i] = local.radius * scale;
+        store.extentX[i] = extent.x;
+        store.extentY[i] = extent.y;
+        store.extentZ[i] = extent.z;
+    }
+}
+
+// The six clip planes of a projection * view matrix, left, right, bottom, top, near and far.
+// Works the same for the perspective and the ortho projection
+Frustum UExtractFrustum(const glm::mat4& viewProjection)
+{
+    glm::vec4 rows[4];
+    for (int r = 0; r < 4; ++r)
+        rows[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+
+    Frustum frustum;
+    for (int axis = 0; axis < 3; ++axis) {
+        frustum.planes[axis * 2] = rows[3] + rows[axis];
+        frustum.planes[axis * 2 + 1] = rows[3] - rows[axis];
+    }
+    for (glm::vec4& plane : frustum.planes)
+        plane /= glm::length(glm::vec3(plane));
+    return frustum;
+}
+
+// Appends to visible every object in [first, last) whose bounds reach inside the frustum.
+// An object is out when its sphere or its box is wholly behind any one plane, whichever
+// reaches less far towards it. Four objects a test with SSE
+void UCullObjects(const TransformStore& store, const Frustum& frustum, size_t first, size_t last, std::vector<uint32_t>& visible)
+{
+    size_t i = first;
+#ifdef U_HAVE_SSE
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6], absX[6], absY[6], absZ[6];
+    for (int p = 0; p < 6; ++p) {
+        const glm::vec4& plane = frustum.planes[p];
+        planeX[p] = _mm_set1_ps(plane.x);
+        planeY[p] = _mm_set1_ps(plane.y);
+        planeZ[p] = _mm_set1_ps(plane.z);
+        planeW[p] = _mm_set1_ps(plane.w);
+        absX[p] = _mm_set1_ps(fabsf(plane.x));
+        absY[p] = _mm_set1_ps(fabsf(plane.y));
+        absZ[p] = _mm_set1_ps(fabsf(plane.z));
+    }
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= last; i += 4) {
+        __m128 x = _mm_loadu_ps(&store.boundsX[i]);
+        __m128 y = _mm_loadu_ps(&store.boundsY[i]);
+        __m128 z = _mm_loadu_ps(&store.boundsZ[i]);
+        __m128 radius = _mm_loadu_ps(&store.boundsRadius[i]);
+        __m128 ex = _mm_loadu_ps(&store.extentX[i]);
+        __m128 ey = _mm_loadu_ps(&store.extentY[i]);
+        __m128 ez = _mm_loadu_ps(&store.extentZ[i]);
+
+        __m128 outside = zero;
+        for (int p = 0; p < 6; ++p) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], x), _mm_mul_ps(planeY[p], y)),
+                _mm_add_ps(_mm_mul_ps(planeZ[p], z), planeW[p]));
+            __m128 boxReach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(absX[p], ex), _mm_mul_ps(absY[p], ey)), _mm_mul_ps(absZ[p], ez));
+            __m128 reach = _mm_min_ps(radius, boxReach);
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), zero));
+        }
+
+        int culled = _mm_movemask_ps(outside);
+        if (culled == 0xF)
+            continue;
+        for (int lane = 0; lane < 4; ++lane)
+            if (!(culled & (1 << lane)))
+                visible.push_back((uint32_t)(i + lane));
+    }
+#endif
+    for (; i < last; ++i)
+        if (!UObjectOutsideFrustum(store, frustum, i))
+            visible.push_back((uint32_t)i);
+}
+
+// One object of UCullObjects(), summed in the same order as the SSE lanes so both agree
+bool UObjectOutsideFrustum(const TransformStore& store, const Frustum& frustum, size_t i)
+{
+    for (const glm::vec4& plane : frustum.planes) {
+        float distance = (plane.x * store.boundsX[i] + plane.y * store.boundsY[i]) + (plane.z * store.boundsZ[i] + plane.w);
+        float boxReach = (fabsf(plane.x) * store.extentX[i] + fabsf(plane.y) * store.extentY[i]) + fabsf(plane.z) * store.extentZ[i];
+        if (distance + std::min(store.boundsRadius[i], boxReach) < 0.0f)
+            return true;
+    }
+    return false;
+}
+
+// Fills gVisibleObjects with what the camera can see this frame, or everything with culling off
+void UCullScene()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    gVisibleObjects.clear();
+    if (gFrustumCulling) {
+        glm::mat4 viewProjection = UGetProjectionMatrix() * gCamera.GetViewMatrix();
+        Frustum frustum = UExtractFrustum(viewProjection);
+        if (gBvhCulling)
+            UBvhQueryFrustum(gSceneBvh, gTransforms, frustum, gVisibleObjects);
+        else
+            UCullObjects(gTransforms, frustum, 0, sceneObjects.size(), gVisibleObjects);
+
+        // Then whatever the biggest cubes hide
+        if (gOcclusionCulling)
+            UOcclusionCull(viewProjection, gVisibleObjects);
+    }
+    else {
+        gVisibleObjects.resize(sceneObjects.size());
+        for (size_t i = 0; i < gVisibleObjects.size(); ++i)
+            gVisibleObjects[i] = (uint32_t)i;
+    }
+
+    gCullStats.tested = sceneObjects.size();
+    gCullStats.submitted = gVisibleObjects.size();
+    gCullStats.testedTotal += gCullStats.tested;
+    gCullStats.submittedTotal += gCullStats.submitted;
+    gCullStats.cullMsTotal += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    ++gCullStats.frames;
+}
+
+// Drops the objects in visible that the biggest cubes on screen hide completely
+void UOcclusionCull(const glm::mat4& viewProjection, std::vector<uint32_t>& visible)
+{
+    auto start = std::chrono::steady_clock::now();
+    OcclusionBuffer& buffer = gOcclusion;
+    const TransformStore& store = gTransforms;
+
+    // Occluders are the cubes that cover the most screen, nearest and biggest first
+    const glm::vec3 cameraPosition = gCamera.Position;
+    std::vector<std::pair<float, uint32_t>> candidates;
+    for (uint32_t object : visible) {
+        if (sceneObjects[object].shape != PrimitiveShape::CUBE)
+            continue;
+        glm::vec3 center(store.boundsX[object], store.boundsY[object], store.boundsZ[object]);
+        float size = store.boundsRadius[object] / std::max(glm::length(center - cameraPosition), 0.1f);
+        if (size >= OCCLUDER_MIN_SIZE)
+            candidates.push_back(std::make_pair(size, object));
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<float, uint32_t>>());
+    candidates.resize(std::min<size_t>(candidates.size(), OCCLUSION_MAX_OCCLUDERS));
+    buffer.occluders.clear();
+    for (const std::pair<float, uint32_t>& candidate : candidates)
+        buffer.occluders.push_back(candidate.second);
+
+    URasterizeOccluders(viewProjection);
+    UBuildHiZ();
+    auto rasterized = std::chrono::steady_clock::now();
+
+    // Occluders stay, everything else has to show at least one pixel in front of them
+    size_t kept = 0;
+    const size_t tested = visible.size() - buffer.occluders.size();
+    for (uint32_t object : visible) {
+        bool occluder = std::find(buffer.occluders.begin(), buffer.occluders.end(), object) != buffer.occluders.end();
+        if (occluder || !UObjectOccluded(viewProjection, object))
+            visible[kept++] = object;
+    }
+    OcclusionStats& stats = gOcclusionStats;
+    stats.tested = tested;
+    stats.occluded = visible.size() - kept;
+    visible.resize(kept);
+
+    stats.testedTotal += stats.tested;
+    stats.occludedTotal += stats.occluded;
+    stats.occludersTotal += buffer.occluders.size();
+    stats.rasterMsTotal += std::chrono::duration<double, std::milli>(rasterized - start).count();
+    stats.testMsTotal += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - rasterized).count();
+    ++stats.frames;
+}
+
+// Projects every occluder triangle into buffer pixels, clipping at the near plane, then
+// rasterizes them tile by tile on the workers into level 0 of the pyramid
+void URasterizeOccluders(const glm::mat4& viewProjection)
+{
+    OcclusionBuffer& buffer = gOcclusion;
+    if (buffer.levels.empty()) {
+        int width = OCCLUSION_WIDTH, height = OCCLUSION_HEIGHT;
+        for (;;) {
+            buffer.widths.push_back(width);
+            buffer.heights.push_back(height);
+            buffer.levels.push_back(std::vector<float>((size_t)width * height));
+            if (width == 1 && height == 1)
+                break;
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+    }
+    std::fill(buffer.levels[0].begin(), buffer.levels[0].end(), 1.0f);
+
+    buffer.triangles.clear();
+    for (uint32_t object : buffer.occluders) {
+        const glm::mat4 toClip = viewProjection * gTransforms.world[object];
+        const MeshGeometry geometry = UGetMeshGeometry(gMeshRegistry.entries[sceneObjects[object].mesh]);
+        for (GLuint i = 0; i + 2 < geometry.indexCount; i += 3) {
+            glm::vec4 corners[3];
+            for (int k = 0; k < 3; ++k) {
+                GLuint vertex = geometry.indexType == GL_UNSIGNED_SHORT ? ((const GLushort*)geometry.indices)[i + k] : ((const GLuint*)geometry.indices)[i + k];
+                const GLfloat* v = geometry.vertices + vertex * FLOATS_PER_VERTEX;
+                corners[k] = toClip * glm::vec4(v[0], v[1], v[2], 1.0f);
+            }
+            UAddOcclusionTriangle(corners);
+        }
+    }
+
+    // Tiles own disjoint pixels, so no two jobs write the same one. While textures are still
+    // decoding the workers are busy with them and the tiles are done here instead
+    const int tilesX = OCCLUSION_WIDTH / OCCLUSION_TILE_WIDTH, tilesY = OCCLUSION_HEIGHT / OCCLUSION_TILE_HEIGHT;
+    auto rasterizeTile = [tilesX](int tile) {
+        URasterizeOcclusionTile((tile % tilesX) * OCCLUSION_TILE_WIDTH, (tile / tilesX) * OCCLUSION_TILE_HEIGHT);
+    };
+    if (gTextureLoader.pending > 0) {
+        for (int tile = 0; tile < tilesX * tilesY; ++tile)
+            rasterizeTile(tile);
+    }
+    else {
+        UParallelFor(tilesX * tilesY, rasterizeTile);
+    }
+}
+
+// Clips one clip space triangle against the near plane and queues what's left in pixels
+void UAddOcclusionTriangle(const glm::vec4 corners[3])
+{
+    // Sutherland-Hodgman against z > -w, one plane turns a triangle into at most a quad
+    glm::vec4 polygon[4];
+    int count = 0;
+    for (int k = 0; k < 3; ++k) {
+        const glm::vec4& a = corners[k];
+        const glm::vec4& b = corners[(k + 1) % 3];
+        float distanceA = a.z + a.w, distanceB = b.z + b.w;
+        if (distanceA >= 0.0f)
+            polygon[count++] = a;
+        if ((distanceA >= 0.0f) != (distanceB >= 0.0f))
+            polygon[count++] = a + (b - a) * (distanceA / (distanceA - distanceB));
+    }
+
+    glm::vec3 points[4];
+    for (int k = 0; k < count; ++k) {
+        float inverseW = 1.0f / std::max(polygon[k].w, 1e-6f);
+        points[k] = glm::vec3((polygon[k].x * inverseW * 0.5f + 0.5f) * OCCLUSION_WIDTH,
+            (polygon[k].y * inverseW * 0.5f + 0.5f) * OCCLUSION_HEIGHT, std::min(polygon[k].z * inverseW * 0.5f + 0.5f, 1.0f));
+    }
+
+    for (int k = 2; k < count; ++k) {
+        OcclusionTriangle triangle;
+        const glm::vec3* fan[3] = { &points[0], &points[k - 1], &points[k] };
+        float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+        for (int v = 0; v < 3; ++v) {
+            triangle.x[v] = fan[v]->x;
+            triangle.y[v] = fan[v]->y;
+            triangle.z[v] = fan[v]->z;
+            minX = std::min(minX, triangle.x[v]);
+            minY = std::min(minY, triangle.y[v]);
+            maxX = std::max(maxX, triangle.x[v]);
+            maxY = std::max(maxY, triangle.y[v]);
+        }
+
+        // Pixel centres sit at +0.5, only those inside the bounds can be covered
+        triangle.minX = std::max(0, (int)ceilf(minX - 0.5f));
+        triangle.minY = std::max(0, (int)ceilf(minY - 0.5f));
+        triangle.maxX = std::min(OCCLUSION_WIDTH - 1, (int)floorf(maxX - 0.5f));
+        triangle.maxY = std::min(OCCLUSION_HEIGHT - 1, (int)floorf(maxY - 0.5f));
+        if (triangle.minX <= triangle.maxX && triangle.minY <= triangle.maxY)
+            gOcclusion.triangles.push_back(triangle);
+    }
+}
+
+// Rasterizes every queued triangle that reaches the tile at (tileX, tileY), keeping the
+// nearest depth per pixel. Edge functions and depth are planes in x and y, so each row
+// steps four pixel centres at a time through them
+void URasterizeOcclusionTile(int tileX, int tileY)
+{
+    float* depth = gOcclusion.levels[0].data();
+    const int tileMaxX = tileX + OCCLUSION_TILE_WIDTH - 1, tileMaxY = tileY + OCCLUSION_TILE_HEIGHT - 1;
+    for (const OcclusionTriangle& triangle : gOcclusion.triangles) {
+        if (triangle.maxX < tileX || triangle.minX > tileMaxX || triangle.maxY < tileY || triangle.minY > tileMaxY)
+            continue;
+
+        // Edge k runs from vertex k to the next, positive inside once the winding is known
+        float edgeA[3], edgeB[3], edgeC[3];
+        for (int k = 0; k < 3; ++k) {
+            int next = (k + 1) % 3;
+            edgeA[k] = triangle.y[k] - triangle.y[next];
+            edgeB[k] = triangle.x[next] - triangle.x[k];
+            edgeC[k] = triangle.x[k] * triangle.y[next] - triangle.x[next] * triangle.y[k];
+        }
+        float area = edgeC[0] + edgeC[1] + edgeC[2];
+        if (fabsf(area) < 1e-8f)
+            continue;
+        if (area < 0.0f) {
+            for (int k = 0; k < 3; ++k) {
+                edgeA[k] = -edgeA[k];
+                edgeB[k] = -edgeB[k];
+                edgeC[k] = -edgeC[k];
+            }
+            area = -area;
+        }
+
+        // Depth plane from the barycentric weights, edge k weighs the vertex opposite it
+        float depthA = 0.0f, depthB = 0.0f, depthC = 0.0f;
+        for (int k = 0; k < 3; ++k) {
+            float vertexDepth = triangle.z[(k + 2) % 3] / area;
+            depthA += edgeA[k] * vertexDepth;
+            depthB += edgeB[k] * vertexDepth;
+            depthC += edgeC[k] * vertexDepth;
+        }
+
+        const int minY = std::max(triangle.minY, tileY), maxY = std::min(triangle.maxY, tileMaxY);
+        const int minX = std::max(triangle.minX, tileX) & ~3, maxX = std::min(triangle.maxX, tileMaxX);
+        for (int y = minY; y <= maxY; ++y) {
+            const float centerY = y + 0.5f;
+            float* row = depth + (size_t)y * OCCLUSION_WIDTH;
+            int x = minX;
+#ifdef U_HAVE_SSE
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            __m128 rowEdge[3], stepEdge[3];
+            for (int k = 0; k < 3; ++k) {
+                rowEdge[k] = _mm_set1_ps(edgeB[k] * centerY + edgeC[k]);
+                stepEdge[k] = _mm_set1_ps(edgeA[k]);
+            }
+            const __m128 rowDepth = _mm_set1_ps(depthB * centerY + depthC), stepDepth = _mm_set1_ps(depthA);
+            for (; x <= maxX; x += 4) {
+                __m128 centerX = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+                __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(stepEdge[0], centerX), rowEdge[0]), zero);
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(stepEdge[1], centerX), rowEdge[1]), zero));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(stepEdge[2], centerX), rowEdge[2]), zero));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+                __m128 pixelDepth = _mm_add_ps(_mm_mul_ps(stepDepth, centerX), rowDepth);
+                __m128 current = _mm_loadu_ps(row + x);
+                __m128 nearest = _mm_min_ps(current, pixelDepth);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, current)));
+            }
+#endif
+            for (; x <= maxX; ++x) {
+                const float centerX = x + 0.5f;
+                if (edgeA[0] * centerX + edgeB[0] * centerY + edgeC[0] >= 0.0f &&
+                    edgeA[1] * centerX + edgeB[1] * centerY + edgeC[1] >= 0.0f &&
+                    edgeA[2] * centerX + edgeB[2] * centerY + edgeC[2] >= 0.0f)
+                    row[x] = std::min(row[x], depthA * centerX + depthB * centerY + depthC);
+            }
+        }
+    }
+}
+
+// Fills every pyramid level above 0 with the farthest depth of the texels it covers
+void UBuildHiZ()
+{
+    OcclusionBuffer& buffer = gOcclusion;
+    for (size_t level = 1; level < buffer.levels.size(); ++level) {
+        const std::vector<float>& below = buffer.levels[level - 1];
+        const int belowWidth = buffer.widths[level - 1], belowHeight = buffer.heights[level - 1];
+        std::vector<float>& above = buffer.levels[level];
+        for (int y = 0; y < buffer.heights[level]; ++y) {
+            const int y0 = y * 2, y1 = std::min(y * 2 + 1, belowHeight - 1);
+            for (int x = 0; x < buffer.widths[level]; ++x) {
+                const int x0 = x * 2, x1 = std::min(x * 2 + 1, belowWidth - 1);
+                above[(size_t)y * buffer.widths[level] + x] = std::max(
+                    std::max(below[(size_t)y0 * belowWidth + x0], below[(size_t)y0 * belowWidth + x1]),
+                    std::max(below[(size_t)y1 * belowWidth + x0], below[(size_t)y1 * belowWidth + x1]));
+            }
+        }
+    }
+}
+
+// Whether an object's world box is wholly behind the occluders. Boxes reaching through the
+// near plane always count as visible. The test reads the coarsest level where the box
+// still covers no more than four texels a side
+bool UObjectOccluded(const glm::mat4& viewProjection, uint32_t object)
+{
+    const TransformStore& store = gTransforms;
+    const glm::vec3 center(store.boundsX[object], store.boundsY[object], store.boundsZ[object]);
+    const glm::vec3 extent(store.extentX[object], store.extentY[object], store.extentZ[object]);
+
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, nearest = FLT_MAX;
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec3 signs((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f, (corner & 4) ? 1.0f : -1.0f);
+        glm::vec4 clip = viewProjection * glm::vec4(center + extent * signs, 1.0f);
+        if (clip.z + clip.w <= 0.0f)
+            return false;
+        float inverseW = 1.0f / clip.w;
+        minX = std::min(minX, clip.x * inverseW);
+        maxX = std::max(maxX, clip.x * inverseW);
+        minY = std::min(minY, clip.y * inverseW);
+        maxY = std::max(maxY, clip.y * inverseW);
+        nearest = std::min(nearest, clip.z * inverseW * 0.5f + 0.5f);
+    }
+
+    // Every pixel the rectangle touches, not just the ones whose centres it covers
+    int x0 = std::max(0, (int)floorf((minX * 0.5f + 0.5f) * OCCLUSION_WIDTH));
+    int y0 = std::max(0, (int)floorf((minY * 0.5f + 0.5f) * OCCLUSION_HEIGHT));
+    int x1 = std::min(OCCLUSION_WIDTH - 1, (int)floorf((maxX * 0.5f + 0.5f) * OCCLUSION_WIDTH));
+    int y1 = std::min(OCCLUSION_HEIGHT - 1, (int)floorf((maxY * 0.5f + 0.5f) * OCCLUSION_HEIGHT));
+    if (x0 > x1 || y0 > y1)
+        return false;
+
+    const OcclusionBuffer& buffer = gOcclusion;
+    size_t level = 0;
+    while (level + 1 < buffer.levels.size() && ((x1 >> level) - (x0 >> level) > 3 || (y1 >> level) - (y0 >> level) > 3))
+        ++level;
+    const std::vector<float>& depth = buffer.levels[level];
+    const int width = buffer.widths[level];
+    for (int y = y0 >> level; y <= (y1 >> level); ++y)
+        for (int x = x0 >> level; x <= (x1 >> level); ++x)
+            if (nearest <= depth[(size_t)y * width + x])
+                return false;
+    return true;
+}
+
+// Writes level 0 of the occlusion buffer as a greyscale PGM, near white and empty black.
+// Perspective depth is linearised first or everything past a few units would look the same
+bool UWriteOcclusionDump(const char* filename)
+{
+    const OcclusionBuffer& buffer = gOcclusion;
+    if (buffer.levels.empty())
+        return false;
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    const float nearPlane = PROJECTION_NEAR, farPlane = PROJECTION_FAR;
+    file << "P5\n" << OCCLUSION_WIDTH << " " << OCCLUSION_HEIGHT << "\n255\n";
+    std::vector<unsigned char> row(OCCLUSION_WIDTH);
+    for (int y = OCCLUSION_HEIGHT - 1; y >= 0; --y) {
+        for (int x = 0; x < OCCLUSION_WIDTH; ++x) {
+            float depth = buffer.levels[0][(size_t)y * OCCLUSION_WIDTH + x];
+            float linear = gOrthoView ? depth : nearPlane * farPlane / (farPlane - depth * (farPlane - nearPlane)) / farPlane;
+            row[x] = depth >= 1.0f ? 0 : (unsigned char)(255.0f * (1.0f - std::min(std::max(linear, 0.0f), 1.0f) * 0.9f));
+        }
+        file.write((const char*)row.data(), row.size());
+    }
+
+    cout << "Wrote occlusion buffer to " << filename << endl;
+    return (bool)file;
+}
+
+// Prints last frame's occlusion results and the run's averages
+void UPrintOcclusionStats()
+{
+    const OcclusionStats& stats = gOcclusionStats;
+    if (stats.frames == 0)
+        return;
+    cout << "Occlusion culling " << (gOcclusionCulling ? "on" : "off") << ": last frame " << stats.occluded << " of "
+        << stats.tested << " frustum visible objects occluded by " << gOcclusion.occluders.size() << " occluders. Average "
+        << 100.0 * stats.occludedTotal / std::max<size_t>(stats.testedTotal, 1) << "% of draws occluded, "
+        << (double)stats.occludersTotal / stats.frames << " occluders, " << stats.rasterMsTotal / stats.frames
+        << " ms rasterizing, " << stats.testMsTotal / stats.frames << " ms testing per frame" << endl;
+}
+
+// Moves each visible object to the level of detail its projected radius calls for and counts
+// the triangles that leaves to draw
+void USelectLods(const std::vector<uint32_t>& visible)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Pixels one unit of radius covers at unit distance, or at any distance in ortho
+    const float halfHeight = WINDOW_HEIGHT * 0.5f;
+    const float pixelsPerUnit = gOrthoView ? halfHeight / 2.0f : halfHeight / tanf(glm::radians(gCamera.Zoom) * 0.5f);
+    const glm::vec3 cameraPosition = gCamera.Position;
+    if (gObjectLod.size() != sceneObjects.size())
+        gObjectLod.assign(sceneObjects.size(), 0);
+
+    LodStats& stats = gLodStats;
+    stats.triangles = 0;
+    stats.fullTriangles = 0;
+    stats.switches = 0;
+    std::fill(stats.levelObjects, stats.levelObjects + LOD_LEVELS, 0);
+    for (uint32_t objectIndex : visible) {
+        GLObject& currentObject = sceneObjects[objectIndex];
+        const LodChain& chain = gLodChains[(int)currentObject.shape];
+        int level = gObjectLod[objectIndex];
+        if (!gLodSelection || chain.levels < 2) {
+            level = 0;
+        }
+        else {
+            glm::vec3 center(gTransforms.boundsX[objectIndex], gTransforms.boundsY[objectIndex], gTransforms.boundsZ[objectIndex]);
+            float radius = gTransforms.boundsRadius[objectIndex];
+            float distance = glm::length(center - cameraPosition);
+            float pixels = gOrthoView ? radius * pixelsPerUnit
+                : distance > radius ? radius * pixelsPerUnit / distance : FLT_MAX;
+
+            // Only step across a threshold once the size is clearly past it
+            while (level > 0 && pixels >= LOD_SWITCH_PIXELS[level - 1] * (1.0f + LOD_HYSTERESIS))
+                --level;
+            while (level < chain.levels - 1 && pixels < LOD_SWITCH_PIXELS[level] * (1.0f - LOD_HYSTERESIS))
+                ++level;
+        }
+
+        if (level != gObjectLod[objectIndex]) {
+            UReleaseMesh(currentObject.mesh);
+            currentObject.mesh = UAcquireMesh(chain.keys[level]);
+            gObjectLod[objectIndex] = (unsigned char)level;
+            ++stats.switches;
+        }
+
+        ++stats.levelObjects[level];
+        stats.triangles += UGetMesh(currentObject.mesh).nIndices / 3;
+        stats.fullTriangles += UGetMesh(chain.meshes[0]).nIndices / 3;
+    }
+
+    // The GPU culling path's draw records name the old meshes, and its visible list slices
+    // were sized from the old object count of each mesh
+    if (stats.switches > 0)
+        gGpuCull.slicesCurrent = false;
+
+    stats.trianglesTotal += stats.triangles;
+    stats.fullTrianglesTotal += stats.fullTriangles;
+    stats.switchesTotal += stats.switches;
+    stats.selectMsTotal += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    ++stats.frames;
+}
+
+// Prints last frame's triangle count against full detail and the run's averages
+void UPrintLodStats()
+{
+    const LodStats& stats = gLodStats;
+    if (stats.frames == 0)
+        return;
+    cout << "LOD selection " << (gLodSelection ? "on" : "off") << ": last frame submitted " << stats.triangles
+        << " triangles, " << stats.fullTriangles << " at full detail, " << stats.sceneTriangles << " for the whole scene. Objects per level";
+    for (int level = 0; level < LOD_LEVELS; ++level)
+        cout << (level == 0 ? " " : "/") << stats.levelObjects[level];
+    cout << ", " << stats.switches << " switches. Average " << (double)stats.trianglesTotal / stats.frames << " triangles ("
+        << 100.0 * stats.trianglesTotal / std::max<size_t>(stats.fullTrianglesTotal, 1) << "% of full detail), "
+        << (double)stats.switchesTotal / stats.frames << " switches, " << stats.selectMsTotal / stats.frames << " ms per frame" << endl;
+}
+
+// Prints last frame's culling counts and the run's averages
+void UPrintCullStats()
+{
+    const CullStats& stats = gCullStats;
+    if (stats.frames == 0)
+        return;
+    cout << "Frustum culling " << (gFrustumCulling ? "on" : "off") << ": last frame submitted " << stats.submitted
+        << " of " << stats.tested << " objects, culled " << stats.tested - stats.submitted << ". Average "
+        << (double)stats.submittedTotal / stats.frames << " submitted, " << (double)(stats.testedTotal - stats.submittedTotal) / stats.frames
+        << " culled, " << stats.cullMsTotal / stats.frames << " ms per frame" << endl;
+}
+
+// Builds gSceneBvh on the first frame or after the scene changed, otherwise refits it around
+// whatever the last transform update moved
+void UUpdateSceneBvh()
+{
+    Bvh& bvh = gSceneBvh;
+    const TransformStore& store = gTransforms;
+    if (!bvh.built || bvh.objectNode.size() != store.world.size()) {
+        UBuildBvh(bvh, store);
+        return;
+    }
+    if (store.updatedRanges.empty())
+        return;
+
+    URefitBvh(bvh, store, store.updatedRanges);
+    if (bvh.cost > bvh.builtCost * BVH_REBUILD_RATIO)
+        UBuildBvh(bvh, store);
+}
+
+// Builds bvh from scratch over every object's world box in store
+void UBuildBvh(Bvh& bvh, const TransformStore& store)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    const uint32_t count = (uint32_t)store.world.size();
+    bvh.tree = BvhNodes();
+    bvh.objects.resize(count);
+    for (uint32_t i = 0; i < count; ++i)
+        bvh.objects[i] = i;
+    bvh.objectNode.assign(count, 0);
+
+    if (count > 0) {
+        // The top of the tree is split here, then each subtree small enough goes to a worker
+        std::vector<BvhBuildTask> tasks;
+        const uint32_t workers = (uint32_t)gThreadPool.workers.size();
+        const uint32_t taskSize = std::max(BVH_TASK_MIN, count / (std::max(1u, workers) * 8));
+        UBuildBvhNode(bvh, bvh.tree, store, 0, count, -1, 0, workers > 0 ? &tasks : nullptr, taskSize);
+        UParallelFor((int)tasks.size(), [&bvh, &store, &tasks](int t) {
+            BvhBuildTask& task = tasks[t];
+            UBuildBvhNode(bvh, task.subtree, store, task.first, task.count, -1, task.depth, nullptr, 0);
+        });
+
+        // Stitch the subtrees in after the top, shifting their node indices
+        for (BvhBuildTask& task : tasks) {
+            const int32_t offset = (int32_t)bvh.tree.nodes.size();
+            for (size_t n = 0; n < task.subtree.nodes.size(); ++n) {
+                BvhNode node = task.subtree.nodes[n];
+                for (int k = 0; k < 4; ++k)
+                    if (node.count[k] > 0 && node.child[k] >= 0)
+                        node.child[k] += offset;
+                bvh.tree.nodes.push_back(node);
+                bvh.tree.parent.push_back(task.subtree.parent[n] < 0 ? task.parent : task.subtree.parent[n] + offset);
+                bvh.tree.first.push_back(task.subtree.first[n]);
+            }
+            bvh.tree.nodes[task.parent].child[task.slot] = offset;
+            for (uint32_t i = task.first; i < task.first + task.count; ++i)
+                bvh.objectNode[bvh.objects[i]] += offset;
+        }
+    }
+
+    bvh.cost = 0.0;
+    for (const BvhNode& node : bvh.tree.nodes)
+        bvh.cost += UBvhNodeCost(node);
+    bvh.builtCost = bvh.cost;
+    bvh.nodeDirty.assign(bvh.tree.nodes.size(), 0);
+    bvh.built = true;
+    ++bvh.builds;
+    bvh.lastBuildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Makes a node for bvh.objects[first, first + count) in out and returns its index. Two SAH
+// splits give up to four children; ranges that fit a leaf become leaf slots, the rest become
+// child nodes, or build tasks when tasks is set and they're no bigger than taskSize
+int32_t UBuildBvhNode(Bvh& bvh, BvhNodes& out, const TransformStore& store, uint32_t first, uint32_t count,
+    int32_t parent, int depth, std::vector<BvhBuildTask>* tasks, uint32_t taskSize)
+{
+    const int32_t index = (int32_t)out.nodes.size();
+    BvhNode empty;
+    for (int k = 0; k < 4; ++k) {
+        empty.minX[k] = empty.minY[k] = empty.minZ[k] = FLT_MAX;
+        empty.maxX[k] = empty.maxY[k] = empty.maxZ[k] = -FLT_MAX;
+        empty.child[k] = -1;
+        empty.count[k] = 0;
+    }
+    out.nodes.push_back(empty);
+    out.parent.push_back(parent);
+    out.first.push_back(first);
+
+    uint32_t* objects = bvh.objects.data();
+    const bool median = depth >= BVH_MAX_DEPTH;
+    uint32_t ranges[4][2];
+    int rangeCount = 0;
+    if (count <= BVH_LEAF_SIZE) {
+        ranges[rangeCount][0] = first;
+        ranges[rangeCount++][1] = count;
+    }
+    else {
+        uint32_t middle = UBvhSplit(store, objects, first, count, median);
+        uint32_t halves[2][2] = { { first, middle - first }, { middle, first + count - middle } };
+        for (auto& half : halves) {
+            if (half[1] > BVH_LEAF_SIZE) {
+                uint32_t quarter = UBvhSplit(store, objects, half[0], half[1], median);
+                ranges[rangeCount][0] = half[0];
+                ranges[rangeCount++][1] = quarter - half[0];
+                ranges[rangeCount][0] = quarter;
+                ranges[rangeCount++][1] = half[0] + half[1] - quarter;
+            }
+            else {
+                ranges[rangeCount][0] = half[0];
+                ranges[rangeCount++][1] = half[1];
+            }
+        }
+    }
+
+    for (int k = 0; k < rangeCount; ++k) {
+        const uint32_t rangeFirst = ranges[k][0], rangeCount_ = ranges[k][1];
+        glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+        for (uint32_t i = rangeFirst; i < rangeFirst + rangeCount_; ++i) {
+            uint32_t object = objects[i];
+            glm::vec3 center(store.boundsX[object], store.boundsY[object], store.boundsZ[object]);
+            glm::vec3 extent(store.extentX[object], store.extentY[object], store.extentZ[object]);
+            low = glm::min(low, center - extent);
+            high = glm::max(high, center + extent);
+        }
+
+        // out may have grown since, so the node is looked up again for every write
+        int32_t child;
+        if (rangeCount_ <= BVH_LEAF_SIZE) {
+            child = ~(int32_t)rangeFirst;
+            for (uint32_t i = rangeFirst; i < rangeFirst + rangeCount_; ++i)
+                bvh.objectNode[objects[i]] = (uint32_t)index;
+        }
+        else if (tasks && rangeCount_ <= taskSize) {
+            BvhBuildTask task;
+            task.first = rangeFirst;
+            task.count = rangeCount_;
+            task.parent = index;
+            task.slot = k;
+            task.depth = depth + 1;
+            tasks->push_back(std::move(task));
+            child = 0;      // Patched once the task is stitched in
+        }
+        else {
+            child = UBuildBvhNode(bvh, out, store, rangeFirst, rangeCount_, index, depth + 1, tasks, taskSize);
+        }
+
+        BvhNode& node = out.nodes[index];
+        node.minX[k] = low.x;
+        node.minY[k] = low.y;
+        node.minZ[k] = low.z;
+        node.maxX[k] = high.x;
+        node.maxY[k] = high.y;
+        node.maxZ[k] = high.z;
+        node.child[k] = child;
+        node.count[k] = rangeCount_;
+    }
+    return index;
+}
+
+// Splits objects[first, first + count) in two where the surface area heuristic says, binning
+// object centres along each axis, and returns where the second half starts. Falls back to
+// the middle when every centre is in one spot or median is set
+uint32_t UBvhSplit(const TransformStore& store, uint32_t* objects, uint32_t first, uint32_t count, bool median)
+{
+    const uint32_t last = first + count;
+    glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+    for (uint32_t i = first; i < last; ++i) {
+        glm::vec3 center(store.boundsX[objects[i]], store.boundsY[objects[i]], store.boundsZ[objects[i]]);
+        low = glm::min(low, center);
+        high = glm::max(high, center);
+    }
+    glm::vec3 span = high - low;
+    if (median || (span.x <= 0.0f && span.y <= 0.0f && span.z <= 0.0f)) {
+        int axis = span.x >= span.y && span.x >= span.z ? 0 : span.y >= span.z ? 1 : 2;
+        const std::vector<float>& centers = axis == 0 ? store.boundsX : axis == 1 ? store.boundsY : store.boundsZ;
+        std::nth_element(objects + first, objects + first + count / 2, objects + last,
+            [&centers](uint32_t a, uint32_t b) { return centers[a] < centers[b]; });
+        return first + count / 2;
+    }
+
+    struct Bin
+    {
+        glm::vec3 low = glm::vec3(FLT_MAX);
+        glm::vec3 high = glm::vec3(-FLT_MAX);
+        uint32_t count = 0;
+    };
+    Bin bins[3][BVH_SAH_BINS];
+    glm::vec3 binScale;
+    for (int axis = 0; axis < 3; ++axis)
+        binScale[axis] = span[axis] > 0.0f ? BVH_SAH_BINS * 0.9999f / span[axis] : 0.0f;
+
+    for (uint32_t i = first; i < last; ++i) {
+        uint32_t object = objects[i];
+        glm::vec3 center(store.boundsX[object], store.boundsY[object], store.boundsZ[object]);
+        glm::vec3 extent(store.extentX[object], store.extentY[object], store.extentZ[object]);
+        for (int axis = 0; axis < 3; ++axis) {
+            Bin& bin = bins[axis][(int)((center[axis] - low[axis]) * binScale[axis])];
+            bin.low = glm::min(bin.low, center - extent);
+            bin.high = glm::max(bin.high, center + extent);
+            ++bin.count;
+        }
+    }
+
+    // Sweep each axis from the right for the right hand side areas, then from the left
+    auto area = [](glm::vec3 boxLow, glm::vec3 boxHigh) {
+        glm::vec3 size = glm::max(boxHigh - boxLow, glm::vec3(0.0f));
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    };
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestBin = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (span[axis] <= 0.0f)
+            continue;
+        float rightArea[BVH_SAH_BINS];
+        uint32_t rightCount[BVH_SAH_BINS];
+        glm::vec3 boxLow(FLT_MAX), boxHigh(-FLT_MAX);
+        uint32_t running = 0;
+        for (int b = BVH_SAH_BINS - 1; b > 0; --b) {
+            boxLow = glm::min(boxLow, bins[axis][b].low);
+            boxHigh = glm::max(boxHigh, bins[axis][b].high);
+            running += bins[axis][b].count;
+            rightArea[b] = area(boxLow, boxHigh);
+            rightCount[b] = running;
+        }
+        boxLow = glm::vec3(FLT_MAX);
+        boxHigh = glm::vec3(-FLT_MAX);
+        running = 0;
+        for (int b = 0; b < BVH_SAH_BINS - 1; ++b) {
+            boxLow = glm::min(boxLow, bins[axis][b].low);
+            boxHigh = glm::max(boxHigh, bins[axis][b].high);
+            running += bins[axis][b].count;
+            if (running == 0 || rightCount[b + 1] == 0)
+                continue;
+            float cost = area(boxLow, boxHigh) * running + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+    if (bestAxis < 0)
+        return UBvhSplit(store, objects, first, count, true);
+
+    const std::vector<float>& centers = bestAxis == 0 ? store.boundsX : bestAxis == 1 ? store.boundsY : store.boundsZ;
+    const float axisLow = low[bestAxis], axisScale = binScale[bestAxis];
+    uint32_t* middle = std::partition(objects + first, objects + last, [&](uint32_t object) {
+        return (int)((centers[object] - axisLow) * axisScale) <= bestBin;
+    });
+    return (uint32_t)(middle - objects);
+}
+
+// What a node adds to the tree's cost: each slot's surface area, leaves weighted by their
+// object count since every object in them gets tested
+double UBvhNodeCost(const BvhNode& node)
+{
+    double cost = 0.0;
+    for (int k = 0; k < 4; ++k) {
+        if (node.count[k] == 0)
+            continue;
+        double x = node.maxX[k] - node.minX[k], y = node.maxY[k] - node.minY[k], z = node.maxZ[k] - node.minZ[k];
+        double area = 2.0 * (x * y + y * z + z * x);
+        cost += node.child[k] < 0 ? area * node.count[k] : area;
+    }
+    return cost;
+}
+
+// Refits the boxes above every object in ranges, each node once, children before parents.
+// Covering the whole scene refits every node without the marking
+void URefitBvh(Bvh& bvh, const TransformStore& store, const std::vector<std::pair<size_t, size_t>>& ranges)
+{
+    BvhNodes& tree = bvh.tree;
+    size_t moved = 0;
+    for (const std::pair<size_t, size_t>& range : ranges)
+        moved += range.second - range.first;
+
+    if (moved >= bvh.objects.size()) {
+        for (size_t n = tree.nodes.size(); n-- > 0; )
+            URefitBvhNode(bvh, store, (int32_t)n);
+    }
+    else {
+        bvh.dirtyNodes.clear();
+        for (const std::pair<size_t, size_t>& range : ranges) {
+            for (size_t object = range.first; object < range.second; ++object) {
+                for (int32_t n = (int32_t)bvh.objectNode[object]; n >= 0 && !bvh.nodeDirty[n]; n = tree.parent[n]) {
+                    bvh.nodeDirty[n] = 1;
+                    bvh.dirtyNodes.push_back(n);
+                }
+            }
+        }
+        std::sort(bvh.dirtyNodes.begin(), bvh.dirtyNodes.end(), std::greater<int32_t>());
+        for (int32_t n : bvh.dirtyNodes) {
+            URefitBvhNode(bvh, store, n);
+            bvh.nodeDirty[n] = 0;
+        }
+    }
+    ++bvh.refits;
+}
+
+// Recomputes a node's slot boxes from its children's boxes or its leaf objects
+void URefitBvhNode(Bvh& bvh, const TransformStore& store, int32_t index)
+{
+    BvhNode& node = bvh.tree.nodes[index];
+    bvh.cost -= UBvhNodeCost(node);
+    for (int k = 0; k < 4; ++k) {
+        if (node.count[k] == 0)
+            continue;
+        glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+        if (node.child[k] >= 0) {
+            const BvhNode& child = bvh.tree.nodes[node.child[k]];
+            for (int c = 0; c < 4; ++c) {
+                if (child.count[c] == 0)
+                    continue;
+                low = glm::min(low, glm::vec3(child.minX[c], child.minY[c], child.minZ[c]));
+                high = glm::max(high, glm::vec3(child.maxX[c], child.maxY[c], child.maxZ[c]));
+            }
+        }
+        else {
+            const uint32_t first = (uint32_t)~node.child[k];
+            for (uint32_t i = first; i < first + node.count[k]; ++i) {
+                uint32_t object = bvh.objects[i];
+                glm::vec3 center(store.boundsX[object], store.boundsY[object], store.boundsZ[object]);
+                glm::vec3 extent(store.extentX[object], store.extentY[object], store.extentZ[object]);
+                low = glm::min(low, center - extent);
+                high = glm::max(high, center + extent);
+            }
+        }
+        node.minX[k] = low.x;
+        node.minY[k] = low.y;
+        node.minZ[k] = low.z;
+        node.maxX[k] = high.x;
+        node.maxY[k] = high.y;
+        node.maxZ[k] = high.z;
+    }
+    bvh.cost += UBvhNodeCost(node);
+}
+
+// Tests a node's four slot boxes against the frustum. Bits of outside are slots wholly
+// behind some plane, bits of inside are slots wholly in front of all of them
+void UBvhTestFrustum(const BvhNode& node, const Frustum& frustum, int& outside, int& inside)
+{
+#ifdef U_HAVE_SSE
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128 low = _mm_loadu_ps(node.minX), high = _mm_loadu_ps(node.maxX);
+    __m128 x = _mm_mul_ps(_mm_add_ps(low, high), half), ex = _mm_mul_ps(_mm_sub_ps(high, low), half);
+    low = _mm_loadu_ps(node.minY), high = _mm_loadu_ps(node.maxY);
+    __m128 y = _mm_mul_ps(_mm_add_ps(low, high), half), ey = _mm_mul_ps(_mm_sub_ps(high, low), half);
+    low = _mm_loadu_ps(node.minZ), high = _mm_loadu_ps(node.maxZ);
+    __m128 z = _mm_mul_ps(_mm_add_ps(low, high), half), ez = _mm_mul_ps(_mm_sub_ps(high, low), half);
+
+    const __m128 zero = _mm_setzero_ps();
+    __m128 out = zero, partial = zero;
+    for (const glm::vec4& plane : frustum.planes) {
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), x), _mm_mul_ps(_mm_set1_ps(plane.y), y)),
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), z), _mm_set1_ps(plane.w)));
+        __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(fabsf(plane.x)), ex), _mm_mul_ps(_mm_set1_ps(fabsf(plane.y)), ey)),
+            _mm_mul_ps(_mm_set1_ps(fabsf(plane.z)), ez));
+        out = _mm_or_ps(out, _mm_cmplt_ps(_mm_add_ps(distance, reach), zero));
+        partial = _mm_or_ps(partial, _mm_cmplt_ps(_mm_sub_ps(distance, reach), zero));
+    }
+    outside = _mm_movemask_ps(out);
+    inside = ~_mm_movemask_ps(partial) & 0xF;
+#else
+    outside = inside = 0;
+    for (int k = 0; k < 4; ++k) {
+        glm::vec3 low(node.minX[k], node.minY[k], node.minZ[k]), high(node.maxX[k], node.maxY[k], node.maxZ[k]);
+        glm::vec3 center = (low + high) * 0.5f, extent = (high - low) * 0.5f;
+        bool out = false, partial = false;
+        for (const glm::vec4& plane : frustum.planes) {
+            float distance = glm::dot(glm::vec3(plane), center) + plane.w;
+            float reach = glm::dot(glm::abs(glm::vec3(plane)), extent);
+            out = out || distance + reach < 0.0f;
+            partial = partial || distance - reach < 0.0f;
+        }
+        outside |= out ? 1 << k : 0;
+        inside |= partial ? 0 : 1 << k;
+    }
+#endif
+}
+
+// Slab test of a ray against a node's four slot boxes. Returns a bit per slot the ray enters
+// before maxDistance, with where it enters in entry
+int UBvhTestRay(const BvhNode& node, glm::vec3 origin, glm::vec3 inverseDirection, float maxDistance, float entry[4])
+{
+#ifdef U_HAVE_SSE
+    __m128 nearest = _mm_setzero_ps(), farthest = _mm_set1_ps(maxDistance);
+    const float* lows[3] = { node.minX, node.minY, node.minZ };
+    const float* highs[3] = { node.maxX, node.maxY, node.maxZ };
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 o = _mm_set1_ps(origin[axis]), d = _mm_set1_ps(inverseDirection[axis]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(lows[axis]), o), d);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(highs[axis]), o), d);
+        nearest = _mm_max_ps(nearest, _mm_min_ps(t0, t1));
+        farthest = _mm_min_ps(farthest, _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(entry, nearest);
+    return _mm_movemask_ps(_mm_cmple_ps(nearest, farthest));
+#else
+    int hits = 0;
+    for (int k = 0; k < 4; ++k) {
+        glm::vec3 t0 = (glm::vec3(node.minX[k], node.minY[k], node.minZ[k]) - origin) * inverseDirection;
+        glm::vec3 t1 = (glm::vec3(node.maxX[k], node.maxY[k], node.maxZ[k]) - origin) * inverseDirection;
+        glm::vec3 near3 = glm::min(t0, t1), far3 = glm::max(t0, t1);
+        entry[k] = std::max(0.0f, std::max(near3.x, std::max(near3.y, near3.z)));
+        float exit = std::min(maxDistance, std::min(far3.x, std::min(far3.y, far3.z)));
+        hits |= entry[k] <= exit ? 1 << k : 0;
+    }
+    return hits;
+#endif
+}
+
+// Overlap test of a box against a node's four slot boxes, a bit per slot that touches it
+int UBvhTestBox(const BvhNode& node, glm::vec3 low, glm::vec3 high)
+{
+#ifdef U_HAVE_SSE
+    __m128 apart = _mm_or_ps(_mm_cmpgt_ps(_mm_loadu_ps(node.minX), _mm_set1_ps(high.x)),
+        _mm_cmplt_ps(_mm_loadu_ps(node.maxX), _mm_set1_ps(low.x)));
+    apart = _mm_or_ps(apart, _mm_or_ps(_mm_cmpgt_ps(_mm_loadu_ps(node.minY), _mm_set1_ps(high.y)),
+        _mm_cmplt_ps(_mm_loadu_ps(node.maxY), _mm_set1_ps(low.y))));
+    apart = _mm_or_ps(apart, _mm_or_ps(_mm_cmpgt_ps(_mm_loadu_ps(node.minZ), _mm_set1_ps(high.z)),
+        _mm_cmplt_ps(_mm_loadu_ps(node.maxZ), _mm_set1_ps(low.z))));
+    return ~_mm_movemask_ps(apart) & 0xF;
+#else
+    int hits = 0;
+    for (int k = 0; k < 4; ++k) {
+        bool apart = node.minX[k] > high.x || node.maxX[k] < low.x || node.minY[k] > high.y || node.maxY[k] < low.y
+            || node.minZ[k] > high.z || node.maxZ[k] < low.z;
+        hits |= apart ? 0 : 1 << k;
+    }
+    return hits;
+#endif
+}
+
+// Appends every object whose bounds reach into the frustum, the same set UCullObjects finds.
+// Slots wholly inside hand over all their objects without testing any further down
+void UBvhQueryFrustum(const Bvh& bvh, const TransformStore& store, const Frustum& frustum, std::vector<uint32_t>& visible)
+{
+    if (bvh.tree.nodes.empty())
+        return;
+
+    int32_t stack[BVH_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const BvhNode& node = bvh.tree.nodes[stack[--depth]];
+        int outside, inside;
+        UBvhTestFrustum(node, frustum, outside, inside);
+        for (int k = 0; k < 4; ++k) {
+            if (node.count[k] == 0 || (outside & (1 << k)))
+                continue;
+            const bool leaf = node.child[k] < 0;
+            const uint32_t first = leaf ? (uint32_t)~node.child[k] : bvh.tree.first[node.child[k]];
+            if (inside & (1 << k))
+                visible.insert(visible.end(), bvh.objects.begin() + first, bvh.objects.begin() + first + node.count[k]);
+            else if (leaf) {
+                for (uint32_t i = first; i < first + node.count[k]; ++i)
+                    if (!UObjectOutsideFrustum(store, frustum, bvh.objects[i]))
+                        visible.push_back(bvh.objects[i]);
+            }
+            else
+                stack[depth++] = node.child[k];
+        }
+    }
+}
+
+// Finds the nearest object along a ray. intersect is asked about each object whose box the
+// ray reaches before the best hit so far and returns its own hit distance, or anything not
+// less than the distance it was given for a miss. Nodes are visited nearest first so far
+// ones get skipped. Returns the object hit, or BVH_NO_HIT, with distance updated
+uint32_t UBvhRaycast(const Bvh& bvh, glm::vec3 origin, glm::vec3 direction, float& distance,
+    const std::function<float(uint32_t, float)>& intersect)
+{
+    uint32_t best = BVH_NO_HIT;
+    if (bvh.tree.nodes.empty())
+        return best;
+
+    const glm::vec3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    struct Entry
+    {
+        int32_t node;
+        float entry;
+    };
+    Entry stack[BVH_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = { 0, 0.0f };
+    while (depth > 0) {
+        Entry top = stack[--depth];
+        if (top.entry >= distance)
+            continue;
+        const BvhNode& node = bvh.tree.nodes[top.node];
+        float entry[4];
+        int hits = UBvhTestRay(node, origin, inverseDirection, distance, entry);
+
+        // Nearest slot first
+        int order[4], hitCount = 0;
+        for (int k = 0; k < 4; ++k) {
+            if (node.count[k] == 0 || !(hits & (1 << k)))
+                continue;
+            int at = hitCount++;
+            for (; at > 0 && entry[order[at - 1]] > entry[k]; --at)
+                order[at] = order[at - 1];
+            order[at] = k;
+        }
+
+        // Leaves get tested now, inner nodes pushed far to near so the nearest pops next
+        for (int h = 0; h < hitCount; ++h) {
+            int k = order[h];
+            if (node.child[k] >= 0 || entry[k] >= distance)
+                continue;
+            const uint32_t first = (uint32_t)~node.child[k];
+            for (uint32_t i = first; i < first + node.count[k]; ++i) {
+                float hit = intersect(bvh.objects[i], distance);
+                if (hit < distance) {
+                    distance = hit;
+                    best = bvh.objects[i];
+                }
+            }
+        }
+        for (int h = hitCount; h-- > 0; ) {
+            int k = order[h];
+            if (node.child[k] >= 0 && entry[k] < distance)
+                stack[depth++] = { node.child[k], entry[k] };
+        }
+    }
+    return best;
+}
+
+// Appends every object whose world box overlaps [low, high]
+void UBvhQueryBox(const Bvh& bvh, const TransformStore& store, glm::vec3 low, glm::vec3 high, std::vector<uint32_t>& results)
+{
+    if (bvh.tree.nodes.empty())
+        return;
+
+    int32_t stack[BVH_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const BvhNode& node = bvh.tree.nodes[stack[--depth]];
+        int hits = UBvhTestBox(node, low, high);
+        for (int k = 0; k < 4; ++k) {
+            if (node.count[k] == 0 || !(hits & (1 << k)))
+                continue;
+            if (node.child[k] >= 0) {
+                stack[depth++] = node.child[k];
+                continue;
+            }
+            const uint32_t first = (uint32_t)~node.child[k];
+            for (uint32_t i = first; i < first + node.count[k]; ++i)
+                if (UObjectOverlapsBox(store, bvh.objects[i], low, high))
+                    results.push_back(bvh.objects[i]);
+        }
+    }
+}
+
+// Whether an object's world box overlaps [low, high]
+bool UObjectOverlapsBox(const TransformStore& store, uint32_t object, glm::vec3 low, glm::vec3 high)
+{
+    return fabsf(store.boundsX[object] - (low.x + high.x) * 0.5f) <= store.extentX[object] + (high.x - low.x) * 0.5f
+        && fabsf(store.boundsY[object] - (low.y + high.y) * 0.5f) <= store.extentY[object] + (high.y - low.y) * 0.5f
+        && fabsf(store.boundsZ[object] - (low.z + high.z) * 0.5f) <= store.extentZ[object] + (high.z - low.z) * 0.5f;
+}
+
+// Where a ray enters an object's world box, or maxDistance if it misses it on the way there
+float UIntersectObjectBox(const TransformStore& store, uint32_t object, glm::vec3 origin, glm::vec3 inverseDirection, float maxDistance)
+{
+    glm::vec3 center(store.boundsX[object], store.boundsY[object], store.boundsZ[object]);
+    glm::vec3 extent(store.extentX[object], store.extentY[object], store.extentZ[object]);
+    glm::vec3 t0 = (center - extent - origin) * inverseDirection, t1 = (center + extent - origin) * inverseDirection;
+    glm::vec3 near3 = glm::min(t0, t1), far3 = glm::max(t0, t1);
+    float entry = std::max(0.0f, std::max(near3.x, std::max(near3.y, near3.z)));
+    float exit = std::min(far3.x, std::min(far3.y, far3.z));
+    return entry <= exit && entry < maxDistance ? entry : maxDistance;
+}
+
+// Prints the scene BVH's shape and upkeep, headless runs do it at exit
+void UPrintBvhStats()
+{
+    const Bvh& bvh = gSceneBvh;
+    if (!gBvhCulling || !bvh.built)
+        return;
+    cout << "BVH: " << bvh.tree.nodes.size() << " nodes over " << bvh.objects.size() << " objects, "
+        << bvh.tree.nodes.size() * sizeof(BvhNode) / 1024 << " KiB, built " << bvh.builds << " times (last "
+        << bvh.lastBuildMs << " ms), refit " << bvh.refits << " times, cost " << bvh.cost / std::max(bvh.builtCost, 1e-9)
+        << "x of freshly built" << endl;
+}
+
+// Times building, refitting and querying BVHs over generated scenes of 10k, 100k and 1M
+// objects, checking every query against the flat loop it replaces
+void URunBvhBenchmark()
+{
+    UStartThreadPool(std::max(1, (int)std::thread::hardware_concurrency() - 1));
+    cout << "BVH benchmark, " << gThreadPool.workers.size() << " workers, " << sizeof(BvhNode) << " byte nodes" << endl;
+
+    auto msSince = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    const int counts[] = { 10000, 100000, 1000000 };
+    for (int count : counts) {
+        std::vector<SceneRecord> records;
+        UGenerateScene(count, records);
+        std::vector<GLObject> objects(records.size());
+        for (size_t i = 0; i < records.size(); ++i)
+            objects[i] = UMakeSceneObject(records[i]);
+        TransformStore store;
+        UInitTransformStore(store, objects);
+
+        Bvh bvh;
+        UBuildBvh(bvh, store);
+        double buildMs = bvh.lastBuildMs;
+
+        auto start = std::chrono::steady_clock::now();
+        URefitBvh(bvh, store, std::vector<std::pair<size_t, size_t>>(1, std::make_pair((size_t)0, (size_t)count)));
+        double fullRefitMs = msSince(start);
+
+        // Move one object in a hundred, the cars drag their cabs along
+        std::mt19937 random(17);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        for (int moved = 0; moved < count / 100; ++moved) {
+            size_t index = random() % count;
+            if (store.parent[index] >= 0)
+                index = store.parent[index];
+            UMoveObject(store, index, glm::vec3(store.positionX[index] + unit(random), store.positionY[index],
+                store.positionZ[index] + unit(random)));
+        }
+        UUpdateTransforms(store);
+        start = std::chrono::steady_clock::now();
+        URefitBvh(bvh, store, store.updatedRanges);
+        double refitMs = msSince(start);
+
+        // The same view as standing in the middle of the grid
+        glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 6.0f, 0.0f), glm::vec3(40.0f, 0.0f, 30.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        Frustum frustum = UExtractFrustum(glm::perspective(glm::radians(ZOOM), (float)WINDOW_WIDTH / WINDOW_HEIGHT, PROJECTION_NEAR, PROJECTION_FAR) * view);
+        std::vector<uint32_t> flatVisible, bvhVisible;
+        start = std::chrono::steady_clock::now();
+        UCullObjects(store, frustum, 0, count, flatVisible);
+        double flatFrustumMs = msSince(start);
+        start = std::chrono::steady_clock::now();
+        UBvhQueryFrustum(bvh, store, frustum, bvhVisible);
+        double bvhFrustumMs = msSince(start);
+        std::sort(bvhVisible.begin(), bvhVisible.end());
+        bool frustumMatches = bvhVisible == flatVisible;
+
+        // Rays from above the grid angled down, boxes the size of a few grid cells
+        const float side = sqrtf((float)count) * 3.0f;
+        const int queries = 1000;
+        std::vector<glm::vec3> origins(queries), directions(queries), boxLows(queries);
+        for (int q = 0; q < queries; ++q) {
+            origins[q] = glm::vec3(unit(random) * side * 0.5f, 20.0f, unit(random) * side * 0.5f);
+            directions[q] = glm::normalize(glm::vec3(unit(random), -1.0f, unit(random)));
+            boxLows[q] = glm::vec3(unit(random) * side * 0.5f, 0.0f, unit(random) * side * 0.5f);
+        }
+        const glm::vec3 boxSize(10.0f, 3.0f, 10.0f);
+
+        int rayMismatches = 0;
+        std::vector<float> bvhDistances(queries);
+        start = std::chrono::steady_clock::now();
+        for (int q = 0; q < queries; ++q) {
+            const glm::vec3 inverseDirection = 1.0f / directions[q];
+            float distance = FLT_MAX;
+            UBvhRaycast(bvh, origins[q], directions[q], distance, [&](uint32_t object, float maxDistance) {
+                return UIntersectObjectBox(store, object, origins[q], inverseDirection, maxDistance);
+            });
+            bvhDistances[q] = distance;
+        }
+        double bvhRayUs = msSince(start) * 1000.0 / queries;
+        start = std::chrono::steady_clock::now();
+        for (int q = 0; q < queries; ++q) {
+            const glm::vec3 inverseDirection = 1.0f / directions[q];
+            float distance = FLT_MAX;
+            for (int object = 0; object < count; ++object)
+                distance = UIntersectObjectBox(store, object, origins[q], inverseDirection, distance);
+            rayMismatches += distance != bvhDistances[q];
+        }
+        double flatRayUs = msSince(start) * 1000.0 / queries;
+
+        int boxMismatches = 0;
+        size_t boxHits = 0;
+        std::vector<uint32_t> results, flatResults;
+        double bvhBoxMs = 0.0, flatBoxMs = 0.0;
+        for (int q = 0; q < queries; ++q) {
+            results.clear();
+            flatResults.clear();
+            start = std::chrono::steady_clock::now();
+            UBvhQueryBox(bvh, store, boxLows[q], boxLows[q] + boxSize, results);
+            bvhBoxMs += msSince(start);
+            start = std::chrono::steady_clock::now();
+            for (int object = 0; object < count; ++object)
+                if (UObjectOverlapsBox(store, object, boxLows[q], boxLows[q] + boxSize))
+                    flatResults.push_back(object);
+            flatBoxMs += msSince(start);
+            std::sort(results.begin(), results.end());
+            boxMismatches += results != flatResults;
+            boxHits += results.size();
+        }
+
+        cout << "  " << count << " objects, " << bvh.tree.nodes.size() << " nodes ("
+            << bvh.tree.nodes.size() * sizeof(BvhNode) / 1024 << " KiB)" << endl;
+        cout << "    build " << buildMs << " ms, full refit " << fullRefitMs << " ms, refit after moving 1% ("
+            << store.updatedLastFrame << " objects) " << refitMs << " ms, cost " << bvh.cost / bvh.builtCost << "x of built" << endl;
+        cout << "    frustum: " << bvhFrustumMs << " ms against " << flatFrustumMs << " ms flat, " << bvhVisible.size()
+            << " visible" << (frustumMatches ? ", same set" : ", DIFFERENT SET") << endl;
+        cout << "    ray: " << bvhRayUs << " us against " << flatRayUs << " us flat, " << rayMismatches << " of " << queries << " differ" << endl;
+        cout << "    box: " << bvhBoxMs * 1000.0 / queries << " us against " << flatBoxMs * 1000.0 / queries << " us flat, "
+            << (double)boxHits / queries << " objects each, " << boxMismatches << " of " << queries << " differ" << endl;
+    }
+
+    UStopThreadPool();
+}
+
+// Turns a point in window pixels, y down, into a world space ray through the current view
+// and projection. Unprojecting the near and far plane points works for ortho and perspective
+void UMakePickRay(float x, float y, glm::vec3& origin, glm::vec3& direction)
+{
+    glm::mat4 inverseViewProjection = glm::inverse(UGetProjectionMatrix() * gCamera.GetViewMatrix());
+    glm::vec2 ndc(2.0f * x / WINDOW_WIDTH - 1.0f, 1.0f - 2.0f * y / WINDOW_HEIGHT);
+    glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndc, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndc, 1.0f, 1.0f);
+    origin = glm::vec3(nearPoint) / nearPoint.w;
+    direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+}
+
+// Finds the nearest object triangle along a ray, going through the scene BVH
+PickResult UPickObject(glm::vec3 origin, glm::vec3 direction)
+{
+    // The BVH isn't kept up to date while it isn't used for culling
+    if (!gSceneBvh.built || gSceneBvh.objectNode.size() != gTransforms.world.size())
+        UBuildBvh(gSceneBvh, gTransforms);
+
+    PickResult result;
+    const glm::vec3 inverseDirection = 1.0f / direction;
+    result.object = UBvhRaycast(gSceneBvh, origin, direction, result.distance, [&](uint32_t object, float maxDistance) {
+        if (UIntersectObjectBox(gTransforms, object, origin, inverseDirection, maxDistance) >= maxDistance)
+            return maxDistance;
+        ++result.objectsTested;
+        return UIntersectObjectTriangles(object, origin, direction, maxDistance, result.trianglesTested);
+    });
+    if (result.object != BVH_NO_HIT)
+        result.point = origin + direction * result.distance;
+    return result;
+}
+
+// Nearest hit of a world space ray on an object's mesh triangles, or maxDistance. The ray
+// goes into the object's local space instead of the triangles into world space; the
+// direction isn't renormalised there so distances along it stay in world units
+float UIntersectObjectTriangles(uint32_t object, glm::vec3 origin, glm::vec3 direction, float maxDistance, uint32_t& trianglesTested)
+{
+    const glm::mat4 toLocal = glm::inverse(gTransforms.world[object]);
+    const glm::vec3 localOrigin = glm::vec3(toLocal * glm::vec4(origin, 1.0f));
+    const glm::vec3 localDirection = glm::vec3(toLocal * glm::vec4(direction, 0.0f));
+
+    const MeshGeometry geometry = UGetMeshGeometry(gMeshRegistry.entries[sceneObjects[object].mesh]);
+    auto position = [&geometry](GLuint i) {
+        GLuint vertex = geometry.indexType == GL_UNSIGNED_SHORT ? ((const GLushort*)geometry.indices)[i] : ((const GLuint*)geometry.indices)[i];
+        const GLfloat* v = geometry.vertices + vertex * FLOATS_PER_VERTEX;
+        return glm::vec3(v[0], v[1], v[2]);
+    };
+
+    float nearest = maxDistance;
+    for (GLuint i = 0; i + 2 < geometry.indexCount; i += 3)
+        nearest = URayTriangle(localOrigin, localDirection, position(i), position(i + 1), position(i + 2), nearest);
+    trianglesTested += geometry.indexCount / 3;
+    return nearest;
+}
+
+// Moller-Trumbore ray triangle intersection, both faces. Returns the hit distance along
+// direction if it's nearer than maxDistance, otherwise maxDistance
+float URayTriangle(glm::vec3 origin, glm::vec3 direction, glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, float maxDistance)
+{
+    const float epsilon = 1e-7f;
+    glm::vec3 edge1 = v1 - v0, edge2 = v2 - v0;
+    glm::vec3 p = glm::cross(direction, edge2);
+    float determinant = glm::dot(edge1, p);
+    if (fabsf(determinant) < epsilon)
+        return maxDistance;     // Parallel to the triangle
+
+    float inverseDeterminant = 1.0f / determinant;
+    glm::vec3 s = origin - v0;
+    float u = glm::dot(s, p) * inverseDeterminant;
+    if (u < 0.0f || u > 1.0f)
+        return maxDistance;
+    glm::vec3 q = glm::cross(s, edge1);
+    float v = glm::dot(direction, q) * inverseDeterminant;
+    if (v < 0.0f || u + v > 1.0f)
+        return maxDistance;
+    float t = glm::dot(edge2, q) * inverseDeterminant;
+    return t > 0.0f && t < maxDistance ? t : maxDistance;
+}
+
+// Picks whatever is under the cursor and reports it. The cursor is captured for mouse look,
+// so it always sits in the middle of the view
+void UPickAtCursor()
+{
+    auto start = std::chrono::steady_clock::now();
+    glm::vec3 origin, direction;
+    UMakePickRay(WINDOW_WIDTH * 0.5f, WINDOW_HEIGHT * 0.5f, origin, direction);
+    PickResult pick = UPickObject(origin, direction);
+    double latencyUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    if (pick.object == BVH_NO_HIT) {
+        cout << "Picked nothing (" << latencyUs << " us)" << endl;
+        return;
+    }
+    const GLObject& object = sceneObjects[pick.object];
+    cout << "Picked object " << pick.object << " (" << SHAPE_NAMES[(int)object.shape] << ", " << TEXTURE_NAMES[(int)object.texture]
+        << ") at " << pick.point.x << " " << pick.point.y << " " << pick.point.z << ", " << pick.distance << " away, in "
+        << latencyUs << " us testing " << pick.trianglesTested << " triangles of " << pick.objectsTested << " objects" << endl;
+}
+
+// Casts count picks through random screen points from wherever the camera ended up, times
+// them and checks each against testing every object's box and triangles in turn
+void URunPickBenchmark(int count)
+{
+    std::mt19937 random(19);
+    std::uniform_real_distribution<float> unitX(0.0f, (float)WINDOW_WIDTH), unitY(0.0f, (float)WINDOW_HEIGHT);
+    std::vector<double> latenciesUs;
+    size_t hits = 0, triangles = 0;
+    int mismatches = 0;
+    double bruteUs = 0.0;
+    for (int pick = 0; pick < count; ++pick) {
+        glm::vec3 origin, direction;
+        UMakePickRay(unitX(random), unitY(random), origin, direction);
+
+        auto start = std::chrono::steady_clock::now();
+        PickResult result = UPickObject(origin, direction);
+        latenciesUs.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        hits += result.object != BVH_NO_HIT;
+        triangles += result.trianglesTested;
+
+        start = std::chrono::steady_clock::now();
+        const glm::vec3 inverseDirection = 1.0f / direction;
+        float bruteDistance = FLT_MAX;
+        uint32_t bruteObject = BVH_NO_HIT, unused = 0;
+        for (uint32_t object = 0; object < (uint32_t)sceneObjects.size(); ++object) {
+            if (UIntersectObjectBox(gTransforms, object, origin, inverseDirection, bruteDistance) >= bruteDistance)
+                continue;
+            float distance = UIntersectObjectTriangles(object, origin, direction, bruteDistance, unused);
+            if (distance < bruteDistance) {
+                bruteDistance = distance;
+                bruteObject = object;
+            }
+        }
+        bruteUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        mismatches += bruteDistance != result.distance || (bruteObject != result.object && bruteDistance != FLT_MAX);
+    }
+
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+    double sum = 0.0;
+    for (double us : latenciesUs)
+        sum += us;
+    cout << "Pick latency over " << count << " picks of " << sceneObjects.size() << " objects: mean " << sum / count
+        << " us, p50 " << latenciesUs[count / 2] << " us, p99 " << latenciesUs[std::min(count - 1, count * 99 / 100)]
+        << " us, max " << latenciesUs.back() << " us; " << hits << " hit something, " << (double)triangles / count
+        << " triangles tested on average. Testing every object took " << bruteUs / count << " us, "
+        << mismatches << " picks differed" << endl;
+}
+
+// Times a full transform update of TRANSFORM_BENCHMARK_OBJECTS objects: the old three-matrix
+// GetModelMatrix() product, the scalar and SSE batch kernels, and a frame where one
+// object in a hundred changed
+void URunTransformBenchmark()
+{
+    const size_t count = TRANSFORM_BENCHMARK_OBJECTS;
+    std::mt19937 random(330);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    // The old layout, three matrices per object
+    struct MatrixTransform
+    {
+        glm::mat4 scale;
+        glm::mat4 rotation;
+        glm::mat4 translation;
+    };
+    std::vector<MatrixTransform> matrices(count);
+    TransformStore store;
+    UResizeTransformStore(store, count);
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 position(unit(random) * 1000.0f, unit(random) * 10.0f, unit(random) * 1000.0f);
+        glm::vec3 angles(unit(random) * 6.28f, unit(random) * 6.28f, unit(random) * 6.28f);
+        glm::vec3 scale(0.5f + unit(random), 0.5f + unit(random), 0.5f + unit(random));
+        matrices[i].scale = glm::scale(scale);
+        matrices[i].rotation = glm::eulerAngleXYZ(angles.x, angles.y, angles.z);
+        matrices[i].translation = glm::translate(position);
+        USetTransform(store, i, position, glm::quat_cast(glm::mat3(matrices[i].rotation)), scale);
+    }
+    UPropagateTransforms(store, 0, count);
+
+    // Best of a few runs, so the first run's page faults and cold caches don't count
+    auto time = [](const std::function<void()>& run) {
+        double best = 0.0;
+        for (int repeat = 0; repeat < 5; ++repeat) {
+            auto start = std::chrono::steady_clock::now();
+            run();
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            best = repeat == 0 ? ms : std::min(best, ms);
+        }
+        return best;
+    };
+
+    std::vector<glm::mat4> models(count);
+    double matrixMs = time([&]() {
+        for (size_t i = 0; i < count; ++i)
+            models[i] = matrices[i].translation * matrices[i].rotation * matrices[i].scale;
+    });
+    double scalarMs = time([&]() { UComputeTransformsScalar(store, 0, count); });
+    double simdMs = time([&]() { UComputeTransforms(store, 0, count); });
+
+    float maxError = 0.0f;
+    for (size_t i = 0; i < count; ++i)
+        for (int c = 0; c < 4; ++c)
+            for (int r = 0; r < 4; ++r)
+                maxError = std::max(maxError, fabsf(models[i][c][r] - store.world[i][c][r]));
+
+    // Scattered single objects, the worst case for range merging
+    std::vector<size_t> changed(count / 100);
+    for (size_t& index : changed)
+        index = random() % count;
+    std::sort(changed.begin(), changed.end());
+    double dirtyMs = time([&]() {
+        for (size_t index : changed)
+            UMarkTransformsDirty(store, index, index + 1);
+        UUpdateTransforms(store);
+    });
+    size_t dirtyUpdated = store.updatedLastFrame;
+
+    // The same objects as groups of a parent and three children, like a car and its parts
+    const size_t groupSize = 4;
+    for (size_t i = 0; i < count; ++i) {
+        store.parent[i] = i % groupSize == 0 ? -1 : (int32_t)(i - i % groupSize);
+        store.subtreeEnd[i] = i % groupSize == 0 ? (uint32_t)std::min(count, i + groupSize) : (uint32_t)i + 1;
+    }
+    double hierarchyMs = time([&]() {
+        UMarkTransformsDirty(store, 0, count);
+        UUpdateTransforms(store);
+    });
+    const size_t movedGroup = count / 2 / groupSize * groupSize;
+    double groupMs = time([&]() {
+        UMoveObject(store, movedGroup, glm::vec3(store.positionX[movedGroup] + 1.0f, 0.0f, 0.0f));
+        UUpdateTransforms(store);
+    });
+
+    cout << "Transform benchmark, " << count << " objects:" << endl;
+    cout << "  GetModelMatrix (3 x mat4): " << matrixMs << " ms, " << matrixMs * 1e6 / count << " ns per object" << endl;
+    cout << "  SoA scalar, with normals:  " << scalarMs << " ms, " << scalarMs * 1e6 / count << " ns per object" << endl;
+#ifdef U_HAVE_SSE
+    cout << "  SoA SSE, with normals:     " << simdMs << " ms, " << simdMs * 1e6 / count << " ns per object" << endl;
+#else
+    cout << "  SoA SSE: not available on this target, " << simdMs << " ms scalar again" << endl;
+#endif
+    cout << "  1% dirty (" << changed.size() << " objects, " << dirtyUpdated << " updated): " << dirtyMs << " ms" << endl;
+    cout << "  In groups of " << groupSize << ": whole scene " << hierarchyMs << " ms, one group moved ("
+        << store.updatedLastFrame << " objects) " << groupMs * 1000.0 << " us" << endl;
+    cout << "  Source data: " << sizeof(MatrixTransform) << " bytes per object before, " << 10 * sizeof(float)
+        << " after. Largest difference from GetModelMatrix: " << maxError << endl;
+}
+
+// Replaces sceneObjects with the objects in a scene file, text or binary. Text files are
+// cut into slices at line breaks and parsed on the thread pool, then the objects are built
+// on the pool as well
+bool ULoadSceneFile(const char* filename)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        cout << "Failed to open scene " << filename << endl;
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    const size_t size = (size_t)file.tellg();
+    file.seekg(0);
+    std::vector<char> bytes(size);
+    file.read(bytes.data(), size);
+    if (!file)
+    {
+        cout << "Failed to read scene " << filename << endl;
+        return false;
+    }
+
+    const int jobCount = std::max<int>(1, (int)gThreadPool.workers.size() * 4);
+    std::vector<SceneRecord> records;
+    const SceneFileHeader* header = (const SceneFileHeader*)bytes.data();
+    const bool binary = size >= sizeof(SceneFileHeader) && memcmp(header->magic, SCENE_FILE_MAGIC, 4) == 0;
+    if (binary)
+    {
+        if (header->version != SCENE_FILE_VERSION || size != sizeof(SceneFileHeader) + (size_t)header->objectCount * sizeof(SceneRecord))
+        {
+            cout << filename << ": unsupported version or truncated binary scene" << endl;
+            return false;
+        }
+        records.resize(header->objectCount);
+        memcpy(records.data(), bytes.data() + sizeof(SceneFileHeader), records.size() * sizeof(SceneRecord));
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            if (records[i].shape < 0 || records[i].shape >= SHAPE_NAME_COUNT || records[i].texture < 0 || records[i].texture >= TEXTURE_NAME_COUNT)
+            {
+                cout << filename << ": object " << i << " has an unknown shape or texture" << endl;
+                return false;
+            }
+        }
+    }
+    else
+    {
+        // Small files aren't worth splitting
+        const int sliceCount = (int)std::min<size_t>(jobCount, size / SCENE_PARSE_SLICE_BYTES + 1);
+        std::vector<size_t> bounds(sliceCount + 1, size);
+        bounds[0] = 0;
+        for (int i = 1; i < sliceCount; ++i)
+        {
+            size_t bound = std::max(bounds[i - 1], size / sliceCount * i);
+            const char* lineEnd = (const char*)memchr(bytes.data() + bound, '\n', size - bound);
+            bounds[i] = lineEnd ? lineEnd - bytes.data() + 1 : size;
+        }
+
+        struct SceneSlice
+        {
+            std::vector<SceneRecord> records;
+            int lines = 0;
+            std::string error;
+            bool parsed = false;
+        };
+        std::vector<SceneSlice> slices(sliceCount);
+        UParallelFor(sliceCount, [&](int i) {
+            slices[i].parsed = UParseSceneText(bytes.data() + bounds[i], bytes.data() + bounds[i + 1],
+                slices[i].records, slices[i].lines, slices[i].error);
+        });
+
+        // Slices count lines from their own start, so errors get the earlier slices added
+        int lineBase = 0;
+        size_t total = 0;
+        for (const SceneSlice& slice : slices)
+        {
+            if (!slice.parsed)
+            {
+                cout << filename << ":" << lineBase + slice.lines << ": " << slice.error << endl;
+                return false;
+            }
+            lineBase += slice.lines;
+            total += slice.records.size();
+        }
+        records.reserve(total);
+        for (const SceneSlice& slice : slices)
+            records.insert(records.end(), slice.records.begin(), slice.records.end());
+    }
+
+    // Parents listed first also means there can't be a cycle
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        if (records[i].parent < -1 || records[i].parent >= (int64_t)i)
+        {
+            cout << filename << ": object " << i << " has parent " << records[i].parent
+                << ", a parent has to be an object listed before it" << endl;
+            return false;
+        }
+    }
+    auto parsed = std::chrono::steady_clock::now();
+
+    std::vector<GLObject> objects(records.size());
+    UParallelFor(jobCount, [&](int job) {
+        size_t begin = records.size() * job / jobCount;
+        size_t end = records.size() * (job + 1) / jobCount;
+        for (size_t i = begin; i < end; ++i)
+            objects[i] = UMakeSceneObject(records[i]);
+    });
+    sceneObjects.swap(objects);
+    auto built = std::chrono::steady_clock::now();
+
+    cout << "Scene: " << sceneObjects.size() << " objects from " << filename << (binary ? " (binary)" : " (text)") << " in "
+        << std::chrono::duration<double, std::milli>(built - start).count() << " ms, parse "
+        << std::chrono::duration<double, std::milli>(parsed - start).count() << " ms, objects "
+        << std::chrono::duration<double, std::milli>(built - parsed).count() << " ms on "
+        << gThreadPool.workers.size() << " workers" << endl;
+    return true;
+}
+
+// Parses whole lines of a text scene into records. lines returns how many lines were read,
+// which on failure is the line error is about
+bool UParseSceneText(const char* begin, const char* end, std::vector<SceneRecord>& records, int& lines, std::string& error)
+{
+    auto skipSpaces = [](const char*& p, const char* lineEnd) {
+        while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r'))
+            ++p;
+    };
+
+    lines = 0;
+    for (const char* p = begin; p < end; )
+    {
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        if (!lineEnd)
+            lineEnd = end;
+        ++lines;
+
+        skipSpaces(p, lineEnd);
+        if (p == lineEnd || *p == '#')
+        {
+            p = lineEnd + 1;
+            continue;
+        }
+
+        SceneRecord record;
+        if (!UParseSceneName(p, lineEnd, SHAPE_NAMES, SHAPE_NAME_COUNT, record.shape))
+        {
+            error = "unknown shape";
+            return false;
+        }
+        skipSpaces(p, lineEnd);
+        if (!UParseSceneName(p, lineEnd, TEXTURE_NAMES, TEXTURE_NAME_COUNT, record.texture))
+        {
+            error = "unknown texture";
+            return false;
+        }
+
+        float fields[11];
+        for (float& field : fields)
+        {
+            skipSpaces(p, lineEnd);
+            if (!UParseSceneFloat(p, lineEnd, field))
+            {
+                error = "expected shape, texture and 11 numbers";
+                return false;
+            }
+        }
+        // Then optionally the index of the parent object, counting objects from 0. The loader
+        // checks it against the objects listed before this one
+        int32_t parent = -1;
+        skipSpaces(p, lineEnd);
+        if (p != lineEnd && *p != '#' && !UParseSceneIndex(p, lineEnd, parent))
+        {
+            error = "expected a parent object index after the scale";
+            return false;
+        }
+        skipSpaces(p, lineEnd);
+        if (p != lineEnd && *p != '#')
+        {
+            error = "unexpected text after the parent";
+            return false;
+        }
+
+        record.uvScale = glm::vec2(fields[0], fields[1]);
+        record.translation = glm::vec3(fields[2], fields[3], fields[4]);
+        record.rotation = glm::vec3(fields[5], fields[6], fields[7]);
+        record.scale = glm::vec3(fields[8], fields[9], fields[10]);
+        record.parent = parent;
+        records.push_back(record);
+        p = lineEnd + 1;
+    }
+    return true;
+}
+
+// Matches the word at p against names, advancing p past it
+bool UParseSceneName(const char*& p, const char* end, const char* const* names, int nameCount, int32_t& value)
+{
+    const char* wordEnd = p;
+    while (wordEnd < end && *wordEnd != ' ' && *wordEnd != '\t' && *wordEnd != '\r')
+        ++wordEnd;
+
+    for (int i = 0; i < nameCount; ++i)
+    {
+        if (strlen(names[i]) == (size_t)(wordEnd - p) && memcmp(names[i], p, wordEnd - p) == 0)
+        {
+            value = i;
+            p = wordEnd;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads a decimal number at p, advancing p past it. strtof goes through the locale and
+// wants a terminated string, this takes a plain sign, digits, fraction and exponent and is
+// several times quicker
+bool UParseSceneFloat(const char*& p, const char* end, float& value)
+{
+    static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    const char* s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = *s++ == '-';
+
+    // Digits past what fits exactly in a double only shift the exponent
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; ++s, ++digits)
+    {
+        if (mantissa < 1000000000000000000ull)
+            mantissa = mantissa * 10 + (*s - '0');
+        else
+            ++exponent;
+    }
+    if (s < end && *s == '.')
+    {
+        for (++s; s < end && *s >= '0' && *s <= '9'; ++s, ++digits)
+        {
+            if (mantissa < 1000000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (*s - '0');
+                --exponent;
+            }
+        }
+    }
+    if (digits == 0)
+        return false;
+
+    if (s < end && (*s == 'e' || *s == 'E'))
+    {
+        ++s;
+        bool negativeExponent = false;
+        if (s < end && (*s == '-' || *s == '+'))
+            negativeExponent = *s++ == '-';
+        int power = 0, powerDigits = 0;
+        for (; s < end && *s >= '0' && *s <= '9'; ++s, ++powerDigits)
+            power = std::min(power * 10 + (*s - '0'), 1000);
+        if (powerDigits == 0)
+            return false;
+        exponent += negativeExponent ? -power : power;
+    }
+
+    // Numbers run into the next field without a separator
+    if (s < end && *s != ' ' && *s != '\t' && *s != '\r' && *s != '#')
+        return false;
+
+    double result = (double)mantissa;
+    if (exponent < 0 && exponent >= -22)
+        result /= powersOfTen[-exponent];
+    else if (exponent > 0 && exponent <= 22)
+        result *= powersOfTen[exponent];
+    else if (exponent != 0)
+        result *= pow(10.0, exponent);
+
+    value = (float)(negative ? -result : result);
+    p = s;
+    return true;
+}
+
+// Reads an object index at p, advancing p past it. Only plain digits or -1 for none, so a
+// fraction or exponent can't round to some other object
+bool UParseSceneIndex(const char*& p, const char* end, int32_t& value)
+{
+    const char* s = p;
+    if (end - s >= 2 && s[0] == '-' && s[1] == '1')
+    {
+        value = -1;
+        s += 2;
+    }
+    else
+    {
+        int64_t index = 0;
+        int digits = 0;
+        for (; s < end && *s >= '0' && *s <= '9'; ++s, ++digits)
+        {
+            index = index * 10 + (*s - '0');
+            if (index > INT32_MAX)
+                return false;
+        }
+        if (digits == 0)
+            return false;
+        value = (int32_t)index;
+    }
+
+    if (s < end && *s != ' ' && *s != '\t' && *s != '\r' && *s != '#')
+        return false;
+    p = s;
+    return true;
+}
+
+// Writes records as a scene file, binary when the name ends in .bscene and text otherwise
+bool UWriteSceneFile(const char* filename, const std::vector<SceneRecord>& records)
+{
+    const size_t length = strlen(filename);
+    const bool binary = length >= 7 && strcmp(filename + length - 7, ".bscene") == 0;
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        cout << "Failed to open " << filename << " for writing" << endl;
+        return false;
+    }
+
+    if (binary)
+    {
+        SceneFileHeader header;
+        memcpy(header.magic, SCENE_FILE_MAGIC, 4);
+        header.version = SCENE_FILE_VERSION;
+        header.objectCount = (uint32_t)records.size();
+        header.reserved = 0;
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)records.data(), records.size() * sizeof(SceneRecord));
+    }
+    else
+    {
+        file << "# shape texture  uvScale.x uvScale.y  translation x y z  rotation x y z (degrees)  scale x y z  [parent]\n";
+        char line[256];
+        for (const SceneRecord& record : records)
+        {
+            int length = snprintf(line, sizeof(line), "%s %s  %g %g  %g %g %g  %g %g %g  %g %g %g",
+                SHAPE_NAMES[record.shape], TEXTURE_NAMES[record.texture], record.uvScale.x, record.uvScale.y,
+                record.translation.x, record.translation.y, record.translation.z,
+                record.rotation.x, record.rotation.y, record.rotation.z,
+                record.scale.x, record.scale.y, record.scale.z);
+            if (record.parent >= 0)
+                snprintf(line + length, sizeof(line) - length, "  %d", (int)record.parent);
+            file << line << "\n";
+        }
+    }
+
+    if (!file)
+    {
+        cout << "Failed to write " << filename << endl;
+        return false;
+    }
+    cout << "Wrote " << records.size() << " objects to " << filename << endl;
+    return true;
+}
+
+// Scatters count random objects on a grid centred on the street, for load and render
+// scaling tests. Every eighth grid cell holds a two part car, a body with a cab parented
+// to it. The same count always gives the same scene
+void UGenerateScene(int count, std::vector<SceneRecord>& records)
+{
+    std::mt19937 random(330);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const int side = (int)ceil(sqrt((double)count));
+    const float spacing = 3.0f;
+
+    records.resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        SceneRecord& record = records[i];
+        record.shape = (int32_t)(random() % SHAPE_NAME_COUNT);
+        record.texture = (int32_t)(random() % TEXTURE_NAME_COUNT);
+        record.uvScale = glm::vec2(1.0f, 1.0f);
+        record.scale = glm::vec3(0.5f + unit(random), 0.5f + unit(random), 0.5f + unit(random));
+        record.rotation = glm::vec3(0.0f, unit(random) * 360.0f, 0.0f);
+        record.translation = glm::vec3((i % side - side / 2) * spacing, record.scale.y * 0.5f, (i / side - side / 2) * spacing);
+        record.parent = -1;
+
+        // The cab takes the next slot and rides on top of the body
+        if (i % 8 == 0 && i + 1 < count)
+        {
+            record.shape = (int32_t)PrimitiveShape::CUBE;
+            record.texture = (int32_t)BasicTexture::METAL;
+            record.scale = glm::vec3(2.0f, 0.75f, 1.0f);
+            record.translation.y = record.scale.y * 0.5f;
+
+            SceneRecord& cab = records[++i];
+            cab = record;
+            cab.texture = (int32_t)BasicTexture::GLASS;
+            cab.scale = glm::vec3(1.0f, 0.5f, 0.9f);
+            cab.rotation = glm::vec3(0.0f);
+            cab.translation = glm::vec3(-0.25f, (record.scale.y + cab.scale.y) * 0.5f, 0.0f);
+            cab.parent = i - 1;
+        }
+    }
+}
+
+// Returns a handle to the mesh for key, generating and uploading it on first use
+MeshHandle UAcquireMesh(MeshKey key)
+{
+    // Scenes only ever hold a handful of distinct meshes, a linear search beats hashing
+    int freeSlot = -1;
+    for (size_t i = 0; i < gMeshRegistry.entries.size(); ++i) {
+        MeshEntry& entry = gMeshRegistry.entries[i];
+        if (entry.refCount > 0 && entry.key == key) {
+            ++entry.refCount;
+            return (MeshHandle)i;
+        }
+        if (entry.refCount == 0 && freeSlot < 0)
+            freeSlot = (int)i;
+    }
+
+    MeshEntry entry;
+    entry.key = key;
+    entry.refCount = 1;
+    entry.mesh = GLMesh();
+    entry.arenaFirstIndex = 0;
+    entry.arenaBaseVertex = 0;
+
+    // Cooked meshes upload straight from the mapped pack
+    entry.packIndex = UFindPackedMesh(key);
+    if (entry.packIndex >= 0) {
+        UUploadMeshGeometry(UGetMeshGeometry(entry), entry.mesh);
+    }
+    else {
+        UGenerateMesh(key, entry.data);
+        UUploadMesh(entry.data, entry.mesh);
+    }
+    entry.bounds = UComputeMeshBounds(UGetMeshGeometry(entry));
+    USetupInstanceAttributes(entry.mesh);
+
+    ++gMeshRegistry.uniqueMeshes;
+    ++gMeshRegistry.generation;
+    gMeshRegistry.bytesResident += entry.mesh.bufferBytes;
+
+    if (freeSlot >= 0) {
+        gMeshRegistry.entries[freeSlot] = entry;
+        return freeSlot;
+    }
+    gMeshRegistry.entries.push_back(entry);
+    return (MeshHandle)gMeshRegistry.entries.size() - 1;
+}
+
+// Key every object of a shape starts out with, the finest level of its chain
+MeshKey UDefaultMeshKey(PrimitiveShape shape)
+{
+    return ULodMeshKey(shape, 0);
+}
+
+// Number of detail levels a shape is generated at, fixed shapes only have the one
+int ULodLevelCount(PrimitiveShape shape)
+{
+    return shape == PrimitiveShape::CYLINDER ? LOD_LEVELS : 1;
+}
+
+// Key of one detail level of a shape
+MeshKey ULodMeshKey(PrimitiveShape shape, int level)
+{
+    MeshKey key = { shape, shape == PrimitiveShape::CYLINDER ? CYLINDER_LOD_SIDES[level] : 0 };
+    return key;
+}
+
+// Runs the generator for key
+void UGenerateMesh(MeshKey key, MeshData& data)
+{
+    switch (key.shape) {
+    case PrimitiveShape::CUBE:
+        UCreateCubeMesh(data);
+        break;
+    case PrimitiveShape::PYRAMID:
+        UCreatePyramidMesh(data);
+        break;
+    case PrimitiveShape::PLANE:
+        UCreatePlaneMesh(data);
+        break;
+    case PrimitiveShape::CYLINDER:
+        UCreateCylinderMesh(data, key.detail);
+        break;
+    }
+}
+
+// Where a registry mesh's geometry lives: in the asset pack, or in its own MeshData
+MeshGeometry UGetMeshGeometry(const MeshEntry& entry)
+{
+    MeshGeometry geometry;
+    if (entry.packIndex >= 0) {
+        const PackMesh& packed = UGetPackMeshes()[entry.packIndex];
+        geometry.vertices = (const GLfloat*)(gAssetPack.base + packed.vertexOffset);
+        geometry.vertexCount = packed.vertexCount;
+        geometry.indices = gAssetPack.base + packed.indexOffset;
+        geometry.indexCount = packed.indexCount;
+        geometry.indexType = packed.indexType;
+    }
+    else {
+        geometry.vertices = entry.data.vertices.data();
+        geometry.vertexCount = (GLuint)(entry.data.vertices.size() / FLOATS_PER_VERTEX);
+        geometry.indices = entry.data.indices.data();
+        geometry.indexCount = (GLuint)entry.data.indices.size();
+        geometry.indexType = GL_UNSIGNED_INT;
+    }
+    return geometry;
+}
+
+// Stores indices in the narrowest GL index type that holds all of them and returns that type
+GLenum UPackIndices(const std::vector<GLuint>& indices, std::vector<unsigned char>& bytes)
+{
+    GLuint maxIndex = indices.empty() ? 0 : *std::max_element(indices.begin(), indices.end());
+    if (maxIndex <= 0xFFFF) {
+        bytes.resize(indices.size() * sizeof(GLushort));
+        GLushort* shortIndices = (GLushort*)bytes.data();
+        for (size_t i = 0; i < indices.size(); ++i)
+            shortIndices[i] = (GLushort)indices[i];
+        return GL_UNSIGNED_SHORT;
+    }
+
+    bytes.resize(indices.size() * sizeof(GLuint));
+    memcpy(bytes.data(), indices.data(), bytes.size());
+    return GL_UNSIGNED_INT;
+}
+
+// Drops one reference to a mesh and destroys it once the last user is gone
+void UReleaseMesh(MeshHandle handle)
+{
+    if (handle < 0 || handle >= (MeshHandle)gMeshRegistry.entries.size())
+        return;
+
+    MeshEntry& entry = gMeshRegistry.entries[handle];
+    if (entry.refCount <= 0 || --entry.refCount > 0)
+        return;
+
+    --gMeshRegistry.uniqueMeshes;
+    ++gMeshRegistry.generation;
+    gMeshRegistry.bytesResident -= entry.mesh.bufferBytes;
+    UDestroyMesh(entry.mesh);
+    entry.data = MeshData();
+    entry.packIndex = -1;
+}
+
+// Creates the shared instance attribute buffer with room for instanceCount objects
+void UCreateInstanceBuffer(GLsizeiptr instanceCount)
+{
+    // Every VAO reads instance data even when drawing without instancing, so keep it non-empty
+    gInstanceVboCapacity = std::max<GLsizeiptr>(instanceCount, 1) * sizeof(InstanceData);
+
+    glGenBuffers(1, &gInstanceVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, gInstanceVboCapacity, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Free the instance attribute buffer
+void UDestroyInstanceBuffer()
+{
+    glDeleteBuffers(1, &gInstanceVbo);
+    gInstanceVboCapacity = 0;
+}
+
+// Points a mesh's VAO at the instance buffer, advancing once per instance
+void USetupInstanceAttributes(GLMesh& mesh)
+{
+    glBindVertexArray(mesh.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gInstanceVbo);
+
+    // A mat4 attribute is fed as four vec4 columns
+    for (GLuint column = 0; column < 4; ++column) {
+        GLuint location = INSTANCE_MODEL_LOCATION + column;
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+            (void*)(sizeof(glm::vec4) * column));
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
+
+    glVertexAttribPointer(INSTANCE_MATERIAL_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+        (void*)offsetof(InstanceData, material));
+    glEnableVertexAttribArray(INSTANCE_MATERIAL_LOCATION);
+    glVertexAttribDivisor(INSTANCE_MATERIAL_LOCATION, 1);
+
+    // And a mat3 as three vec3 columns, each padded out to a vec4
+    for (GLuint column = 0; column < 3; ++column) {
+        GLuint location = INSTANCE_NORMAL_LOCATION + column;
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+            (void*)(offsetof(InstanceData, normal) + sizeof(glm::vec4) * column));
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Looks up the GL mesh behind a handle
+GLMesh& UGetMesh(MeshHandle handle)
+{
+    return gMeshRegistry.entries[handle].mesh;
+}
+
+// Prints how many meshes are resident and how much GPU memory they hold
+void UPrintMeshRegistryStats()
+{
+    int references = 0;
+    for (const MeshEntry& entry : gMeshRegistry.entries)
+        references += entry.refCount;
+
+    // Level of detail chains hold a reference to each of their meshes besides the objects'
+    for (const LodChain& chain : gLodChains)
+        references -= chain.levels;
+
+    cout << "Mesh registry: " << gMeshRegistry.uniqueMeshes << " unique meshes shared by " << references
+        << " objects, " << gMeshRegistry.bytesResident << " bytes resident" << endl;
+}
+
+// Packs every live registry mesh into the arena's shared vertex and element buffers
+void UBuildMeshArena()
+{
+    UDestroyMeshArena();
+
+    // Indices stay local to their mesh and base vertex does the rest, so 16-bit indices
+    // keep working as long as no single mesh needs more
+    std::vector<GLfloat> vertices;
+    std::vector<QuantizedVertex> quantized;
+    std::vector<GLuint> indices;
+    int meshes = 0;
+    for (MeshEntry& entry : gMeshRegistry.entries) {
+        if (entry.refCount <= 0)
+            continue;
+
+        entry.arenaFirstIndex = (GLuint)indices.size();
+        entry.arenaBaseVertex = (GLint)(vertices.size() / FLOATS_PER_VERTEX);
+
+        MeshGeometry geometry = UGetMeshGeometry(entry);
+        vertices.insert(vertices.end(), geometry.vertices, geometry.vertices + geometry.vertexCount * FLOATS_PER_VERTEX);
+        if (gQuantizedVertices)
+            UQuantizeVertices(geometry, entry.bounds, quantized);   // Each mesh keeps its own box
+        for (GLuint i = 0; i < geometry.indexCount; ++i) {
+            if (geometry.indexType == GL_UNSIGNED_SHORT)
+                indices.push_back(((const GLushort*)geometry.indices)[i]);
+            else
+                indices.push_back(((const GLuint*)geometry.indices)[i]);
+        }
+        ++meshes;
+    }
+
+    std::vector<unsigned char> indexBytes;
+    MeshGeometry arenaGeometry;
+    arenaGeometry.vertices = vertices.data();
+    arenaGeometry.vertexCount = (GLuint)(vertices.size() / FLOATS_PER_VERTEX);
+    arenaGeometry.indexType = UPackIndices(indices, indexBytes);
+    arenaGeometry.indices = indexBytes.data();
+    arenaGeometry.indexCount = (GLuint)indices.size();
+    if (gQuantizedVertices)
+        arenaGeometry.quantized = quantized.data();
+
+    GLMesh arenaMesh = GLMesh();
+    UUploadMeshGeometry(arenaGeometry, arenaMesh);
+    gMeshArena.vao = arenaMesh.vao;
+    gMeshArena.vbo = arenaMesh.vbo;
+    gMeshArena.ebo = arenaMesh.ebo;
+    gMeshArena.indexType = arenaMesh.indexType;
+    gMeshArena.bufferBytes = arenaMesh.bufferBytes;
+
+    // Draw index advances once per instance, starting from the command's base instance
+    glGenBuffers(1, &gMeshArena.drawIndexVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, gMeshArena.drawIndexVbo);
+    glVertexAttribIPointer(DRAW_INDEX_LOCATION, 1, GL_UNSIGNED_INT, sizeof(GLuint), 0);
+    glEnableVertexAttribArray(DRAW_INDEX_LOCATION);
+    glVertexAttribDivisor(DRAW_INDEX_LOCATION, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glGenBuffers(1, &gDrawDataSsbo);
+    glGenBuffers(1, &gIndirectBuffer);
+
+    gMeshArena.builtGeneration = gMeshRegistry.generation;
+
+    cout << "Mesh arena: " << meshes << " meshes, " << arenaGeometry.vertexCount << " vertices, "
+        << arenaGeometry.indexCount << (gMeshArena.indexType == GL_UNSIGNED_SHORT ? " 16" : " 32")
+        << "-bit indices, " << gMeshArena.bufferBytes << " bytes" << endl;
+}
+
+// Free the arena and the multi-draw buffers
+void UDestroyMeshArena()
+{
+    glDeleteVertexArrays(1, &gMeshArena.vao);
+    glDeleteBuffers(1, &gMeshArena.vbo);
+    glDeleteBuffers(1, &gMeshArena.ebo);
+    glDeleteBuffers(1, &gMeshArena.drawIndexVbo);
+    glDeleteBuffers(1, &gDrawDataSsbo);
+    glDeleteBuffers(1, &gIndirectBuffer);
+    gMeshArena = MeshArena();
+    gDrawDataSsbo = 0;
+    gDrawDataCapacity = 0;
+    gIndirectBuffer = 0;
+    gIndirectCapacity = 0;
+}
+
+// Creates and caches all data required to draw a cube
+void UCreateCubeMesh(MeshData& data)
+{
+    // Position and Color data
+    GLfloat verts[] = {
+        //Positions          //Normals
+        // ------------------------------------------------------
+        //Back Face          //Negative Z Normal  Texture Coords.
+        -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+         0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+         0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+         0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+        -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+        -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+        //Front Face         //Positive Z Normal
+        -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+         0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+         0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+         0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+        -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+        -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+        //Left Face          //Negative X Normal
+        -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+        -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+        -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+        -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+        -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+        -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+        //Right Face         //Positive X Normal
+         0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+         0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+         0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+         0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+         0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+         0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+        //Bottom Face        //Negative Y Normal
+        -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+         0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+         0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+         0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+        -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+        -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+        //Top Face           //Positive Y Normal
+        -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+         0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+         0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+         0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+        -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+        -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    };
+
+    // Generated as a plain triangle list, the builder welds it into indexed form
+    const size_t vertexCount = sizeof(verts) / (sizeof(verts[0]) * FLOATS_PER_VERTEX);
+    UBuildMesh("cube", verts, vertexCount, nullptr, 0, data);
+}
+
+// Creates and caches all data required to draw a pyramid
+void UCreatePyramidMesh(MeshData& data)
+{
+    // Vertex data
+    GLfloat verts[] = {
+        //Positions            // Normals          //Texture Coordinates
+        // Front face
+        -0.5f, -0.5f,  0.5f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
+         0.0f,  0.5f,  0.0f,   0.0f, 0.0f, 1.0f,   0.5f, 1.0f,
+         0.5f, -0.5f,  0.5f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,
+
+        // Right face
+         0.5f, -0.5f,  0.5f,   1.0f, 0.0f, 0.0f,   0.0f, 0.0f,
+         0.0f,  0.5f,  0.0f,   1.0f, 0.0f, 0.0f,   0.5f, 1.0f,
+         0.5f, -0.5f, -0.5f,   1.0f, 0.0f, 0.0f,   1.0f, 0.0f,
+
+        // Back face
+         0.5f, -0.5f, -0.5f,   0.0f, 0.0f, -1.f,   1.0f, 0.0f,
+         0.0f,  0.5f,  0.0f,   0.0f, 0.0f, -1.f,   0.5f, 1.0f,
+        -0.5f, -0.5f, -0.5f,   0.0f, 0.0f, -1.f,   0.0f, 0.0f,
+
+        // Left face
+        -0.5f, -0.5f, -0.5f,   -1.f, 0.0f, 0.0f,   1.0f, 0.0f,
+         0.0f,  0.5f,  0.0f,   -1.f, 0.0f, 0.0f,   0.5f, 1.0f,
+        -0.5f, -0.5f,  0.5f,   -1.f, 0.0f, 0.0f,   0.0f, 0.0f,
+
+        // Bottom face
+        -0.5f, -0.5f, -0.5f,   0.0f, -1.f, 0.0f,   0.0f, 1.0f,
+         0.5f, -0.5f, -0.5f,   0.0f, -1.f, 0.0f,   1.0f, 1.0f,
+         0.5f, -0.5f,  0.5f,   0.0f, -1.f, 0.0f,   1.0f, 0.0f,
+         0.5f, -0.5f,  0.5f,   0.0f, -1.f, 0.0f,   1.0f, 0.0f,
+        -0.5f, -0.5f,  0.5f,   0.0f, -1.f, 0.0f,   0.0f, 0.0f,
+        -0.5f, -0.5f, -0.5f,   0.0f, -1.f, 0.0f,   0.0f, 1.0f,
+    };
+
+    // Generated as a plain triangle list, the builder welds it into indexed form
+    const size_t vertexCount = sizeof(verts) / (sizeof(verts[0]) * FLOATS_PER_VERTEX);
+    UBuildMesh("pyramid", verts, vertexCount, nullptr, 0, data);
+}
+
+// Creates and caches all data required to draw a plane
+void UCreatePlaneMesh(MeshData& data)
+{
+    // Vertex data
+    GLfloat verts[] = {
+        // Positions           // Normals          //Texture Coordinates
+        // Front face top tri
+        -0.5f,  0.0f, -0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 0.0f,
+         0.5f,  0.0f,  0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 1.0f,
+        -0.5f,  0.0f,  0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 1.0f,
+
+        // Front face bottom tri
+        -0.5f,  0.0f, -0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 0.0f,
+         0.5f,  0.0f, -0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 0.0f,
          0.5f,  0.0f,  0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 1.0f,
     };
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    // Generated as a plain triangle list, the builder welds it into indexed form
+    const size_t vertexCount = sizeof(verts) / (sizeof(verts[0]) * FLOATS_PER_VERTEX);
+    UBuildMesh("plane", verts, vertexCount, nullptr, 0, data);
+}
+
+// Creates and caches all data required to draw a cylinder
+void UCreateCylinderMesh(MeshData& data, int numSides)
+{
+    const float radius = 0.5f;
+    const float height = 1.0f;
+
+    std::vector<GLfloat> finalData;
+
+    // get unit circle vectors on XY-plane
+    std::vector<GLfloat> unitVertices = getUnitCircleVertices(numSides);
+
+    // put side vertices to arrays
+    for (int i = 0; i < 2; ++i)
+    {
+        GLfloat h = -height / 2.0f + i * height;           // z value; -h/2 to h/2
+        GLfloat t = 1.0f - i;                              // vertical tex coord; 1 to 0
+
+        for (int j = 0, k = 0; j <= numSides; ++j, k += 3)
+        {
+            GLfloat ux = unitVertices[k];
+            GLfloat uy = unitVertices[k + 1];
+            GLfloat uz = unitVertices[k + 2];
+
+            // position vector
+            finalData.push_back(ux * radius);             // vx
+            finalData.push_back(uy * radius);             // vy
+            finalData.push_back(h);                       // vz
+            // normal vector
+            finalData.push_back(ux);                       // nx
+            finalData.push_back(uy);                       // ny
+            finalData.push_back(uz);                       // nz
+            // texture coordinate
+            finalData.push_back((GLfloat)j / numSides);  // s
+            finalData.push_back(t);                      // t
+        }
+    }
+
+    // the starting index for the base/top surface
+    //NOTE: it is used for generating indices later
+    int baseCenterIndex = (int)finalData.size() / 8;
+    int topCenterIndex = baseCenterIndex + numSides + 1; // include center vertex
+
+    // put base and top vertices to arrays
+    for (int i = 0; i < 2; ++i)
+    {
+        GLfloat h = -height / 2.0f + i * height;           // z value; -h/2 to h/2
+        GLfloat nz = -1 + i * 2;                           // z value of normal; -1 to 1
+
+        // center point
+        finalData.push_back(0);     finalData.push_back(0);     finalData.push_back(h);
+        finalData.push_back(0);      finalData.push_back(0);      finalData.push_back(nz);
+        finalData.push_back(0.5f); finalData.push_back(0.5f);
+
+        for (int j = 0, k = 0; j < numSides; ++j, k += 3)
+        {
+            GLfloat ux = unitVertices[k];
+            GLfloat uy = unitVertices[k + 1];
+
+            // position vector
+            finalData.push_back(ux * radius);             // vx
+            finalData.push_back(uy * radius);             // vy
+            finalData.push_back(h);                       // vz
+            // normal vector
+            finalData.push_back(0);                        // nx
+            finalData.push_back(0);                        // ny
+            finalData.push_back(nz);                       // nz
+            // texture coordinate
+            finalData.push_back(-ux * 0.5f + 0.5f);      // s
+            finalData.push_back(-uy * 0.5f + 0.5f);      // t
+        }
+    }
+
+    // Position and Color data
+    const size_t vertsSize = (8 * ((numSides * 2) + 2)) * 2;
+    if (vertsSize != finalData.size()) {
+        cout << "BIG PROBLEM! vertsSize " << vertsSize << " finalData size " << finalData.size() << endl;
+        return;
+    }
+
+    std::vector<GLuint> indices;
+
+    // side quads, two triangles each between the bottom ring k1 and the top ring k2
+    for (int j = 0; j < numSides; ++j)
+    {
+        GLuint k1 = j;
+        GLuint k2 = j + numSides + 1;
+
+        indices.push_back(k1);  indices.push_back(k1 + 1);  indices.push_back(k2);
+        indices.push_back(k2);  indices.push_back(k1 + 1);  indices.push_back(k2 + 1);
+    }
+
+    // base and top fans, wound so both face away from the cylinder
+    for (int j = 0; j < numSides; ++j)
+    {
+        GLuint next = (j + 1) % numSides;
+
+        indices.push_back(baseCenterIndex);
+        indices.push_back(baseCenterIndex + 1 + next);
+        indices.push_back(baseCenterIndex + 1 + j);
+
+        indices.push_back(topCenterIndex);
+        indices.push_back(topCenterIndex + 1 + j);
+        indices.push_back(topCenterIndex + 1 + next);
+    }
+
+    UBuildMesh("cylinder", finalData.data(), finalData.size() / FLOATS_PER_VERTEX, indices.data(), indices.size(), data);
+}
+
+// Welds and reorders a triangle list into data, printing its vertex cache efficiency.
+// indices may be null for unindexed triangle lists.
+void UBuildMesh(const char* name, const GLfloat* verts, size_t vertexCount, const GLuint* indices, size_t indexCount, MeshData& data)
+{
+    data = MeshData();
+    UWeldVertices(verts, vertexCount, indices, indexCount, data);
+
+    size_t uniqueVertices = data.vertices.size() / FLOATS_PER_VERTEX;
+    float acmrBefore = UComputeAcmr(data.indices, uniqueVertices, ACMR_CACHE_SIZE);
+    UOptimizeVertexCache(data);
+    UReorderVertices(data);
+    float acmrAfter = UComputeAcmr(data.indices, uniqueVertices, ACMR_CACHE_SIZE);
+
+    cout << "Mesh builder: " << name << " " << vertexCount << " -> " << data.vertices.size() / FLOATS_PER_VERTEX
+        << " vertices, " << data.indices.size() << " indices, ACMR " << acmrBefore << " -> " << acmrAfter << endl;
+}
+
+// Merges bitwise identical vertices and rewrites the indices to point at the survivors
+void UWeldVertices(const GLfloat* verts, size_t vertexCount, const GLuint* indices, size_t indexCount, MeshData& data)
+{
+    std::unordered_map<VertexKey, GLuint, VertexKeyHash> unique;
+    std::vector<GLuint> remap(vertexCount);
+
+    for (size_t v = 0; v < vertexCount; ++v) {
+        VertexKey key;
+        for (GLuint f = 0; f < FLOATS_PER_VERTEX; ++f)
+            key.values[f] = verts[v * FLOATS_PER_VERTEX + f] + 0.0f; // folds -0 into +0
+
+        auto found = unique.find(key);
+        if (found != unique.end()) {
+            remap[v] = found->second;
+            continue;
+        }
+
+        GLuint newIndex = (GLuint)(data.vertices.size() / FLOATS_PER_VERTEX);
+        unique[key] = newIndex;
+        remap[v] = newIndex;
+        data.vertices.insert(data.vertices.end(), key.values, key.values + FLOATS_PER_VERTEX);
+    }
+
+    if (indices) {
+        data.indices.resize(indexCount);
+        for (size_t i = 0; i < indexCount; ++i)
+            data.indices[i] = remap[indices[i]];
+    }
+    else {
+        data.indices = remap;
+    }
+}
+
+// Forsyth's score for a vertex: recently used vertices are cheap, lonely vertices get
+// a boost so the last triangles around them are not left stranded
+float UForsythVertexScore(int cachePosition, int activeTriangles)
+{
+    if (activeTriangles == 0)
+        return -1.0f;
+
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        if (cachePosition < 3)
+            score = 0.75f;  // Used by the last triangle, deliberately below the next few slots
+        else
+            score = powf(1.0f - (cachePosition - 3) / (float)(FORSYTH_CACHE_SIZE - 3), 1.5f);
+    }
+
+    return score + 2.0f * powf((float)activeTriangles, -0.5f);
+}
+
+// Reorders triangles for post-transform vertex cache hits (Tom Forsyth's linear-speed optimizer)
+void UOptimizeVertexCache(MeshData& data)
+{
+    const size_t triangleCount = data.indices.size() / 3;
+    const size_t vertexCount = data.vertices.size() / FLOATS_PER_VERTEX;
+    if (triangleCount == 0)
+        return;
+
+    // Triangles using each vertex, packed into one array
+    std::vector<int> activeTriangles(vertexCount, 0);
+    for (GLuint index : data.indices)
+        ++activeTriangles[index];
+
+    std::vector<int> firstTriangle(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; ++v)
+        firstTriangle[v + 1] = firstTriangle[v] + activeTriangles[v];
+
+    std::vector<int> vertexTriangles(data.indices.size());
+    std::vector<int> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (size_t t = 0; t < triangleCount; ++t)
+        for (int corner = 0; corner < 3; ++corner)
+            vertexTriangles[fill[data.indices[t * 3 + corner]]++] = (int)t;
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v)
+        vertexScore[v] = UForsythVertexScore(-1, activeTriangles[v]);
+
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<int> cache;
+    std::vector<int> nextCache;
+    std::vector<GLuint> output;
+    output.reserve(data.indices.size());
+    size_t scanCursor = 0;
+
+    auto triangleScore = [&](int t) {
+        return vertexScore[data.indices[t * 3]] + vertexScore[data.indices[t * 3 + 1]] + vertexScore[data.indices[t * 3 + 2]];
+    };
+
+    for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount) {
+        // Best candidate among triangles touching the cache, falling back to the next unused one
+        int best = -1;
+        float bestScore = -1.0f;
+        for (int v : cache) {
+            for (int i = firstTriangle[v]; i < firstTriangle[v] + activeTriangles[v]; ++i) {
+                float score = triangleScore(vertexTriangles[i]);
+                if (score > bestScore) {
+                    bestScore = score;
+                    best = vertexTriangles[i];
+                }
+            }
+        }
+        if (best < 0) {
+            while (emitted[scanCursor])
+                ++scanCursor;
+            best = (int)scanCursor;
+        }
+
+        emitted[best] = true;
+        nextCache.clear();
+        for (int corner = 0; corner < 3; ++corner) {
+            GLuint v = data.indices[best * 3 + corner];
+            output.push_back(v);
+            nextCache.push_back((int)v);
+
+            // Drop the triangle from the vertex's active list
+            int end = firstTriangle[v] + activeTriangles[v];
+            for (int i = firstTriangle[v]; i < end; ++i) {
+                if (vertexTriangles[i] == best) {
+                    std::swap(vertexTriangles[i], vertexTriangles[end - 1]);
+                    break;
+                }
+            }
+            --activeTriangles[v];
+        }
+
+        // The new triangle's vertices move to the front, the oldest fall off the end
+        for (int v : cache)
+            if (std::find(nextCache.begin(), nextCache.begin() + 3, v) == nextCache.begin() + 3)
+                nextCache.push_back(v);
+        for (size_t i = 0; i < nextCache.size(); ++i) {
+            int v = nextCache[i];
+            cachePosition[v] = i < (size_t)FORSYTH_CACHE_SIZE ? (int)i : -1;
+            vertexScore[v] = UForsythVertexScore(cachePosition[v], activeTriangles[v]);
+        }
+        if (nextCache.size() > (size_t)FORSYTH_CACHE_SIZE)
+            nextCache.resize(FORSYTH_CACHE_SIZE);
+        cache.swap(nextCache);
+    }
+
+    data.indices.swap(output);
+}
+
+// Renumbers vertices in order of first use so vertex fetches walk the buffer forwards
+void UReorderVertices(MeshData& data)
+{
+    const size_t vertexCount = data.vertices.size() / FLOATS_PER_VERTEX;
+    std::vector<GLuint> remap(vertexCount, (GLuint)-1);
+    std::vector<GLfloat> vertices;
+    vertices.reserve(data.vertices.size());
+
+    for (GLuint& index : data.indices) {
+        if (remap[index] == (GLuint)-1) {
+            remap[index] = (GLuint)(vertices.size() / FLOATS_PER_VERTEX);
+            vertices.insert(vertices.end(), data.vertices.begin() + index * FLOATS_PER_VERTEX,
+                data.vertices.begin() + (index + 1) * FLOATS_PER_VERTEX);
+        }
+        index = remap[index];
+    }
+
+    // Vertices no triangle references are dropped
+    data.vertices.swap(vertices);
+}
+
+// Average vertex shader invocations per triangle through a FIFO post-transform cache
+float UComputeAcmr(const std::vector<GLuint>& indices, size_t vertexCount, int cacheSize)
+{
+    if (indices.empty())
+        return 0.0f;
+
+    // A vertex is still cached while fewer than cacheSize misses happened since it was loaded
+    std::vector<int> loadedAt(vertexCount, -cacheSize - 1);
+    int misses = 0;
+    for (GLuint index : indices) {
+        if (misses - loadedAt[index] > cacheSize) {
+            loadedAt[index] = misses;
+            ++misses;
+        }
+    }
+
+    return misses / (indices.size() / 3.0f);
+}
+
+// Creates the VAO, vertex and element buffers for built mesh data
+void UUploadMesh(const MeshData& data, GLMesh& mesh)
+{
+    // Halve the element buffer whenever every index fits in 16 bits
+    std::vector<unsigned char> indexBytes;
+    MeshGeometry geometry;
+    geometry.vertices = data.vertices.data();
+    geometry.vertexCount = (GLuint)(data.vertices.size() / FLOATS_PER_VERTEX);
+    geometry.indexType = UPackIndices(data.indices, indexBytes);
+    geometry.indices = indexBytes.data();
+    geometry.indexCount = (GLuint)data.indices.size();
+    UUploadMeshGeometry(geometry, mesh);
+}
+
+// Creates the VAO, vertex and element buffers for geometry whose indices are already in
+// their final type
+void UUploadMeshGeometry(const MeshGeometry& geometry, GLMesh& mesh)
+{
+    mesh.nVertices = geometry.vertexCount;
+    mesh.nIndices = geometry.indexCount;
+    mesh.indexType = geometry.indexType;
+
+    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
+    glBindVertexArray(mesh.vao);
+
+    // Quantized vertices are stored against the mesh's own bounds box
+    const void* vertexData = geometry.vertices;
+    std::vector<QuantizedVertex> quantized;
+    if (gQuantizedVertices) {
+        if (!geometry.quantized)
+            UQuantizeVertices(geometry, UComputeMeshBounds(geometry), quantized);
+        vertexData = geometry.quantized ? geometry.quantized : quantized.data();
+    }
+
+    // Create VBO
+    const GLsizeiptr vertsBytes = (GLsizeiptr)geometry.vertexCount * UVertexStride();
+    glGenBuffers(1, &mesh.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
+    glBufferData(GL_ARRAY_BUFFER, vertsBytes, vertexData, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+
+    // Create EBO
+    const GLsizeiptr indexBytes = (GLsizeiptr)geometry.indexCount * (geometry.indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+    glGenBuffers(1, &mesh.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, geometry.indices, GL_STATIC_DRAW);
+    mesh.bufferBytes = vertsBytes + indexBytes;
+
+    if (gQuantizedVertices) {
+        const GLsizei quantizedStride = sizeof(QuantizedVertex);
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, quantizedStride, (void*)offsetof(QuantizedVertex, position));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, quantizedStride, (void*)offsetof(QuantizedVertex, normal));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, quantizedStride, (void*)offsetof(QuantizedVertex, uv));
+        glEnableVertexAttribArray(2);
+        return;
+    }
+
+    const GLuint floatsPerVertex = 3;
+    const GLuint floatsPerNormal = 3;
+    const GLuint floatsPerUV = 2;
+
+    GLint stride = sizeof(float) * FLOATS_PER_VERTEX;
+
+    // Create Vertex Attribute Pointers
+    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+    glEnableVertexAttribArray(2);
+}
+
+// Bytes one vertex takes in the current vertex format
+GLsizei UVertexStride()
+{
+    return gQuantizedVertices ? sizeof(QuantizedVertex) : FLOATS_PER_VERTEX * sizeof(GLfloat);
+}
+
+// Appends geometry's vertices in quantized form, positions measured across bounds' box
+void UQuantizeVertices(const MeshGeometry& geometry, const MeshBounds& bounds, std::vector<QuantizedVertex>& out)
+{
+    const glm::vec3 offset = bounds.center - bounds.extent;
+    const glm::vec3 scale = bounds.extent * 2.0f;
+    for (GLuint i = 0; i < geometry.vertexCount; ++i) {
+        const GLfloat* vertex = geometry.vertices + i * FLOATS_PER_VERTEX;
+        QuantizedVertex quantized;
+        for (int axis = 0; axis < 3; ++axis) {
+            // Flat axes, like the plane's height, decode to the offset alone
+            float unit = scale[axis] > 0.0f ? (vertex[axis] - offset[axis]) / scale[axis] : 0.0f;
+            quantized.position[axis] = (GLushort)(std::max(0.0f, std::min(1.0f, unit)) * 65535.0f + 0.5f);
+        }
+        quantized.position[3] = 0;
+        quantized.normal = UPackNormal(vertex + 3);
+        quantized.uv[0] = UFloatToHalf(vertex[6]);
+        quantized.uv[1] = UFloatToHalf(vertex[7]);
+        out.push_back(quantized);
+    }
+}
+
+// IEEE half float bits for value, rounded to nearest
+GLushort UFloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    // Too big for a half (or not a number) saturates to infinity
+    if (exponent >= 31)
+        return (GLushort)(sign | 0x7C00);
+
+    // Too small for a normal half becomes a denormal, then zero
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return (GLushort)sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1)
+            ++half;
+        return (GLushort)(sign | half);
+    }
+
+    // A carry out of the mantissa correctly bumps the exponent
+    uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000)
+        ++half;
+    return (GLushort)half;
+}
+
+// Packs a unit normal into signed 10-bit x, y and z, laid out for GL_INT_2_10_10_10_REV
+GLuint UPackNormal(const GLfloat* normal)
+{
+    GLuint packed = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        int value = (int)roundf(std::max(-1.0f, std::min(1.0f, normal[axis])) * 511.0f);
+        packed |= ((GLuint)value & 0x3FF) << (10 * axis);
+    }
+    return packed;
+}
+
+// Uploads every registry mesh again in the quantized or float vertex format. The arena, the
+// instanced batches and the GPU culling buffers see the new generation and rebuild themselves
+void USetVertexFormat(bool quantized)
+{
+    gQuantizedVertices = quantized;
+    for (MeshEntry& entry : gMeshRegistry.entries) {
+        if (entry.refCount <= 0)
+            continue;
+        gMeshRegistry.bytesResident -= entry.mesh.bufferBytes;
+        UDestroyMesh(entry.mesh);
+        UUploadMeshGeometry(UGetMeshGeometry(entry), entry.mesh);
+        USetupInstanceAttributes(entry.mesh);
+        gMeshRegistry.bytesResident += entry.mesh.bufferBytes;
+    }
+    ++gMeshRegistry.generation;
+
+    // Draw records hold the model matrices the format change just altered
+    gGpuCull.recordsCurrent = false;
+}
+
+// Prints the vertex bytes the meshes hold and last frame fetched, in both formats
+void UPrintVertexFormatStats()
+{
+    size_t residentVertices = 0;
+    for (const MeshEntry& entry : gMeshRegistry.entries)
+        if (entry.refCount > 0)
+            residentVertices += entry.mesh.nVertices;
+
+    // Every draw reads each of its mesh's vertices at least once
+    size_t drawnVertices = 0;
+    for (const RenderItem& item : gRenderQueue.items)
+        drawnVertices += UGetMesh(sceneObjects[item.objectIndex].mesh).nVertices;
+
+    const size_t floatStride = FLOATS_PER_VERTEX * sizeof(GLfloat);
+    const size_t quantizedStride = sizeof(QuantizedVertex);
+    cout << "Vertex format " << (gQuantizedVertices ? "quantized" : "float") << ": " << quantizedStride << " bytes per vertex quantized, "
+        << floatStride << " as floats. Meshes hold " << residentVertices << " vertices, " << residentVertices * quantizedStride
+        << " bytes quantized against " << residentVertices * floatStride << ".";
+
+    // The GPU culling path never builds the queue
+    if (!gGpuCulling)
+        cout << " Last frame fetched at least " << drawnVertices << " vertices, " << drawnVertices * quantizedStride / 1024.0
+            << " KiB quantized against " << drawnVertices * floatStride / 1024.0 << " KiB";
+    cout << endl;
+}
+
+// Free the memory used by our mesh VAO and VBOs
+void UDestroyMesh(GLMesh& mesh)
+{
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(1, &mesh.vbo);
+    glDeleteBuffers(1, &mesh.ebo);
+}
+
+// Builds the texture array and starts loading each basic texture in the project into its
+// layer. Layers hold a placeholder until UPumpTextureUploads swaps the real image in
+void ULoadTextureSet() {
+    TextureLoader& loader = gTextureLoader;
+    loader.startTime = std::chrono::steady_clock::now();
+
+    // Every layer shares one format, so it has to be picked before any image is decoded.
+    // A cooked pack already made that choice
+    if (gAssetPack.header)
+        gTextureFormat = (GLenum)gAssetPack.header->textureFormat;
+    else
+        gTextureFormat = UChooseTextureFormat();
+    if (gTextureFormat != GL_RGBA8 && !gAssetPack.header)
+        U_MKDIR(TEXTURE_CACHE_DIR);
+
+    glGenTextures(1, &gTextureArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gTextureArray);
+
+    // Immutable storage for the full mip chain of every layer
+    gTextureMipLevels = UMipLevelCount(TEXTURE_ARRAY_SIZE);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, gTextureMipLevels, gTextureFormat, TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE, TEXTURE_LAYER_COUNT);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // The pack holds every finished mip chain, nothing to decode or stream in
+    if (gAssetPack.header)
+    {
+        UUploadPackedTextures();
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        return;
+    }
+
+    if (gTextureFormat == GL_RGBA8)
+    {
+        for (int level = 0; level < gTextureMipLevels; ++level)
+            glClearTexImage(gTextureArray, level, GL_RGBA, GL_UNSIGNED_BYTE, TEXTURE_PLACEHOLDER_COLOR);
+    }
+    else
+    {
+        // Compressed textures can't be cleared, so tile one encoded placeholder block instead
+        unsigned char pixels[64];
+        for (int i = 0; i < 16; ++i)
+            memcpy(pixels + i * 4, TEXTURE_PLACEHOLDER_COLOR, 4);
+        unsigned char block[16];
+        UCompressImage(pixels, 4, gTextureFormat, block);
+
+        const size_t blockBytes = gTextureFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16;
+        for (int level = 0, size = TEXTURE_ARRAY_SIZE; level < gTextureMipLevels; ++level, size = std::max(size / 2, 1))
+        {
+            GLsizei levelBytes = UTextureLevelBytes(gTextureFormat, size);
+            std::vector<unsigned char> placeholder(levelBytes * TEXTURE_LAYER_COUNT);
+            for (size_t offset = 0; offset < placeholder.size(); offset += blockBytes)
+                memcpy(placeholder.data() + offset, block, blockBytes);
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, 0, size, size, TEXTURE_LAYER_COUNT,
+                gTextureFormat, (GLsizei)placeholder.size(), placeholder.data());
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    glGenBuffers(2, loader.pbos);
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    loader.loads.resize(TEXTURE_LAYER_COUNT);
+    loader.pending = TEXTURE_LAYER_COUNT;
+    for (int layer = 0; layer < TEXTURE_LAYER_COUNT; ++layer)
+    {
+        loader.loads[layer].layer = layer;
+        loader.loads[layer].filename = TEXTURE_FILES[layer];
+    }
 
-    // Create VBO
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    for (int layer = 0; layer < TEXTURE_LAYER_COUNT; ++layer)
+    {
+        if (gSerialTextureLoading)
+        {
+            UDecodeTextureLayer(loader.loads[layer]);
+            loader.finished.push_back(layer);
+            continue;
+        }
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+        // loads is never resized while jobs run, so workers can hold on to their element
+        USubmitJob([layer]() {
+            UDecodeTextureLayer(gTextureLoader.loads[layer]);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+            std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+            gTextureLoader.finished.push_back(layer);
+            gTextureLoader.finishedChanged.notify_all();
+        });
+    }
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    // The serial path has everything decoded already
+    if (gSerialTextureLoading)
+        UPumpTextureUploads(true);
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+// Picks the array format: BC1 unless some image carries alpha, which needs BC3. BC7 on
+// request, and plain RGBA8 when compression is off
+GLenum UChooseTextureFormat()
+{
+    if (!gCompressTextures)
+        return GL_RGBA8;
+    if (gBc7Textures)
+        return GL_COMPRESSED_RGBA_BPTC_UNORM;
+
+    // stbi_info only parses the header
+    for (int layer = 0; layer < TEXTURE_LAYER_COUNT; ++layer)
+    {
+        int width, height, channels;
+        if (stbi_info(TEXTURE_FILES[layer], &width, &height, &channels) && (channels == 2 || channels == 4))
+            return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    }
+    return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
 }
 
-// Creates and caches all data required to draw a cylinder
-void UCreateCylinderMesh(GLMesh& mesh)
+// Loads one image into load: straight from the compressed cache when it is current, else
+// decoded, flipped and resized, then compressed and written back to the cache.
+// Runs on a worker thread
+void UDecodeTextureLayer(TextureLoad& load)
 {
-    // Number of sides in the cylinder
-    const int numSides = 16;
+    auto start = std::chrono::steady_clock::now();
 
-    const float radius = 0.5f;
-    const float height = 1.0f;
+    std::vector<unsigned char> source;
+    std::ifstream file(load.filename, std::ios::binary);
+    if (file)
+        source.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
 
-    std::vector<GLfloat> finalData;
+    const bool compressed = gTextureFormat != GL_RGBA8;
+    const uint64_t sourceHash = UHashBytes(source.data(), source.size());
+    const std::string cachePath = UTextureCachePath(load.filename);
+    if (compressed && !source.empty() && UReadTextureCache(cachePath, sourceHash, load))
+    {
+        load.loaded = true;
+        load.cacheHit = true;
+        load.decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return;
+    }
 
-    // get unit circle vectors on XY-plane
-    std::vector<GLfloat> unitVertices = getUnitCircleVertices(numSides);
+    // Layers share one format, so stb expands everything to RGBA
+    int width, height, channels;
+    unsigned char* image = source.empty() ? nullptr
+        : stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 4);
+    load.loaded = image != nullptr;
+    if (image)
+    {
+        flipImageVertically(image, width, height, 4);
 
-    // put side vertices to arrays
-    for (int i = 0; i < 2; ++i)
+        load.pixels.resize(TEXTURE_ARRAY_SIZE * TEXTURE_ARRAY_SIZE * 4);
+        if (width == TEXTURE_ARRAY_SIZE && height == TEXTURE_ARRAY_SIZE)
+            memcpy(load.pixels.data(), image, load.pixels.size());
+        else
+            UResampleImage(image, width, height, 4, load.pixels.data(), TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE);
+
+        stbi_image_free(image);
+    }
+
+    if (image && compressed)
     {
-        GLfloat h = -height / 2.0f + i * height;           // z value; -h/2 to h/2
-        GLfloat t = 1.0f - i;                              // vertical tex coord; 1 to 0
+        // Mips are built on the CPU since compressed levels can't be generated by GL
+        std::vector<std::vector<unsigned char>> mips;
+        UBuildMipChain(load.pixels, TEXTURE_ARRAY_SIZE, gTextureMipLevels, mips);
 
-        for (int j = 0, k = 0; j <= numSides; ++j, k += 3)
+        load.levels.resize(mips.size());
+        for (size_t level = 0, size = TEXTURE_ARRAY_SIZE; level < mips.size(); ++level, size = std::max<size_t>(size / 2, 1))
         {
-            GLfloat ux = unitVertices[k];
-            GLfloat uy = unitVertices[k + 1];
-            GLfloat uz = unitVertices[k + 2];
+            load.levels[level].resize(UTextureLevelBytes(gTextureFormat, (int)size));
+            UCompressImage(mips[level].data(), (int)size, gTextureFormat, load.levels[level].data());
+        }
+        load.pixels = std::vector<unsigned char>();
 
-            // position vector
-            finalData.push_back(ux * radius);             // vx
-            finalData.push_back(uy * radius);             // vy
-            finalData.push_back(h);                       // vz
-            // normal vector
-            finalData.push_back(ux);                       // nx
-            finalData.push_back(uy);                       // ny
-            finalData.push_back(uz);                       // nz
-            // texture coordinate
-            finalData.push_back((GLfloat)j / numSides);  // s
-            finalData.push_back(t);                      // t
+        if (!UWriteTextureCache(cachePath, sourceHash, load))
+            load.cacheWriteFailed = true;
+    }
+
+    load.decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Copies a loaded image into its texture array layer through a pixel buffer object.
+// Layers that failed to load keep the placeholder
+void UUploadTextureLayer(TextureLoad& load)
+{
+    auto start = std::chrono::steady_clock::now();
+    TextureLoader& loader = gTextureLoader;
+
+    if (!load.loaded)
+    {
+        cout << "Failed to load texture " << load.filename << endl;
+        return;
+    }
+    if (load.cacheWriteFailed)
+        cout << "Failed to write texture cache for " << load.filename << endl;
+
+    // Alternate buffers so this copy never waits on the previous layer's transfer
+    GLuint pbo = loader.pbos[loader.nextPbo];
+    loader.nextPbo ^= 1;
+
+    // Compressed layers upload their whole mip chain, uncompressed ones just the base level
+    GLsizeiptr bytes = (GLsizeiptr)load.pixels.size();
+    for (const std::vector<unsigned char>& level : load.levels)
+        bytes += (GLsizeiptr)level.size();
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+    unsigned char* mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (mapped)
+    {
+        size_t offset = 0;
+        if (!load.pixels.empty())
+        {
+            memcpy(mapped, load.pixels.data(), load.pixels.size());
+            offset = load.pixels.size();
+        }
+        for (const std::vector<unsigned char>& level : load.levels)
+        {
+            memcpy(mapped + offset, level.data(), level.size());
+            offset += level.size();
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // With an unpack buffer bound the data pointer is an offset into it
+        if (load.levels.empty())
+        {
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, load.layer, TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE, 1,
+                GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
         }
+        else
+        {
+            offset = 0;
+            for (size_t level = 0, size = TEXTURE_ARRAY_SIZE; level < load.levels.size(); ++level, size = std::max<size_t>(size / 2, 1))
+            {
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, (GLint)level, 0, 0, load.layer, (GLsizei)size, (GLsizei)size, 1,
+                    gTextureFormat, (GLsizei)load.levels[level].size(), (void*)offset);
+                offset += load.levels[level].size();
+            }
+        }
+    }
+    else
+    {
+        cout << "Failed to map upload buffer for " << load.filename << endl;
     }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-    // the starting index for the base/top surface
-    //NOTE: it is used for generating indices later
-    int baseCenterIndex = (int)(numSides * 2) / 3;
-    int topCenterIndex = baseCenterIndex + numSides + 1; // include center vertex
+    load.pixels = std::vector<unsigned char>();
+    load.levels = std::vector<std::vector<unsigned char>>();
+    loader.uploadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-    // put base and top vertices to arrays
-    for (int i = 0; i < 2; ++i)
+// Uploads every texture the workers have finished and rebuilds the mip chain. With wait
+// set, blocks until every layer is in. Prints the load timings once the last one lands
+void UPumpTextureUploads(bool wait)
+{
+    TextureLoader& loader = gTextureLoader;
+    while (loader.pending > 0)
     {
-        GLfloat h = -height / 2.0f + i * height;           // z value; -h/2 to h/2
-        GLfloat nz = -1 + i * 2;                           // z value of normal; -1 to 1
+        std::vector<int> ready;
+        {
+            std::unique_lock<std::mutex> lock(loader.mutex);
+            if (wait)
+                loader.finishedChanged.wait(lock, [&loader]() { return !loader.finished.empty(); });
+            ready.swap(loader.finished);
+        }
+        if (ready.empty())
+            return;
+
+        glBindTexture(GL_TEXTURE_2D_ARRAY, gTextureArray);
+        for (int index : ready)
+            UUploadTextureLayer(loader.loads[index]);
+        if (gTextureFormat == GL_RGBA8)
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        loader.pending -= (int)ready.size();
+        if (!wait)
+            break;
+    }
 
-        // center point
-        finalData.push_back(0);     finalData.push_back(0);     finalData.push_back(h);
-        finalData.push_back(0);      finalData.push_back(0);      finalData.push_back(nz);
-        finalData.push_back(0.5f); finalData.push_back(0.5f);
+    if (loader.pending > 0 || loader.loads.empty())
+        return;
 
-        for (int j = 0, k = 0; j < numSides; ++j, k += 3)
+    // Summed decode time is what the serial path spends decoding, wall time is what we waited
+    double decodeMs = 0.0;
+    int cacheHits = 0;
+    for (const TextureLoad& load : loader.loads)
+    {
+        decodeMs += load.decodeMs;
+        if (load.cacheHit)
+            ++cacheHits;
+    }
+    double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loader.startTime).count();
+
+    size_t residentBytes = UTextureChainBytes(gTextureFormat) * TEXTURE_LAYER_COUNT;
+
+    cout << "Textures: " << loader.loads.size() << " layers in " << wallMs << " ms, ";
+    if (gSerialTextureLoading)
+        cout << "serial";
+    else
+        cout << "parallel on " << gThreadPool.workers.size() << " workers";
+    cout << " (decode " << decodeMs << " ms summed, upload " << loader.uploadMs << " ms)" << endl;
+    cout << "Textures: " << UTextureFormatName(gTextureFormat) << ", " << residentBytes / 1024 << " KiB resident";
+    if (gTextureFormat != GL_RGBA8)
+        cout << " (RGBA8 would be " << UTextureChainBytes(GL_RGBA8) * TEXTURE_LAYER_COUNT / 1024 << " KiB), "
+            << cacheHits << " of " << loader.loads.size() << " layers from cache";
+    cout << endl;
+
+    glDeleteBuffers(2, loader.pbos);
+    loader.pbos[0] = loader.pbos[1] = 0;
+    loader.loads.clear();
+}
+
+// Starts threadCount workers that run submitted jobs in order
+void UStartThreadPool(int threadCount)
+{
+    gThreadPool.stopping = false;
+    for (int i = 0; i < threadCount; ++i)
+    {
+        gThreadPool.workers.emplace_back([]() {
+            for (;;)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(gThreadPool.mutex);
+                    gThreadPool.jobAvailable.wait(lock, []() { return gThreadPool.stopping || !gThreadPool.jobs.empty(); });
+                    if (gThreadPool.jobs.empty())
+                        return;     // Only exit once the queue has drained
+                    job = std::move(gThreadPool.jobs.front());
+                    gThreadPool.jobs.pop_front();
+                }
+                job();
+            }
+        });
+    }
+}
+
+// Queues a job for the next free worker
+void USubmitJob(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(gThreadPool.mutex);
+        gThreadPool.jobs.push_back(std::move(job));
+    }
+    gThreadPool.jobAvailable.notify_one();
+}
+
+// Runs job(0) to job(jobCount - 1) on the pool and waits for all of them
+void UParallelFor(int jobCount, const std::function<void(int)>& job)
+{
+    if (gThreadPool.workers.empty())
+    {
+        for (int i = 0; i < jobCount; ++i)
+            job(i);
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    int remaining = jobCount;
+    for (int i = 0; i < jobCount; ++i)
+    {
+        USubmitJob([&job, &mutex, &finished, &remaining, i]() {
+            job(i);
+            // Notify under the lock so the waiter can't return and destroy it first
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--remaining == 0)
+                finished.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&remaining]() { return remaining == 0; });
+}
+
+// Finishes every queued job and joins the workers
+void UStopThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(gThreadPool.mutex);
+        gThreadPool.stopping = true;
+    }
+    gThreadPool.jobAvailable.notify_all();
+    for (std::thread& worker : gThreadPool.workers)
+        worker.join();
+    gThreadPool.workers.clear();
+}
+
+// Bilinear resample of a tightly packed 8-bit image, wrapping at the edges like GL_REPEAT
+// so tiling textures stay seamless
+void UResampleImage(const unsigned char* source, int sourceWidth, int sourceHeight, int channels,
+    unsigned char* destination, int destinationWidth, int destinationHeight)
+{
+    for (int y = 0; y < destinationHeight; ++y)
+    {
+        // Sample at texel centers
+        float sy = (y + 0.5f) * sourceHeight / destinationHeight - 0.5f;
+        int y0 = (int)floorf(sy);
+        float fy = sy - y0;
+        int row0 = ((y0 % sourceHeight) + sourceHeight) % sourceHeight;
+        int row1 = (row0 + 1) % sourceHeight;
+
+        for (int x = 0; x < destinationWidth; ++x)
         {
-            GLfloat ux = unitVertices[k];
-            GLfloat uy = unitVertices[k + 1];
+            float sx = (x + 0.5f) * sourceWidth / destinationWidth - 0.5f;
+            int x0 = (int)floorf(sx);
+            float fx = sx - x0;
+            int col0 = ((x0 % sourceWidth) + sourceWidth) % sourceWidth;
+            int col1 = (col0 + 1) % sourceWidth;
+
+            const unsigned char* p00 = source + (row0 * sourceWidth + col0) * channels;
+            const unsigned char* p01 = source + (row0 * sourceWidth + col1) * channels;
+            const unsigned char* p10 = source + (row1 * sourceWidth + col0) * channels;
+            const unsigned char* p11 = source + (row1 * sourceWidth + col1) * channels;
+            unsigned char* out = destination + (y * destinationWidth + x) * channels;
+
+            for (int c = 0; c < channels; ++c)
+            {
+                float top = p00[c] + (p01[c] - p00[c]) * fx;
+                float bottom = p10[c] + (p11[c] - p10[c]) * fx;
+                out[c] = (unsigned char)(top + (bottom - top) * fy + 0.5f);
+            }
+        }
+    }
+}
 
-            // position vector
-            finalData.push_back(ux * radius);             // vx
-            finalData.push_back(uy * radius);             // vy
-            finalData.push_back(h);                       // vz
-            // normal vector
-            finalData.push_back(0);                        // nx
-            finalData.push_back(0);                        // ny
-            finalData.push_back(nz);                       // nz
-            // texture coordinate
-            finalData.push_back(-ux * 0.5f + 0.5f);      // s
-            finalData.push_back(-uy * 0.5f + 0.5f);      // t
+// Box filters an RGBA image down to levels mips, level 0 being the image itself
+void UBuildMipChain(const std::vector<unsigned char>& image, int size, int levels, std::vector<std::vector<unsigned char>>& mips)
+{
+    mips.resize(levels);
+    mips[0] = image;
+    for (int level = 1; level < levels; ++level)
+    {
+        const std::vector<unsigned char>& parent = mips[level - 1];
+        int parentSize = size;
+        size = std::max(size / 2, 1);
+        mips[level].resize((size_t)size * size * 4);
+
+        for (int y = 0; y < size; ++y)
+        {
+            int y0 = std::min(y * 2, parentSize - 1), y1 = std::min(y * 2 + 1, parentSize - 1);
+            for (int x = 0; x < size; ++x)
+            {
+                int x0 = std::min(x * 2, parentSize - 1), x1 = std::min(x * 2 + 1, parentSize - 1);
+                for (int c = 0; c < 4; ++c)
+                {
+                    int sum = parent[(y0 * parentSize + x0) * 4 + c] + parent[(y0 * parentSize + x1) * 4 + c]
+                        + parent[(y1 * parentSize + x0) * 4 + c] + parent[(y1 * parentSize + x1) * 4 + c];
+                    mips[level][(y * size + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
         }
     }
+}
 
-    // Position and Color data
-    const int vertsSize = (8 * ((numSides * 2) + 2)) * 2;
-    if (vertsSize != finalData.size()) {
-        cout << "BIG PROBLEM! vertsSize " << vertsSize << " finalData size " << finalData.size() << endl;
-        return;
+// Number of levels in a full mip chain of a size x size image
+int UMipLevelCount(int size)
+{
+    int levels = 1;
+    for (; size > 1; size /= 2)
+        ++levels;
+    return levels;
+}
+
+// Bytes one mip level of a size x size image takes in format
+GLsizei UTextureLevelBytes(GLenum format, int size)
+{
+    if (format == GL_RGBA8)
+        return size * size * 4;
+
+    // Block formats store 4x4 texel blocks, partial blocks at the edges still take a whole one
+    int blocks = (size + 3) / 4;
+    return blocks * blocks * (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16);
+}
+
+// Bytes one texture array layer takes with its full mip chain
+size_t UTextureChainBytes(GLenum format)
+{
+    size_t bytes = 0;
+    for (int size = TEXTURE_ARRAY_SIZE; ; size /= 2)
+    {
+        bytes += UTextureLevelBytes(format, size);
+        if (size == 1)
+            break;
     }
+    return bytes;
+}
 
-    GLfloat verts[vertsSize];
+const char* UTextureFormatName(GLenum format)
+{
+    switch (format) {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        return "BC1";
+    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+        return "BC3";
+    case GL_COMPRESSED_RGBA_BPTC_UNORM:
+        return "BC7";
+    }
+    return "RGBA8";
+}
 
-    for (size_t i = 0; i < finalData.size(); i++) {
-        verts[i] = finalData[i];
+// Encodes a size x size RGBA image into 4x4 blocks of format. Edge blocks of mips smaller
+// than a block repeat their last row and column
+void UCompressImage(const unsigned char* image, int size, GLenum format, unsigned char* out)
+{
+    const int blocks = (size + 3) / 4;
+    unsigned char texels[64];
+    for (int by = 0; by < blocks; ++by)
+    {
+        for (int bx = 0; bx < blocks; ++bx)
+        {
+            for (int y = 0; y < 4; ++y)
+            {
+                for (int x = 0; x < 4; ++x)
+                {
+                    int sx = std::min(bx * 4 + x, size - 1);
+                    int sy = std::min(by * 4 + y, size - 1);
+                    memcpy(texels + (y * 4 + x) * 4, image + (sy * size + sx) * 4, 4);
+                }
+            }
+
+            switch (format) {
+            case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+                UEncodeBc1Block(texels, out);
+                out += 8;
+                break;
+            case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+                UEncodeBc4AlphaBlock(texels, out);
+                UEncodeBc1Block(texels, out + 8);
+                out += 16;
+                break;
+            default:
+                UEncodeBc7Block(texels, out);
+                out += 16;
+                break;
+            }
+        }
     }
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+// Fits a line through a block's texels along their principal axis and returns the extreme
+// points on it, clamped to the byte range. channels is 3 for RGB, 4 for RGBA
+void UFitBlockEndpoints(const unsigned char texels[64], int channels, float low[4], float high[4])
+{
+    float mean[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < channels; ++c)
+            mean[c] += texels[i * 4 + c] / 16.0f;
+
+    float covariance[4][4] = {};
+    for (int i = 0; i < 16; ++i)
+        for (int a = 0; a < channels; ++a)
+            for (int b = 0; b < channels; ++b)
+                covariance[a][b] += (texels[i * 4 + a] - mean[a]) * (texels[i * 4 + b] - mean[b]);
+
+    // A few rounds of power iteration are plenty for a 4x4 block
+    float axis[4] = { 1, 1, 1, 1 };
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        float next[4] = { 0, 0, 0, 0 };
+        float length = 0.0f;
+        for (int a = 0; a < channels; ++a)
+        {
+            for (int b = 0; b < channels; ++b)
+                next[a] += covariance[a][b] * axis[b];
+            length += next[a] * next[a];
+        }
+        if (length < 1e-8f)
+            break;  // Flat block, any axis will do
+        length = sqrtf(length);
+        for (int c = 0; c < channels; ++c)
+            axis[c] = next[c] / length;
+    }
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    float minT = 0.0f, maxT = 0.0f;
+    for (int i = 0; i < 16; ++i)
+    {
+        float t = 0.0f;
+        for (int c = 0; c < channels; ++c)
+            t += (texels[i * 4 + c] - mean[c]) * axis[c];
+        minT = std::min(minT, t);
+        maxT = std::max(maxT, t);
+    }
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    for (int c = 0; c < 4; ++c)
+    {
+        low[c] = c < channels ? glm::clamp(mean[c] + axis[c] * minT, 0.0f, 255.0f) : 255.0f;
+        high[c] = c < channels ? glm::clamp(mean[c] + axis[c] * maxT, 0.0f, 255.0f) : 255.0f;
+    }
+}
 
-    // Create VBO
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// BC1: two RGB565 endpoints and a 2-bit index per texel. Always uses the four color mode,
+// so the same block is valid as the color half of BC3
+void UEncodeBc1Block(const unsigned char texels[64], unsigned char out[8])
+{
+    float low[4], high[4];
+    UFitBlockEndpoints(texels, 3, low, high);
+
+    auto pack565 = [](const float color[4]) {
+        return (uint16_t)(((int)(color[0] * 31.0f / 255.0f + 0.5f) << 11)
+            | ((int)(color[1] * 63.0f / 255.0f + 0.5f) << 5)
+            | (int)(color[2] * 31.0f / 255.0f + 0.5f));
+    };
+    uint16_t color0 = pack565(high);
+    uint16_t color1 = pack565(low);
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        // Decode the endpoints exactly like the hardware before choosing indices
+        int palette[4][3];
+        const uint16_t endpoints[2] = { color0, color1 };
+        for (int e = 0; e < 2; ++e)
+        {
+            int r = endpoints[e] >> 11, g = (endpoints[e] >> 5) & 63, b = endpoints[e] & 31;
+            palette[e][0] = (r << 3) | (r >> 2);
+            palette[e][1] = (g << 2) | (g >> 4);
+            palette[e][2] = (b << 3) | (b >> 2);
+        }
+        for (int c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestError = INT32_MAX;
+            for (int p = 0; p < 4; ++p)
+            {
+                int error = 0;
+                for (int c = 0; c < 3; ++c)
+                {
+                    int d = texels[i * 4 + c] - palette[p][c];
+                    error += d * d;
+                }
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = p;
+                }
+            }
+            indices |= (uint32_t)best << (i * 2);
+        }
+    }
+
+    out[0] = color0 & 0xFF;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xFF;
+    out[3] = color1 >> 8;
+    for (int b = 0; b < 4; ++b)
+        out[4 + b] = (indices >> (b * 8)) & 0xFF;
+}
+
+// BC3 alpha half (same as BC4): two 8-bit endpoints and a 3-bit index per texel
+void UEncodeBc4AlphaBlock(const unsigned char texels[64], unsigned char out[8])
+{
+    int alpha0 = 0, alpha1 = 255;
+    for (int i = 0; i < 16; ++i)
+    {
+        alpha0 = std::max(alpha0, (int)texels[i * 4 + 3]);
+        alpha1 = std::min(alpha1, (int)texels[i * 4 + 3]);
+    }
+
+    // With alpha0 > alpha1 codes 2 to 7 interpolate six steps between the endpoints
+    int palette[8] = { alpha0, alpha1 };
+    for (int code = 2; code < 8; ++code)
+        palette[code] = ((8 - code) * alpha0 + (code - 1) * alpha1) / 7;
+
+    uint64_t indices = 0;
+    if (alpha0 != alpha1)
+    {
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0;
+            for (int code = 1; code < 8; ++code)
+                if (abs(texels[i * 4 + 3] - palette[code]) < abs(texels[i * 4 + 3] - palette[best]))
+                    best = code;
+            indices |= (uint64_t)best << (i * 3);
+        }
+    }
+
+    out[0] = (unsigned char)alpha0;
+    out[1] = (unsigned char)alpha1;
+    for (int b = 0; b < 6; ++b)
+        out[2 + b] = (indices >> (b * 8)) & 0xFF;
+}
+
+// BC7 mode 6: one subset, RGBA endpoints of 7 bits plus a shared low bit each, and a
+// 4-bit index per texel
+void UEncodeBc7Block(const unsigned char texels[64], unsigned char out[16])
+{
+    static const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+    float fitted[2][4];
+    UFitBlockEndpoints(texels, 4, fitted[0], fitted[1]);
+
+    // Quantize each endpoint with whichever p-bit lands closer
+    int quantized[2][4], pBits[2], decoded[2][4];
+    for (int e = 0; e < 2; ++e)
+    {
+        float bestError = 1e30f;
+        for (int p = 0; p < 2; ++p)
+        {
+            int candidate[4];
+            float error = 0.0f;
+            for (int c = 0; c < 4; ++c)
+            {
+                candidate[c] = glm::clamp((int)((fitted[e][c] - p) / 2.0f + 0.5f), 0, 127);
+                float d = fitted[e][c] - ((candidate[c] << 1) | p);
+                error += d * d;
+            }
+            if (error < bestError)
+            {
+                bestError = error;
+                pBits[e] = p;
+                for (int c = 0; c < 4; ++c)
+                    quantized[e][c] = candidate[c];
+            }
+        }
+        for (int c = 0; c < 4; ++c)
+            decoded[e][c] = (quantized[e][c] << 1) | pBits[e];
+    }
+
+    int indices[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        int bestError = INT32_MAX;
+        for (int w = 0; w < 16; ++w)
+        {
+            int error = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                int value = ((64 - weights[w]) * decoded[0][c] + weights[w] * decoded[1][c] + 32) >> 6;
+                int d = texels[i * 4 + c] - value;
+                error += d * d;
+            }
+            if (error < bestError)
+            {
+                bestError = error;
+                indices[i] = w;
+            }
+        }
+    }
+
+    // The first index is stored without its top bit, so flip the endpoints if it is set
+    if (indices[0] & 8)
+    {
+        for (int c = 0; c < 4; ++c)
+            std::swap(quantized[0][c], quantized[1][c]);
+        std::swap(pBits[0], pBits[1]);
+        for (int& index : indices)
+            index = 15 - index;
+    }
+
+    memset(out, 0, 16);
+    int bit = 0;
+    auto write = [&out, &bit](uint32_t value, int count) {
+        for (int i = 0; i < count; ++i, ++bit)
+            out[bit >> 3] |= ((value >> i) & 1) << (bit & 7);
+    };
+
+    write(1 << 6, 7);   // Mode 6 is six zero bits and a one
+    for (int c = 0; c < 4; ++c)
+    {
+        write(quantized[0][c], 7);
+        write(quantized[1][c], 7);
+    }
+    write(pBits[0], 1);
+    write(pBits[1], 1);
+    write(indices[0], 3);
+    for (int i = 1; i < 16; ++i)
+        write(indices[i], 4);
+}
+
+// 64-bit FNV-1a, stable across runs and platforms so it can key files on disk
+uint64_t UHashBytes(const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+// Cache file for a source image: its file name under TEXTURE_CACHE_DIR
+std::string UTextureCachePath(const char* filename)
+{
+    std::string name = filename;
+    size_t slash = name.find_last_of("/\\");
+    if (slash != std::string::npos)
+        name.erase(0, slash + 1);
+    return std::string(TEXTURE_CACHE_DIR) + "/" + name + ".bct";
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Reads a cached mip chain into load.levels. Misses when the file is absent or was built
+// from a different source image, format, size or encoder version
+bool UReadTextureCache(const std::string& path, uint64_t sourceHash, TextureLoad& load)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    TextureCacheHeader header;
+    file.read((char*)&header, sizeof(header));
+    if (!file || memcmp(header.magic, TEXTURE_CACHE_MAGIC, 4) != 0 || header.version != TEXTURE_CACHE_VERSION
+        || header.sourceHash != sourceHash || header.format != gTextureFormat || header.size != (uint32_t)TEXTURE_ARRAY_SIZE
+        || header.mipLevels != (uint32_t)gTextureMipLevels)
+        return false;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    load.levels.resize(header.mipLevels);
+    for (uint32_t level = 0, size = header.size; level < header.mipLevels; ++level, size = std::max(size / 2, 1u))
+    {
+        load.levels[level].resize(UTextureLevelBytes(gTextureFormat, (int)size));
+        file.read((char*)load.levels[level].data(), load.levels[level].size());
+    }
+
+    if (!file)
+    {
+        load.levels.clear();
+        return false;
+    }
+    return true;
 }
 
-// Free the memory used by our mesh VAO and VBOs
-void UDestroyMesh(GLMesh& mesh)
+// Writes load.levels to the cache, tagged with everything UReadTextureCache checks
+bool UWriteTextureCache(const std::string& path, uint64_t sourceHash, const TextureLoad& load)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(2, &mesh.vbo);
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+
+    TextureCacheHeader header;
+    memcpy(header.magic, TEXTURE_CACHE_MAGIC, 4);
+    header.version = TEXTURE_CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.format = gTextureFormat;
+    header.size = TEXTURE_ARRAY_SIZE;
+    header.mipLevels = (uint32_t)load.levels.size();
+    header.reserved = 0;
+    file.write((const char*)&header, sizeof(header));
+
+    for (const std::vector<unsigned char>& level : load.levels)
+        file.write((const char*)level.data(), level.size());
+    return (bool)file;
 }
 
-// Calls CreateTexture for each basic texture in the project
-void ULoadTextureSet() {
-    // Notex texture
-    const char* texFilenameNotex = "./resources/notexture.png";
-    if (!UCreateTexture(texFilenameNotex, gTextureIdNotex))
+// Maps a cooked asset pack read-only and checks it matches what this build expects. Meshes,
+// textures and scene objects come from the pack from here on; any problem leaves it closed
+// and everything is generated as usual
+bool UOpenAssetPack(const char* filename)
+{
+    auto start = std::chrono::steady_clock::now();
+    AssetPack& pack = gAssetPack;
+
+#ifdef _WIN32
+    pack.file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pack.file == INVALID_HANDLE_VALUE)
+    {
+        cout << "No asset pack at " << filename << ", generating assets" << endl;
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(pack.file, &fileSize);
+    pack.bytes = (size_t)fileSize.QuadPart;
+    pack.mapping = CreateFileMappingA(pack.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (pack.mapping)
+        pack.base = (const unsigned char*)MapViewOfFile(pack.mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        cout << "No asset pack at " << filename << ", generating assets" << endl;
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
     {
-        cout << "Failed to load texture " << texFilenameNotex << endl;
+        pack.bytes = (size_t)fileStat.st_size;
+        void* mapped = mmap(nullptr, pack.bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED)
+            pack.base = (const unsigned char*)mapped;
     }
+    close(fd);  // The mapping keeps the file alive
+#endif
 
-    // Flatwhite texture
-    const char* texFilenameWhite = "./resources/whitetexture.png";
-    if (!UCreateTexture(texFilenameWhite, gTextureIdWhite))
+    if (!pack.base)
     {
-        cout << "Failed to load texture " << texFilenameWhite << endl;
+        cout << "Failed to map asset pack " << filename << endl;
+        UCloseAssetPack();
+        return false;
     }
 
-    // Brick texture
-    const char* texFilenameBrick = "./resources/bricktexture.png";
-    if (!UCreateTexture(texFilenameBrick, gTextureIdBrick))
+    // Every offset and count gets checked once here so nothing later has to
+    const char* problem = nullptr;
+    const PackHeader* header = (const PackHeader*)pack.base;
+    auto fits = [&pack](uint64_t offset, uint64_t bytes) { return offset <= pack.bytes && bytes <= pack.bytes - offset; };
+    if (pack.bytes < sizeof(PackHeader) || memcmp(header->magic, ASSET_PACK_MAGIC, 4) != 0)
+        problem = "not an asset pack";
+    else if (header->version != ASSET_PACK_VERSION)
+        problem = "cooked by a different version, re-run AssetCooker";
+    else if (header->fileBytes != pack.bytes)
+        problem = "truncated";
+    else if (header->textureCount != (uint32_t)TEXTURE_LAYER_COUNT || header->textureSize != (uint32_t)TEXTURE_ARRAY_SIZE
+        || header->textureMipLevels != (uint32_t)UMipLevelCount(TEXTURE_ARRAY_SIZE))
+        problem = "texture layout does not match this build, re-run AssetCooker";
+    else if (!fits(header->meshTable, header->meshCount * sizeof(PackMesh))
+        || !fits(header->textureTable, header->textureCount * sizeof(PackTexture))
+        || !fits(header->objectTable, header->objectCount * sizeof(PackObject)))
+        problem = "table out of bounds";
+    else
     {
-        cout << "Failed to load texture " << texFilenameBrick << endl;
+        pack.header = header;
+        for (uint32_t i = 0; i < header->meshCount && !problem; ++i)
+        {
+            const PackMesh& mesh = UGetPackMeshes()[i];
+            GLsizeiptr indexSize = mesh.indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+            if (!fits(mesh.vertexOffset, (uint64_t)mesh.vertexCount * FLOATS_PER_VERTEX * sizeof(GLfloat))
+                || !fits(mesh.indexOffset, (uint64_t)mesh.indexCount * indexSize))
+                problem = "mesh out of bounds";
+        }
+        const PackTexture* textures = (const PackTexture*)(pack.base + header->textureTable);
+        for (uint32_t i = 0; i < header->textureCount && !problem; ++i)
+        {
+            if (textures[i].layer >= (uint32_t)TEXTURE_LAYER_COUNT || textures[i].bytes != UTextureChainBytes(header->textureFormat)
+                || !fits(textures[i].offset, textures[i].bytes))
+                problem = "texture out of bounds";
+        }
+        const PackObject* objects = (const PackObject*)(pack.base + header->objectTable);
+        for (uint32_t i = 0; i < header->objectCount && !problem; ++i)
+        {
+            if (objects[i].shape < 0 || objects[i].shape >= SHAPE_NAME_COUNT || objects[i].texture < 0
+                || objects[i].texture >= TEXTURE_NAME_COUNT || objects[i].parent < -1 || objects[i].parent >= (int64_t)i)
+                problem = "object with an unknown shape, texture or parent";
+        }
     }
 
-    // Concrete texture
-    const char* texFilenameConcrete = "./resources/concretetexture.png";
-    if (!UCreateTexture(texFilenameConcrete, gTextureIdConcrete))
+    if (problem)
     {
-        cout << "Failed to load texture " << texFilenameConcrete << endl;
+        cout << "Ignoring asset pack " << filename << ": " << problem << endl;
+        UCloseAssetPack();
+        return false;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "Asset pack: " << filename << " mapped in " << ms << " ms, " << header->meshCount << " meshes, "
+        << header->textureCount << " layers, " << header->objectCount << " objects, " << pack.bytes / 1024 << " KiB" << endl;
+    return true;
+}
+
+// Unmaps the asset pack. Nothing may still point into it
+void UCloseAssetPack()
+{
+    AssetPack& pack = gAssetPack;
+#ifdef _WIN32
+    if (pack.base)
+        UnmapViewOfFile(pack.base);
+    if (pack.mapping)
+        CloseHandle(pack.mapping);
+    if (pack.file != INVALID_HANDLE_VALUE)
+        CloseHandle(pack.file);
+#else
+    if (pack.base)
+        munmap((void*)pack.base, pack.bytes);
+#endif
+    pack = AssetPack();
+}
+
+const PackMesh* UGetPackMeshes()
+{
+    return (const PackMesh*)(gAssetPack.base + gAssetPack.header->meshTable);
+}
+
+// Index of key's mesh in the asset pack, -1 when there is no pack or it lacks the mesh
+int UFindPackedMesh(MeshKey key)
+{
+    if (!gAssetPack.header)
+        return -1;
+
+    for (uint32_t i = 0; i < gAssetPack.header->meshCount; ++i) {
+        const PackMesh& packed = UGetPackMeshes()[i];
+        if (packed.shape == (int32_t)key.shape && packed.detail == key.detail)
+            return (int)i;
     }
+    return -1;
+}
 
-    // Door texture
-    const char* texFilenameDoor= "./resources/doortexture.png";
-    if (!UCreateTexture(texFilenameDoor, gTextureIdDoor))
+// Replaces the built-in scene objects with the pack's object table
+void ULoadPackedSceneObjects()
+{
+    const PackObject* objects = (const PackObject*)(gAssetPack.base + gAssetPack.header->objectTable);
+    sceneObjects.resize(gAssetPack.header->objectCount);
+    for (uint32_t i = 0; i < gAssetPack.header->objectCount; ++i)
     {
-        cout << "Failed to load texture " << texFilenameDoor << endl;
+        GLObject& object = sceneObjects[i];
+        object.shape = (PrimitiveShape)objects[i].shape;
+        object.texture = (BasicTexture)objects[i].texture;
+        object.uvScale = objects[i].uvScale;
+        object.scale = objects[i].scale;
+        object.rotation = objects[i].rotation;
+        object.translation = objects[i].translation;
+        object.parent = objects[i].parent;
+        object.mesh = -1;
     }
+}
 
-    // Glass texture
-    const char* texFilenameGlass = "./resources/glasstexture.png";
-    if (!UCreateTexture(texFilenameGlass, gTextureIdGlass))
+// Uploads every layer's mip chain straight out of the mapped pack. Called with the texture
+// array bound and its storage allocated in the pack's format
+void UUploadPackedTextures()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    const PackTexture* textures = (const PackTexture*)(gAssetPack.base + gAssetPack.header->textureTable);
+    for (uint32_t i = 0; i < gAssetPack.header->textureCount; ++i)
     {
-        cout << "Failed to load texture " << texFilenameGlass << endl;
+        const unsigned char* data = gAssetPack.base + textures[i].offset;
+        for (int level = 0, size = TEXTURE_ARRAY_SIZE; level < gTextureMipLevels; ++level, size = std::max(size / 2, 1))
+        {
+            GLsizei levelBytes = UTextureLevelBytes(gTextureFormat, size);
+            if (gTextureFormat == GL_RGBA8)
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, textures[i].layer, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, data);
+            else
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, textures[i].layer, size, size, 1,
+                    gTextureFormat, levelBytes, data);
+            data += levelBytes;
+        }
     }
 
-    // Road texture
-    const char* texFilenameRoad = "./resources/roadtexture.png";
-    if (!UCreateTexture(texFilenameRoad, gTextureIdRoad))
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "Textures: " << gAssetPack.header->textureCount << " layers from the asset pack in " << ms << " ms" << endl;
+    cout << "Textures: " << UTextureFormatName(gTextureFormat) << ", "
+        << UTextureChainBytes(gTextureFormat) * TEXTURE_LAYER_COUNT / 1024 << " KiB resident" << endl;
+}
+
+// AssetCooker entry point. Generates every primitive mesh, loads every texture layer through
+// the same decode, compress and mip path the runtime uses, and writes them along with the
+// scene object table to one pack file
+bool UCookAssets(int argc, char* argv[])
+{
+    const char* filename = ASSET_PACK_FILE;
+    for (int i = 1; i < argc; ++i)
     {
-        cout << "Failed to load texture " << texFilenameRoad << endl;
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            filename = argv[++i];
+        else if (strcmp(argv[i], "--uncompressed-textures") == 0)
+            gCompressTextures = false;
+        else if (strcmp(argv[i], "--bc7") == 0)
+            gBc7Textures = true;
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+            gSceneFile = argv[++i];
+        else
+        {
+            cout << "Unknown argument " << argv[i] << endl;
+            cout << "Usage: " << argv[0] << " [--out file.pack] [--uncompressed-textures] [--bc7] [--scene file]" << endl;
+            return false;
+        }
     }
 
-    // Leaf texture
-    const char* texFilenameLeaf = "./resources/leaftexture.png";
-    if (!UCreateTexture(texFilenameLeaf, gTextureIdLeaf))
+    auto start = std::chrono::steady_clock::now();
+    UStartThreadPool(std::max(1, (int)std::thread::hardware_concurrency()));
+
+    // The object table comes from a scene file when given, the built-in objects otherwise
+    if (gSceneFile && !ULoadSceneFile(gSceneFile))
     {
-        cout << "Failed to load texture " << texFilenameLeaf << endl;
+        UStopThreadPool();
+        return false;
     }
 
-    // Bark texture
-    const char* texFilenameBark = "./resources/barktexture.png";
-    if (!UCreateTexture(texFilenameBark, gTextureIdBark))
+    std::vector<MeshKey> keys;
+    for (PrimitiveShape shape : { PrimitiveShape::CUBE, PrimitiveShape::PYRAMID, PrimitiveShape::PLANE, PrimitiveShape::CYLINDER })
+        for (int level = 0; level < ULodLevelCount(shape); ++level)
+            keys.push_back(ULodMeshKey(shape, level));
+    std::vector<MeshData> meshes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+        UGenerateMesh(keys[i], meshes[i]);
+
+    gTextureFormat = UChooseTextureFormat();
+    gTextureMipLevels = UMipLevelCount(TEXTURE_ARRAY_SIZE);
+    if (gTextureFormat != GL_RGBA8)
+        U_MKDIR(TEXTURE_CACHE_DIR);
+
+    // Stopping the pool waits for every queued decode
+    std::vector<TextureLoad> loads(TEXTURE_LAYER_COUNT);
+    for (int layer = 0; layer < TEXTURE_LAYER_COUNT; ++layer)
     {
-        cout << "Failed to load texture " << texFilenameBark << endl;
+        loads[layer].layer = layer;
+        loads[layer].filename = TEXTURE_FILES[layer];
+        TextureLoad* load = &loads[layer];
+        USubmitJob([load]() {
+            UDecodeTextureLayer(*load);
+            // The runtime leaves uncompressed mips to the GPU, the pack carries them
+            if (load->loaded && gTextureFormat == GL_RGBA8)
+            {
+                UBuildMipChain(load->pixels, TEXTURE_ARRAY_SIZE, gTextureMipLevels, load->levels);
+                load->pixels = std::vector<unsigned char>();
+            }
+        });
     }
+    UStopThreadPool();
 
-    // Metal texture
-    const char* texFilenameMetal = "./resources/metaltexture.png";
-    if (!UCreateTexture(texFilenameMetal, gTextureIdMetal))
+    for (const TextureLoad& load : loads)
     {
-        cout << "Failed to load texture " << texFilenameMetal << endl;
+        if (!load.loaded)
+        {
+            cout << "Failed to load texture " << load.filename << endl;
+            return false;
+        }
     }
-}
 
-// Generate and load the texture
-bool UCreateTexture(const char* filename, GLuint& textureId)
-{
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
     {
-        flipImageVertically(image, width, height, channels);
+        cout << "Failed to open " << filename << " for writing" << endl;
+        return false;
+    }
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    // Header goes in last, once every offset is known
+    PackHeader header = PackHeader();
+    file.write((const char*)&header, sizeof(header));
+
+    auto align = [&file]() {
+        static const char padding[ASSET_PACK_ALIGNMENT] = {};
+        uint64_t offset = (uint64_t)file.tellp();
+        uint64_t aligned = (offset + ASSET_PACK_ALIGNMENT - 1) / ASSET_PACK_ALIGNMENT * ASSET_PACK_ALIGNMENT;
+        file.write(padding, aligned - offset);
+        return aligned;
+    };
+    auto writeBlob = [&file, &align](const void* data, size_t bytes) {
+        uint64_t offset = align();
+        file.write((const char*)data, bytes);
+        return offset;
+    };
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    std::vector<PackMesh> packMeshes(meshes.size());
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        std::vector<unsigned char> indexBytes;
+        PackMesh& packed = packMeshes[i];
+        packed.shape = (int32_t)keys[i].shape;
+        packed.detail = keys[i].detail;
+        packed.vertexCount = (uint32_t)(meshes[i].vertices.size() / FLOATS_PER_VERTEX);
+        packed.indexCount = (uint32_t)meshes[i].indices.size();
+        packed.indexType = UPackIndices(meshes[i].indices, indexBytes);
+        packed.reserved = 0;
+        packed.vertexOffset = writeBlob(meshes[i].vertices.data(), meshes[i].vertices.size() * sizeof(GLfloat));
+        packed.indexOffset = writeBlob(indexBytes.data(), indexBytes.size());
+    }
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
+    std::vector<PackTexture> packTextures(loads.size());
+    for (size_t i = 0; i < loads.size(); ++i)
+    {
+        packTextures[i].layer = (uint32_t)loads[i].layer;
+        packTextures[i].reserved = 0;
+        packTextures[i].offset = align();
+        packTextures[i].bytes = 0;
+        for (const std::vector<unsigned char>& level : loads[i].levels)
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            file.write((const char*)level.data(), level.size());
+            packTextures[i].bytes += level.size();
         }
+    }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+    std::vector<PackObject> packObjects(sceneObjects.size());
+    for (size_t i = 0; i < sceneObjects.size(); ++i)
+    {
+        packObjects[i].shape = (int32_t)sceneObjects[i].shape;
+        packObjects[i].texture = (int32_t)sceneObjects[i].texture;
+        packObjects[i].uvScale = sceneObjects[i].uvScale;
+        packObjects[i].scale = sceneObjects[i].scale;
+        packObjects[i].rotation = sceneObjects[i].rotation;
+        packObjects[i].translation = sceneObjects[i].translation;
+        packObjects[i].parent = sceneObjects[i].parent;
+    }
 
-        return true;
+    memcpy(header.magic, ASSET_PACK_MAGIC, 4);
+    header.version = ASSET_PACK_VERSION;
+    header.meshCount = (uint32_t)packMeshes.size();
+    header.textureCount = (uint32_t)packTextures.size();
+    header.objectCount = (uint32_t)packObjects.size();
+    header.textureFormat = gTextureFormat;
+    header.textureSize = TEXTURE_ARRAY_SIZE;
+    header.textureMipLevels = (uint32_t)gTextureMipLevels;
+    header.meshTable = writeBlob(packMeshes.data(), packMeshes.size() * sizeof(PackMesh));
+    header.textureTable = writeBlob(packTextures.data(), packTextures.size() * sizeof(PackTexture));
+    header.objectTable = writeBlob(packObjects.data(), packObjects.size() * sizeof(PackObject));
+    header.fileBytes = align();
+    file.seekp(0);
+    file.write((const char*)&header, sizeof(header));
+
+    if (!file)
+    {
+        cout << "Failed to write " << filename << endl;
+        return false;
     }
 
-    // Error loading the image
-    return false;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "Cooked " << filename << " in " << ms << " ms: " << header.meshCount << " meshes, " << header.textureCount
+        << " " << UTextureFormatName(gTextureFormat) << " layers, " << header.objectCount << " objects, "
+        << header.fileBytes / 1024 << " KiB" << endl;
+    return true;
 }
 
 void UDestroyTexture(GLuint textureId)
 {
-    glGenTextures(1, &textureId);
+    glDeleteTextures(1, &textureId);
 }
 
 float UGetBasicTexSpecIntensity(BasicTexture basicTex) {
@@ -1250,69 +8427,566 @@ float UGetBasicTexSpecIntensity(BasicTexture basicTex) {
 }
 
 // Creates Vertex and Fragment shaders and combines them into a shader program
-// bound to the handle programId
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// bound to the handle programId, with defines placed after each source's #version line.
+// A binary from the program cache is used when there is one. Otherwise the compile and
+// link are issued, and with parallel compiles left to finish on the driver's threads: the
+// caller completes the program with UFinishShaderProgram once UShaderProgramCompiled says
+// so. Either way the program is ready when pending has no shaders left
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, const std::string& defines,
+    ShaderProgram& program, PendingProgram& pending)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+    GLuint& programId = program.id;
+    const std::string vertexSource = UInjectShaderDefines(vtxShaderSource, defines);
+    const std::string fragmentSource = UInjectShaderDefines(fragShaderSource, defines);
+    const char* vertexText = vertexSource.c_str();
+    const char* fragmentText = fragmentSource.c_str();
 
     // Create a Shader program object.
     programId = glCreateProgram();
 
+    pending.cacheKey = UProgramCacheKey(vertexSource + fragmentSource);
+    if (UReadProgramCache(pending.cacheKey, programId))
+    {
+        UReflectShaderProgram(program);
+        glUseProgram(programId);
+        return true;
+    }
+
     // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+    pending.vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
+    pending.fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
 
     // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+    glShaderSource(pending.vertexShaderId, 1, &vertexText, NULL);
+    glShaderSource(pending.fragmentShaderId, 1, &fragmentText, NULL);
+
+    // Compile both and link, errors are only checked in UFinishShaderProgram
+    glCompileShader(pending.vertexShaderId);
+    glCompileShader(pending.fragmentShaderId);
+    glAttachShader(programId, pending.vertexShaderId);
+    glAttachShader(programId, pending.fragmentShaderId);
+    glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(programId);
+
+    if (gProgramCache.parallelCompile)
+        return true;
+    return UFinishShaderProgram(program, pending);
+}
+
+// Prints compilation and linkage errors for a program UCreateShaderProgram issued, then
+// caches and reflects it. Waits for the driver if it hasn't finished yet
+bool UFinishShaderProgram(ShaderProgram& program, PendingProgram& pending)
+{
+    GLuint programId = program.id;
+
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+    bool built = true;
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
     // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
+    glGetShaderiv(pending.vertexShaderId, GL_COMPILE_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
+        glGetShaderInfoLog(pending.vertexShaderId, sizeof(infoLog), NULL, infoLog);
         std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-
-        return false;
+        built = false;
     }
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
+    glGetShaderiv(pending.fragmentShaderId, GL_COMPILE_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
+        glGetShaderInfoLog(pending.fragmentShaderId, sizeof(infoLog), NULL, infoLog);
         std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        built = false;
+    }
+
+    // check for linking errors, a failed compile fails the link as well
+    if (built)
+    {
+        glGetProgramiv(programId, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+            built = false;
+        }
+    }
+
+    // The shaders are owned by the program now
+    glDeleteShader(pending.vertexShaderId);
+    glDeleteShader(pending.fragmentShaderId);
+    uint64_t cacheKey = pending.cacheKey;
+    pending = PendingProgram();
+    if (!built)
+        return false;
+
+    UWriteProgramCache(cacheKey, programId);
+    UReflectShaderProgram(program);
+
+    glUseProgram(programId);    // Uses the shader program
+
+    return true;
+}
+
+// Whether the driver is done with a program's compile and link, so checking it won't block.
+// Always true without parallel compiles, the link has finished by then
+bool UShaderProgramCompiled(const ShaderProgram& program)
+{
+    if (!gProgramCache.parallelCompile)
+        return true;
+
+    GLint done = 0;
+    glGetProgramiv(program.id, GL_COMPLETION_STATUS_KHR, &done);
+    return done != 0;
+}
+
+// Turns the program cache on when the driver can hand out binaries, and compiles over to
+// the driver's own threads when it has GL_KHR_parallel_shader_compile
+void UInitProgramCache()
+{
+    ProgramCache& cache = gProgramCache;
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    cache.enabled = cache.enabled && formats > 0;
+    if (cache.enabled)
+        U_MKDIR(PROGRAM_CACHE_DIR);
+
+    // A binary is only good for the exact driver and GPU that made it
+    cache.driver = std::string((const char*)glGetString(GL_VENDOR)) + "\n" + (const char*)glGetString(GL_RENDERER)
+        + "\n" + (const char*)glGetString(GL_VERSION);
+
+    cache.parallelCompile = cache.parallelCompile && GLEW_KHR_parallel_shader_compile;
+    if (cache.parallelCompile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);    // As many as the driver likes
+
+    cout << "Program cache " << (cache.enabled ? "on" : "off") << ", shaders compile "
+        << (cache.parallelCompile ? "in parallel" : "serially") << endl;
+}
+
+// Cache key for a program: its full sources, defines included, and the driver strings
+uint64_t UProgramCacheKey(const std::string& sources)
+{
+    const std::string keyed = sources + "\n" + gProgramCache.driver;
+    return UHashBytes(keyed.data(), keyed.size());
+}
+
+// Cache file for a program key under PROGRAM_CACHE_DIR
+std::string UProgramCachePath(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return std::string(PROGRAM_CACHE_DIR) + "/" + name;
+}
+
+// Loads a cached binary into programId. Misses when there is no file for the key or the
+// driver turns the binary down, which leaves programId free for a build from source
+bool UReadProgramCache(uint64_t key, GLuint programId)
+{
+    ProgramCache& cache = gProgramCache;
+    if (!cache.enabled)
+        return false;
+
+    std::ifstream file(UProgramCachePath(key), std::ios::binary);
+    ProgramCacheHeader header;
+    std::vector<char> binary;
+    if (file)
+    {
+        file.read((char*)&header, sizeof(header));
+        if (file && memcmp(header.magic, PROGRAM_CACHE_MAGIC, 4) == 0 && header.version == PROGRAM_CACHE_VERSION
+            && header.key == key)
+        {
+            binary.resize(header.size);
+            file.read(binary.data(), binary.size());
+        }
+    }
+
+    GLint linked = 0;
+    if (file && !binary.empty())
+    {
+        glProgramBinary(programId, header.format, binary.data(), (GLsizei)binary.size());
+        glGetProgramiv(programId, GL_LINK_STATUS, &linked);
+    }
+    if (linked)
+        ++cache.hits;
+    else
+        ++cache.misses;
+    return linked != 0;
+}
+
+// Saves a freshly linked program's binary under its key
+bool UWriteProgramCache(uint64_t key, GLuint programId)
+{
+    ProgramCache& cache = gProgramCache;
+    if (!cache.enabled)
+        return false;
+
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return false;
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(programId, length, &written, &format, binary.data());
 
+    std::ofstream file(UProgramCachePath(key), std::ios::binary);
+    if (!file)
         return false;
+
+    ProgramCacheHeader header;
+    memcpy(header.magic, PROGRAM_CACHE_MAGIC, 4);
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+    header.format = format;
+    header.size = (uint32_t)written;
+    file.write((const char*)&header, sizeof(header));
+    file.write(binary.data(), written);
+    if (file)
+        ++cache.writes;
+    return (bool)file;
+}
+
+// Compiles and links a single compute shader into a program, same reporting as above
+bool UCreateComputeProgram(const char* computeShaderSource, ShaderProgram& program)
+{
+    int success = 0;
+    char infoLog[512];
+
+    program.id = glCreateProgram();
+    const uint64_t cacheKey = UProgramCacheKey(computeShaderSource);
+    if (UReadProgramCache(cacheKey, program.id))
+    {
+        UReflectShaderProgram(program);
+        return true;
     }
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
+    GLuint computeShaderId = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(computeShaderId, 1, &computeShaderSource, NULL);
+
+    glCompileShader(computeShaderId);
+    glGetShaderiv(computeShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(computeShaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
 
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    glAttachShader(program.id, computeShaderId);
+    glProgramParameteri(program.id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program.id);
+    glGetProgramiv(program.id, GL_LINK_STATUS, &success);
     if (!success)
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        glGetProgramInfoLog(program.id, sizeof(infoLog), NULL, infoLog);
         std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
 
         return false;
     }
 
-    glUseProgram(programId);    // Uses the shader program
+    glDeleteShader(computeShaderId);
+
+    UWriteProgramCache(cacheKey, program.id);
+    UReflectShaderProgram(program);
 
     return true;
 }
 
-// Free the memory used by the shader program at handle programId
-void UDestroyShaderProgram(GLuint programId)
+// Records every active uniform and uniform block of a freshly linked program
+void UReflectShaderProgram(ShaderProgram& program)
+{
+    char name[256];
+
+    GLint uniformCount = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &uniformCount);
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(program.id, (GLuint)i, sizeof(name), NULL, &size, &type, name);
+
+        // Block members have no location of their own and are skipped here
+        GLint location = glGetUniformLocation(program.id, name);
+        if (location < 0)
+            continue;
+
+        // Arrays are reported as "name[0]", we want to look them up by their plain name
+        std::string uniformName = name;
+        size_t bracket = uniformName.find('[');
+        if (bracket != std::string::npos)
+            uniformName.erase(bracket);
+        program.uniforms[uniformName] = location;
+    }
+
+    GLint blockCount = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+    for (GLint i = 0; i < blockCount; ++i)
+    {
+        glGetActiveUniformBlockName(program.id, (GLuint)i, sizeof(name), NULL, name);
+        program.uniformBlocks[name] = (GLuint)i;
+    }
+
+    // Point the frame constants at the shared uniform buffer
+    auto frameBlock = program.uniformBlocks.find("FrameData");
+    if (frameBlock != program.uniformBlocks.end())
+        glUniformBlockBinding(program.id, frameBlock->second, FRAME_DATA_BINDING);
+
+    program.modelLoc = program.Uniform("model");
+    program.normalMatrixLoc = program.Uniform("normalMatrix");
+    program.uvScaleLoc = program.Uniform("uvScale");
+    program.specIntensityLoc = program.Uniform("specularIntensity");
+    program.textureLayerLoc = program.Uniform("textureLayer");
+    program.instancedLoc = program.Uniform("instanced");
+    program.multiDrawLoc = program.Uniform("multiDraw");
+    program.gpuCulledLoc = program.Uniform("gpuCulled");
+}
+
+// Free the memory used by the shader program
+void UDestroyShaderProgram(ShaderProgram& program)
+{
+    glDeleteProgram(program.id);
+    program.id = 0;
+    program.uniforms.clear();
+    program.uniformBlocks.clear();
+}
+
+// The GLSL macro can't carry preprocessor lines, so defines go in after the #version line
+std::string UInjectShaderDefines(const char* source, const std::string& defines)
+{
+    std::string text(source);
+    size_t lineEnd = text.find('\n');
+    text.insert(lineEnd == std::string::npos ? text.size() : lineEnd + 1, defines);
+    return text;
+}
+
+// The defines that switch a variant's features on or off, plus the unbounded light count
+// so their loop has a constant trip count
+std::string UShaderVariantDefines(unsigned features)
+{
+    std::ostringstream defines;
+    defines << "#define USE_TEXTURE " << ((features & SHADER_TEXTURED) ? 1 : 0) << "\n"
+        << "#define USE_UV_SCALE " << ((features & SHADER_UV_SCALE) ? 1 : 0) << "\n"
+        << "#define USE_SPECULAR " << ((features & SHADER_SPECULAR) ? 1 : 0) << "\n"
+        << "#define USE_CLUSTERED_LIGHTS " << ((features & SHADER_CLUSTERED_LIGHTS) ? 1 : 0) << "\n"
+        << "#define UNBOUNDED_LIGHT_COUNT " << UNBOUNDED_LIGHTS << "\n";
+    return defines.str();
+}
+
+// Starts building a variant unless it already is. A program cache hit, or a driver without
+// parallel compiles, leaves it settled straight away
+void URequestShaderVariant(unsigned features)
+{
+    ShaderVariants& variants = gShaderVariants;
+    if (variants.state[features] != VARIANT_UNBUILT)
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+    variants.state[features] = VARIANT_COMPILING;
+    ++variants.compiling;
+
+    const int cacheHits = gProgramCache.hits;
+    bool issued = UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, UShaderVariantDefines(features),
+        variants.programs[features], variants.pending[features]);
+    variants.compileMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (gProgramCache.hits != cacheHits)
+        ++variants.cached;
+    if (!issued || variants.pending[features].vertexShaderId == 0)
+        USettleShaderVariant(features, issued);
+}
+
+// Settles a compiling variant once the driver is done with it, or right away when waiting
+void UPollShaderVariant(unsigned features, bool wait)
+{
+    ShaderVariants& variants = gShaderVariants;
+    if (variants.state[features] != VARIANT_COMPILING || (!wait && !UShaderProgramCompiled(variants.programs[features])))
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+    bool linked = UFinishShaderProgram(variants.programs[features], variants.pending[features]);
+    variants.compileMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    USettleShaderVariant(features, linked);
+}
+
+// Marks a variant ready or failed, and reports once the startup compiles are all in
+void USettleShaderVariant(unsigned features, bool linked)
+{
+    ShaderVariants& variants = gShaderVariants;
+    ShaderProgram& program = variants.programs[features];
+    if (linked) {
+        // Texture unit 0, the program was left bound
+        glUniform1i(program.Uniform("uTexture"), 0);
+        variants.state[features] = VARIANT_READY;
+        ++variants.ready;
+    }
+    else {
+        cout << "Shader variant " << features << " failed to build" << endl;
+        UDestroyShaderProgram(program);
+        variants.state[features] = VARIANT_FAILED;
+
+        // Nothing can stand in for the variant with every feature
+        if (features == SHADER_ALL_FEATURES && gWindow)
+            glfwSetWindowShouldClose(gWindow, true);
+    }
+
+    if (--variants.compiling == 0 && variants.reportBatch)
+        UReportShaderVariantBatch();
+}
+
+// Prints how long the startup variants took to be ready
+void UReportShaderVariantBatch()
+{
+    ShaderVariants& variants = gShaderVariants;
+    variants.reportBatch = false;
+    cout << "Shader variants: " << variants.ready << " ready " << std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - variants.batchStart).count() << " ms after they were requested, "
+        << variants.cached << " from the program cache" << endl;
+}
+
+// Settles every variant the driver has finished, or every one in flight when waiting
+void UPollShaderVariants(bool wait)
+{
+    if (gShaderVariants.compiling == 0)
+        return;
+    for (unsigned features = 0; features < SHADER_VARIANT_COUNT; ++features)
+        UPollShaderVariant(features, wait);
+}
+
+// Requests the variant each scene object will draw with, plus the one with every feature
+// that stands in for the rest, so their compiles run before the first frame needs them
+void UPrewarmShaderVariants()
+{
+    gShaderVariants.batchStart = std::chrono::steady_clock::now();
+    URequestShaderVariant(SHADER_ALL_FEATURES);
+    if (gGpuCulling)
+        URequestShaderVariant(SHADER_TEXTURED | SHADER_UV_SCALE | SHADER_SPECULAR | USceneShaderFeatures());
+    for (const GLObject& object : sceneObjects)
+        URequestShaderVariant(UShaderFeatures(object));
+
+    // Cache hits are ready already, anything compiling reports when it's in
+    if (gShaderVariants.compiling == 0)
+        UReportShaderVariantBatch();
+    else
+        gShaderVariants.reportBatch = true;
+}
+
+// The program to draw a variant with this frame: the variant itself once it has compiled,
+// until then the ready variant with the fewest extra features, which draws the same picture.
+// Null when nothing that could stand in has compiled yet
+const ShaderProgram* UGetShaderVariant(unsigned features)
+{
+    ShaderVariants& variants = gShaderVariants;
+    URequestShaderVariant(features);
+    UPollShaderVariant(features, false);
+    if (variants.state[features] == VARIANT_READY)
+        return &variants.programs[features];
+
+    const ShaderProgram* standIn = nullptr;
+    int fewestFeatures = 32;
+    for (unsigned other = 0; other < SHADER_VARIANT_COUNT; ++other) {
+        if ((other & features) != features || variants.state[other] != VARIANT_READY)
+            continue;
+        int featureCount = 0;
+        for (unsigned bits = other; bits != 0; bits &= bits - 1)
+            ++featureCount;
+        if (featureCount < fewestFeatures) {
+            fewestFeatures = featureCount;
+            standIn = &variants.programs[other];
+        }
+    }
+    return standIn;
+}
+
+// Binds a variant and points its vertex shader at where this path keeps the object data.
+// Null when nothing can draw the variant yet
+const ShaderProgram* UUseShaderVariant(unsigned features, DrawSource source)
+{
+    const ShaderProgram* program = UGetShaderVariant(features);
+    if (!program)
+        return nullptr;
+    glUseProgram(program->id);
+    glUniform1i(program->instancedLoc, source == DRAW_SOURCE_INSTANCES);
+    glUniform1i(program->multiDrawLoc, source == DRAW_SOURCE_RECORDS || source == DRAW_SOURCE_CULLED_RECORDS);
+    glUniform1i(program->gpuCulledLoc, source == DRAW_SOURCE_CULLED_RECORDS);
+    return program;
+}
+
+// Tallies objects drawn with a variant, and those a stand-in drew or nothing could
+void UCountShaderVariantDraws(unsigned features, const ShaderProgram* program, int objects)
+{
+    ShaderVariants& variants = gShaderVariants;
+    variants.draws[features] += objects;
+    if (!program)
+        variants.skippedDraws += objects;
+    else if (program != &variants.programs[features])
+        variants.standInDraws += objects;
+}
+
+// The cheapest variant that still draws the object exactly as the full shader would. The
+// flat white texture samples as 1.0, so skipping it changes nothing
+unsigned UShaderFeatures(const GLObject& object)
+{
+    if (!gShaderVariantSelection)
+        return SHADER_ALL_FEATURES;
+
+    unsigned features = USceneShaderFeatures();
+    if (object.texture != BasicTexture::FLATWHITE) {
+        features |= SHADER_TEXTURED;
+        if (object.uvScale.x != 1.0f || object.uvScale.y != 1.0f)
+            features |= SHADER_UV_SCALE;
+    }
+    if (UGetBasicTexSpecIntensity(object.texture) != 0.0f)
+        features |= SHADER_SPECULAR;
+    return features;
+}
+
+// Features every object needs for the scene's lighting: only with --lights is there
+// anything in the clusters
+unsigned USceneShaderFeatures()
+{
+    if (!gShaderVariantSelection || gLighting.lights.size() > UNBOUNDED_LIGHTS)
+        return SHADER_CLUSTERED_LIGHTS;
+    return 0;
+}
+
+// Free every variant, along with the shaders of any still compiling
+void UDestroyShaderVariants()
 {
-    glDeleteProgram(programId);
-}
\ No newline at end of file
+    ShaderVariants& variants = gShaderVariants;
+    for (unsigned features = 0; features < SHADER_VARIANT_COUNT; ++features) {
+        glDeleteShader(variants.pending[features].vertexShaderId);
+        glDeleteShader(variants.pending[features].fragmentShaderId);
+        if (variants.programs[features].id != 0)
+            UDestroyShaderProgram(variants.programs[features]);
+    }
+    variants = ShaderVariants();
+}
+
+// Prints the program cache's hits, how many variants were built, what that cost and how many
+// objects each drew last frame
+void UPrintShaderVariantStats()
+{
+    const ShaderVariants& variants = gShaderVariants;
+    const ProgramCache& cache = gProgramCache;
+    cout << "Program cache: " << (cache.enabled ? "" : "off, ") << cache.hits << " hits, " << cache.misses << " misses, "
+        << cache.writes << " written; shaders compiled " << (cache.parallelCompile ? "in parallel" : "serially") << endl;
+    cout << "Shader variants: " << variants.ready << " of " << SHADER_VARIANT_COUNT << " ready, " << variants.compileMs
+        << " ms on the main thread" << (gShaderVariantSelection ? "" : " (--no-shader-variants)") << ", "
+        << variants.standInDraws << " objects drawn by a stand-in and " << variants.skippedDraws << " skipped while compiling";
+    if (gGpuCulling) {
+        cout << ", GPU culled draws use every material feature" << endl;
+        return;
+    }
+    cout << ". Objects drawn last frame:";
+    for (unsigned features = 0; features < SHADER_VARIANT_COUNT; ++features) {
+        if (variants.draws[features] == 0)
+            continue;
+        cout << " " << ((features & SHADER_TEXTURED) ? "T" : "-") << ((features & SHADER_UV_SCALE) ? "U" : "-")
+            << ((features & SHADER_SPECULAR) ? "S" : "-") << ((features & SHADER_CLUSTERED_LIGHTS) ? "C" : "-")
+            << " " << variants.draws[features];
+    }
+    cout << " (Textured, Uv scale, Specular, Clustered lights)" << endl;
+}